@@ -193,6 +193,8 @@ static bool tb_lookup_cmp(const void *p, const void *d)
 
 static TranslationBlock *tb_htable_lookup(CPUState *cpu, TCGTBCPUState s)
 {
+    TBExecStats *stats = &cpu->tb_jmp_cache->stats;
+    TranslationBlock *tb;
     tb_page_addr_t phys_pc;
     struct tb_desc desc;
     uint32_t h;
@@ -201,12 +203,15 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu, TCGTBCPUState s)
     desc.env = cpu_env(cpu);
     phys_pc = get_page_addr_code(desc.env, s.pc);
     if (phys_pc == -1) {
+        tb_exec_stat_inc(&stats->htable_miss);
         return NULL;
     }
     desc.page_addr0 = phys_pc;
     h = tb_hash_func(phys_pc, (s.cflags & CF_PCREL ? 0 : s.pc),
                      s.flags, s.cs_base, s.cflags);
-    return qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_cmp);
+    tb = qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_cmp);
+    tb_exec_stat_inc(tb ? &stats->htable_hit : &stats->htable_miss);
+    return tb;
 }
 
 /**
@@ -241,9 +246,11 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, TCGTBCPUState s)
                tb->cs_base == s.cs_base &&
                tb->flags == s.flags &&
                tb_cflags(tb) == s.cflags)) {
+        tb_exec_stat_inc(&jc->stats.jc_hit);
         goto hit;
     }
 
+    tb_exec_stat_inc(&jc->stats.jc_miss);
     tb = tb_htable_lookup(cpu, s);
     if (tb == NULL) {
         return NULL;
@@ -550,6 +557,8 @@ void cpu_exec_step_atomic(CPUState *cpu)
     TranslationBlock *tb;
     int tb_exit;
 
+    tb_exec_stat_inc(&cpu->tb_jmp_cache->stats.exclusive);
+
     if (sigsetjmp(cpu->jmp_env, 0) == 0) {
         start_exclusive();
         g_assert(cpu == current_cpu);
@@ -572,6 +581,7 @@ void cpu_exec_step_atomic(CPUState *cpu)
 
         tb = tb_lookup(cpu, s);
         if (tb == NULL) {
+            tb_exec_stat_inc(&cpu->tb_jmp_cache->stats.gen_code);
             mmap_lock();
             tb = tb_gen_code(cpu, s);
             mmap_unlock();
@@ -612,9 +622,10 @@ void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr)
     tb_target_set_jmp_target(c_tb, n, jmp_rx, jmp_rw);
 }
 
-static inline void tb_add_jump(TranslationBlock *tb, int n,
+static inline void tb_add_jump(CPUState *cpu, TranslationBlock *tb, int n,
                                TranslationBlock *tb_next)
 {
+    TBExecStats *stats = &cpu->tb_jmp_cache->stats;
     uintptr_t old;
 
     qemu_thread_jit_write();
@@ -641,12 +652,14 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
 
     qemu_spin_unlock(&tb_next->jmp_lock);
 
+    tb_exec_stat_inc(&stats->chain_patched);
     qemu_log_mask(CPU_LOG_EXEC, "Linking TBs %p index %d -> %p\n",
                   tb->tc.ptr, n, tb_next->tc.ptr);
     return;
 
  out_unlock_next:
     qemu_spin_unlock(&tb_next->jmp_lock);
+    tb_exec_stat_inc(&stats->chain_failed);
 }
 
 static inline bool cpu_handle_halt(CPUState *cpu)
@@ -868,13 +881,18 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
                                     vaddr pc, TranslationBlock **last_tb,
                                     int *tb_exit)
 {
+    TBExecStats *stats = &cpu->tb_jmp_cache->stats;
+
     trace_exec_tb(tb, pc);
     tb = cpu_tb_exec(cpu, tb, tb_exit);
     if (*tb_exit != TB_EXIT_REQUESTED) {
+        tb_exec_stat_inc(&stats->exit[tb ? TB_EXEC_EXIT_UNCHAINED
+                                         : TB_EXEC_EXIT_LOOKUP]);
         *last_tb = tb;
         return;
     }
 
+    tb_exec_stat_inc(&stats->exit[TB_EXEC_EXIT_REQUESTED]);
     *last_tb = NULL;
     if (cpu_loop_exit_requested(cpu)) {
         /* Something asked us to stop executing chained TBs; just
@@ -915,6 +933,7 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
 static int __attribute__((noinline))
 cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
 {
+    TBExecStats *stats = &cpu->tb_jmp_cache->stats;
     int ret;
 
     /* if an exception is pending, we execute it here */
@@ -922,9 +941,16 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
         TranslationBlock *last_tb = NULL;
         int tb_exit = 0;
 
-        while (!cpu_handle_interrupt(cpu, &last_tb)) {
+        while (true) {
             TranslationBlock *tb;
-            TCGTBCPUState s = cpu->cc->tcg_ops->get_tb_cpu_state(cpu);
+            TCGTBCPUState s;
+
+            if (cpu_handle_interrupt(cpu, &last_tb)) {
+                tb_exec_stat_inc(&stats->exit[TB_EXEC_EXIT_INTERRUPT]);
+                break;
+            }
+
+            s = cpu->cc->tcg_ops->get_tb_cpu_state(cpu);
             s.cflags = cpu->cflags_next_tb;
 
             /*
@@ -941,6 +967,7 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
             }
 
             if (check_for_breakpoints(cpu, s.pc, &s.cflags)) {
+                tb_exec_stat_inc(&stats->exit[TB_EXEC_EXIT_BREAKPOINT]);
                 break;
             }
 
@@ -949,6 +976,7 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
                 CPUJumpCache *jc;
                 uint32_t h;
 
+                tb_exec_stat_inc(&stats->gen_code);
                 mmap_lock();
                 tb = tb_gen_code(cpu, s);
                 mmap_unlock();
@@ -976,7 +1004,7 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
 #endif
             /* See if we can patch the calling TB. */
             if (last_tb) {
-                tb_add_jump(last_tb, tb_exit, tb);
+                tb_add_jump(cpu, last_tb, tb_exit, tb);
             }
 
             cpu_loop_exec_tb(cpu, tb, s.pc, &last_tb, &tb_exit);
@@ -993,7 +1021,10 @@ static int cpu_exec_setjmp(CPUState *cpu, SyncClocks *sc)
 {
     /* Prepare setjmp context for exception handling. */
     if (unlikely(sigsetjmp(cpu->jmp_env, 0) != 0)) {
+        TBExecStats *stats = &cpu->tb_jmp_cache->stats;
+
         cpu_exec_longjmp_cleanup(cpu);
+        tb_exec_stat_inc(&stats->exit[TB_EXEC_EXIT_EXCEPTION]);
     }
 
     return cpu_exec_loop(cpu, sc);
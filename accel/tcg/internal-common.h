@@ -13,6 +13,7 @@
 #include "exec/translation-block.h"
 #include "exec/mmap-lock.h"
 #include "accel/tcg/tb-cpu-state.h"
+#include "host/atomic-unaligned.h.inc"
 
 extern int64_t max_delay;
 extern int64_t max_advance;
@@ -136,6 +137,30 @@ void page_table_config_init(void);
 G_NORETURN void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 #endif /* CONFIG_USER_ONLY */
 
+/**
+ * host_atomic_unaligned_ok:
+ * @haddr: host address of the operand
+ * @size: size of the operand in bytes
+ *
+ * Return true if an atomic read-modify-write of the misaligned operand
+ * at @haddr may be performed directly with host atomic operations,
+ * instead of stopping the world.  x86 hosts perform lock-prefixed
+ * operations on misaligned operands atomically; only operands that
+ * split a cache line require a bus lock, which is very slow and may be
+ * disabled by the host kernel.  CMPXCHG16B requires alignment.
+ *
+ * The operation must then go through the host_atomic_* helpers of
+ * host/atomic-unaligned.h.inc, not through the __atomic builtins.
+ */
+static inline bool host_atomic_unaligned_ok(uintptr_t haddr, int size)
+{
+#ifdef HAVE_HOST_ATOMIC_UNALIGNED
+    return size <= 8 && (haddr & 63) + size <= 64;
+#else
+    return false;
+#endif
+}
+
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr);
 
@@ -15,10 +15,12 @@
 #include "monitor/monitor.h"
 #include "system/cpu-timers.h"
 #include "exec/icount.h"
+#include "system/stats.h"
 #include "system/tcg.h"
 #include "tcg/tcg.h"
 #include "internal-common.h"
 #include "tb-context.h"
+#include "tb-jmp-cache.h"
 
 
 static void dump_drift_info(GString *buf)
@@ -141,6 +143,85 @@ static void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
     *pelide = elide;
 }
 
+static const struct {
+    const char *name;
+    size_t offset;
+} tb_exec_stats_desc[] = {
+    { "jmp-cache-hits", offsetof(TBExecStats, jc_hit) },
+    { "jmp-cache-misses", offsetof(TBExecStats, jc_miss) },
+    { "htable-hits", offsetof(TBExecStats, htable_hit) },
+    { "htable-misses", offsetof(TBExecStats, htable_miss) },
+    { "tb-gen-code", offsetof(TBExecStats, gen_code) },
+    { "exclusive-steps", offsetof(TBExecStats, exclusive) },
+    { "chain-patched", offsetof(TBExecStats, chain_patched) },
+    { "chain-failed", offsetof(TBExecStats, chain_failed) },
+    { "exit-unchained",
+      offsetof(TBExecStats, exit[TB_EXEC_EXIT_UNCHAINED]) },
+    { "exit-lookup", offsetof(TBExecStats, exit[TB_EXEC_EXIT_LOOKUP]) },
+    { "exit-requested",
+      offsetof(TBExecStats, exit[TB_EXEC_EXIT_REQUESTED]) },
+    { "exit-interrupt",
+      offsetof(TBExecStats, exit[TB_EXEC_EXIT_INTERRUPT]) },
+    { "exit-breakpoint",
+      offsetof(TBExecStats, exit[TB_EXEC_EXIT_BREAKPOINT]) },
+    { "exit-exception",
+      offsetof(TBExecStats, exit[TB_EXEC_EXIT_EXCEPTION]) },
+};
+
+static size_t tb_exec_stats_read(CPUState *cpu, size_t offset)
+{
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+
+    if (!jc) {
+        return 0;
+    }
+    return qatomic_read((size_t *)((void *)&jc->stats + offset));
+}
+
+static void tb_exec_stats_sum(TBExecStats *sum)
+{
+    CPUState *cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    CPU_FOREACH(cpu) {
+        for (int i = 0; i < ARRAY_SIZE(tb_exec_stats_desc); i++) {
+            size_t off = tb_exec_stats_desc[i].offset;
+            *(size_t *)((void *)sum + off) += tb_exec_stats_read(cpu, off);
+        }
+    }
+}
+
+static void dump_exec_loop_info(GString *buf)
+{
+    TBExecStats st;
+    size_t lookups;
+
+    tb_exec_stats_sum(&st);
+    lookups = st.jc_hit + st.jc_miss;
+
+    g_string_append_printf(buf, "\nExecution loop:\n");
+    g_string_append_printf(buf, "jmp cache lookups   %zu (%0.2f%% hits)\n",
+                           lookups,
+                           lookups ? (double)st.jc_hit / lookups * 100 : 0);
+    g_string_append_printf(buf, "TB hash lookups     %zu (%zu misses)\n",
+                           st.htable_hit + st.htable_miss, st.htable_miss);
+    g_string_append_printf(buf, "TB gen_code calls   %zu\n", st.gen_code);
+    g_string_append_printf(buf, "exclusive steps     %zu\n", st.exclusive);
+    g_string_append_printf(buf, "TB chaining         %zu patched, "
+                           "%zu failed\n",
+                           st.chain_patched, st.chain_failed);
+    g_string_append_printf(buf, "loop exits          unchained=%zu "
+                           "lookup=%zu requested=%zu\n",
+                           st.exit[TB_EXEC_EXIT_UNCHAINED],
+                           st.exit[TB_EXEC_EXIT_LOOKUP],
+                           st.exit[TB_EXEC_EXIT_REQUESTED]);
+    g_string_append_printf(buf, "                    interrupt=%zu "
+                           "breakpoint=%zu exception=%zu\n",
+                           st.exit[TB_EXEC_EXIT_INTERRUPT],
+                           st.exit[TB_EXEC_EXIT_BREAKPOINT],
+                           st.exit[TB_EXEC_EXIT_EXCEPTION]);
+}
+
 static void tcg_dump_info(GString *buf)
 {
     g_string_append_printf(buf, "[TCG profiler not compiled]\n");
@@ -196,6 +277,7 @@ static void dump_exec_info(GString *buf)
     g_string_append_printf(buf, "TLB full flushes    %zu\n", flush_full);
     g_string_append_printf(buf, "TLB partial flushes %zu\n", flush_part);
     g_string_append_printf(buf, "TLB elided flushes  %zu\n", flush_elide);
+    dump_exec_loop_info(buf);
     tcg_dump_info(buf);
 }
 
@@ -235,10 +317,77 @@ HumanReadableText *qmp_x_query_opcount(Error **errp)
     return human_readable_text_from_str(buf);
 }
 
+static void tcg_query_stats_vcpu(StatsResultList **result, CPUState *cpu,
+                                 strList *names)
+{
+    StatsList *stats_list = NULL;
+
+    for (int i = 0; i < ARRAY_SIZE(tb_exec_stats_desc); i++) {
+        Stats *stats;
+
+        if (!apply_str_list_filter(tb_exec_stats_desc[i].name, names)) {
+            continue;
+        }
+        stats = g_new0(Stats, 1);
+        stats->name = g_strdup(tb_exec_stats_desc[i].name);
+        stats->value = g_new0(StatsValue, 1);
+        stats->value->type = QTYPE_QNUM;
+        stats->value->u.scalar =
+            tb_exec_stats_read(cpu, tb_exec_stats_desc[i].offset);
+        QAPI_LIST_PREPEND(stats_list, stats);
+    }
+
+    if (stats_list) {
+        add_stats_entry(result, STATS_PROVIDER_TCG,
+                        cpu->parent_obj.canonical_path, stats_list);
+    }
+}
+
+static void tcg_query_stats_cb(StatsResultList **result, StatsTarget target,
+                               strList *names, strList *targets,
+                               Error **errp)
+{
+    CPUState *cpu;
+
+    if (!tcg_enabled() || target != STATS_TARGET_VCPU) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        if (!apply_str_list_filter(cpu->parent_obj.canonical_path, targets)) {
+            continue;
+        }
+        tcg_query_stats_vcpu(result, cpu, names);
+    }
+}
+
+static void tcg_query_stats_schemas_cb(StatsSchemaList **result,
+                                       Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+
+    if (!tcg_enabled()) {
+        return;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(tb_exec_stats_desc); i++) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->name = g_strdup(tb_exec_stats_desc[i].name);
+        value->type = STATS_TYPE_CUMULATIVE;
+        QAPI_LIST_PREPEND(stats_list, value);
+    }
+
+    add_stats_schema(result, STATS_PROVIDER_TCG, STATS_TARGET_VCPU,
+                     stats_list);
+}
+
 static void hmp_tcg_register(void)
 {
     monitor_register_hmp_info_hrt("jit", qmp_x_query_jit);
     monitor_register_hmp_info_hrt("opcount", qmp_x_query_opcount);
+    add_stats_callbacks(STATS_PROVIDER_TCG, tcg_query_stats_cb,
+                        tcg_query_stats_schemas_cb);
 }
 
 type_init(hmp_tcg_register);
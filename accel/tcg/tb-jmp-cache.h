@@ -10,11 +10,47 @@
 #define ACCEL_TCG_TB_JMP_CACHE_H
 
 #include "qemu/rcu.h"
+#include "qemu/atomic.h"
 #include "exec/cpu-common.h"
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+/*
+ * Reasons for leaving generated code and returning to cpu_exec_loop.
+ */
+typedef enum TBExecExit {
+    TB_EXEC_EXIT_UNCHAINED,     /* goto_tb slot not (yet) patched */
+    TB_EXEC_EXIT_LOOKUP,        /* lookup_tb_ptr miss or exit_tb(NULL) */
+    TB_EXEC_EXIT_REQUESTED,     /* TB_EXIT_REQUESTED: exit or icount */
+    TB_EXEC_EXIT_INTERRUPT,     /* cpu_handle_interrupt stopped the loop */
+    TB_EXEC_EXIT_BREAKPOINT,    /* breakpoint found before lookup */
+    TB_EXEC_EXIT_EXCEPTION,     /* longjmp out of the loop */
+    TB_EXEC_EXIT__MAX
+} TBExecExit;
+
+/*
+ * Per-vCPU execution statistics.  They are only ever written by the
+ * vCPU thread that owns them, so updates need no atomic read-modify-write;
+ * qatomic_set/qatomic_read merely prevent torn values for the monitor.
+ */
+typedef struct TBExecStats {
+    size_t jc_hit;              /* tb_jmp_cache hits */
+    size_t jc_miss;             /* tb_jmp_cache misses */
+    size_t htable_hit;          /* qht lookups that found a TB */
+    size_t htable_miss;         /* qht lookups that found nothing */
+    size_t gen_code;            /* calls to tb_gen_code */
+    size_t exclusive;           /* cpu_exec_step_atomic calls */
+    size_t chain_patched;       /* direct jumps patched by tb_add_jump */
+    size_t chain_failed;        /* tb_add_jump found slot taken or TB dead */
+    size_t exit[TB_EXEC_EXIT__MAX];
+} TBExecStats;
+
+static inline void tb_exec_stat_inc(size_t *counter)
+{
+    qatomic_set(counter, *counter + 1);
+}
+
 /*
  * Invalidated in parallel; all accesses to 'tb' must be atomic.
  * A valid entry is read/written by a single CPU, therefore there is
@@ -28,6 +64,7 @@ typedef struct CPUJumpCache {
         TranslationBlock *tb;
         vaddr pc;
     } array[TB_JMP_CACHE_SIZE];
+    TBExecStats stats;
 } CPUJumpCache;
 
 #endif /* ACCEL_TCG_TB_JMP_CACHE_H */
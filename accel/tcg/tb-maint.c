@@ -18,6 +18,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bitmap.h"
 #include "qemu/interval-tree.h"
 #include "qemu/qtree.h"
 #include "exec/cputlb.h"
@@ -184,6 +185,12 @@ struct PageDesc {
     QemuSpin lock;
     /* list of TBs intersecting this ram page */
     uintptr_t first_tb;
+    /*
+     * One bit per byte of the page, set if the byte may be covered by
+     * a TB; NULL if there is no code.  Bits of invalidated TBs are left
+     * in place until a write hits them, see page_rebuild_code_bitmap().
+     */
+    unsigned long *code_bitmap;
 };
 
 void page_table_config_init(void)
@@ -651,6 +658,71 @@ static void page_collection_unlock(struct page_collection *set)
     g_free(set);
 }
 
+/*
+ * Compute the range [*pstart, *plast] of page @n of @tb that it covers.
+ * NOTE: this is subtle as a TB may span two physical pages.
+ */
+static void tb_page_extent(const TranslationBlock *tb, unsigned int n,
+                           tb_page_addr_t *pstart, tb_page_addr_t *plast)
+{
+    tb_page_addr_t tb_start, tb_last;
+
+    tb_start = tb_page_addr0(tb);
+    tb_last = tb_start + tb->size - 1;
+    if (n == 0) {
+        tb_last = MIN(tb_last, tb_start | ~TARGET_PAGE_MASK);
+    } else {
+        tb_start = tb_page_addr1(tb);
+        tb_last = tb_start + (tb_last & ~TARGET_PAGE_MASK);
+    }
+    *pstart = tb_start;
+    *plast = tb_last;
+}
+
+static void page_code_bitmap_add(PageDesc *pd, const TranslationBlock *tb,
+                                 unsigned int n)
+{
+    tb_page_addr_t start, last;
+
+    assert_page_locked(pd);
+
+    if (pd->code_bitmap == NULL) {
+        pd->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    }
+    tb_page_extent(tb, n, &start, &last);
+    bitmap_set(pd->code_bitmap, start & ~TARGET_PAGE_MASK, last - start + 1);
+}
+
+static void page_code_bitmap_free(PageDesc *pd)
+{
+    assert_page_locked(pd);
+
+    g_free(pd->code_bitmap);
+    pd->code_bitmap = NULL;
+}
+
+/*
+ * Recompute the code bitmap from the TBs still present on the page,
+ * dropping the bits of TBs that have been invalidated since they were
+ * added.  Called with @pd->lock held.
+ */
+static void page_rebuild_code_bitmap(PageDesc *pd)
+{
+    TranslationBlock *tb;
+    PageForEachNext n;
+
+    assert_page_locked(pd);
+
+    if (!pd->first_tb) {
+        page_code_bitmap_free(pd);
+        return;
+    }
+    bitmap_zero(pd->code_bitmap, TARGET_PAGE_SIZE);
+    PAGE_FOR_EACH_TB(unused, unused, pd, tb, n) {
+        page_code_bitmap_add(pd, tb, n);
+    }
+}
+
 /* Set to NULL all the 'first_tb' fields in all PageDescs. */
 static void tb_remove_all_1(int level, void **lp)
 {
@@ -665,6 +737,7 @@ static void tb_remove_all_1(int level, void **lp)
         for (i = 0; i < V_L2_SIZE; ++i) {
             page_lock(&pd[i]);
             pd[i].first_tb = (uintptr_t)NULL;
+            page_code_bitmap_free(&pd[i]);
             page_unlock(&pd[i]);
         }
     } else {
@@ -698,6 +771,7 @@ static void tb_page_add(PageDesc *p, TranslationBlock *tb, unsigned int n)
     tb->page_next[n] = p->first_tb;
     page_already_protected = p->first_tb != 0;
     p->first_tb = (uintptr_t)tb | n;
+    page_code_bitmap_add(p, tb, n);
 
     /*
      * If some code is already present, then the pages are already
@@ -1103,6 +1177,7 @@ tb_invalidate_phys_page_range__locked(CPUState *cpu,
     TranslationBlock *tb;
     PageForEachNext n;
     bool current_tb_modified = false;
+    bool found = false;
     TranslationBlock *current_tb = NULL;
 
     /* Range may not cross a page. */
@@ -1119,16 +1194,9 @@ tb_invalidate_phys_page_range__locked(CPUState *cpu,
     PAGE_FOR_EACH_TB(start, last, p, tb, n) {
         tb_page_addr_t tb_start, tb_last;
 
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        tb_start = tb_page_addr0(tb);
-        tb_last = tb_start + tb->size - 1;
-        if (n == 0) {
-            tb_last = MIN(tb_last, tb_start | ~TARGET_PAGE_MASK);
-        } else {
-            tb_start = tb_page_addr1(tb);
-            tb_last = tb_start + (tb_last & ~TARGET_PAGE_MASK);
-        }
+        tb_page_extent(tb, n, &tb_start, &tb_last);
         if (!(tb_last < start || tb_start > last)) {
+            found = true;
             if (unlikely(current_tb == tb) &&
                 (tb_cflags(current_tb) & CF_COUNT_MASK) != 1) {
                 /*
@@ -1147,7 +1215,11 @@ tb_invalidate_phys_page_range__locked(CPUState *cpu,
 
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
+        page_code_bitmap_free(p);
         tlb_unprotect_code(start);
+    } else if (!found) {
+        /* The write hit only stale bits; stop sending it here. */
+        page_rebuild_code_bitmap(p);
     }
 
     if (unlikely(current_tb_modified)) {
@@ -1204,7 +1276,35 @@ void tb_invalidate_phys_range_fast(CPUState *cpu, ram_addr_t start,
 
     if (p) {
         ram_addr_t last = start + len - 1;
-        struct page_collection *pages = page_collection_lock(start, last);
+        unsigned long first = start & ~TARGET_PAGE_MASK;
+        struct page_collection *pages;
+        bool is_code;
+
+        /*
+         * Most writes to a page containing code do not touch the code
+         * itself, e.g. data sharing a page with code.  Check the bitmap
+         * to avoid building a page collection and walking the TB list.
+         * The page lock is still needed, because a TB being translated
+         * on this page has not set its bits yet.
+         */
+        page_lock(p);
+        is_code = p->code_bitmap &&
+                  find_next_bit(p->code_bitmap, first + len, first) <
+                  first + len;
+        if (!is_code && !p->first_tb) {
+            /*
+             * The last TB was removed through another page, e.g. a TB
+             * spanning two pages invalidated from the other one.
+             */
+            page_code_bitmap_free(p);
+            tlb_unprotect_code(start);
+        }
+        page_unlock(p);
+        if (!is_code) {
+            return;
+        }
+
+        pages = page_collection_lock(start, last);
 
         tb_invalidate_phys_page_range__locked(cpu, pages, p,
                                               start, last, ra);
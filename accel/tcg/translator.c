@@ -40,6 +40,29 @@ bool translator_io_start(DisasContextBase *db)
     return true;
 }
 
+void translator_icount_charge(DisasContextBase *db, TCGLabel *exhausted)
+{
+    TCGv_i32 count;
+
+    if (!(tb_cflags(db->tb) & CF_USE_ICOUNT)) {
+        return;
+    }
+
+    /*
+     * As in gen_tb_start, a pending exit request makes the
+     * whole of icount_decr.u32 negative.
+     */
+    count = tcg_temp_new_i32();
+    tcg_gen_ld_i32(count, tcg_env,
+                   offsetof(CPUState, neg.icount_decr.u32) -
+                   sizeof(CPUState));
+    tcg_gen_brcondi_i32(TCG_COND_LE, count, 0, exhausted);
+    tcg_gen_subi_i32(count, count, 1);
+    tcg_gen_st16_i32(count, tcg_env,
+                     offsetof(CPUState, neg.icount_decr.u16.low) -
+                     sizeof(CPUState));
+}
+
 static TCGOp *gen_tb_start(DisasContextBase *db, uint32_t cflags)
 {
     TCGv_i32 count = NULL;
@@ -1265,7 +1265,8 @@ uint64_t cpu_ldq_code_mmu(CPUArchState *env, vaddr addr,
 #include "ldst_common.c.inc"
 
 /*
- * Do not allow unaligned operations to proceed.  Return the host address.
+ * Do not allow unaligned operations to proceed, unless the host can
+ * perform them atomically.  Return the host address.
  */
 static void *atomic_mmu_lookup(CPUState *cpu, vaddr addr, MemOpIdx oi,
                                int size, uintptr_t retaddr)
@@ -1279,12 +1280,14 @@ static void *atomic_mmu_lookup(CPUState *cpu, vaddr addr, MemOpIdx oi,
         cpu_loop_exit_sigbus(cpu, addr, MMU_DATA_STORE, retaddr);
     }
 
+    ret = g2h(cpu, addr);
+
     /* Enforce qemu required alignment.  */
-    if (unlikely(addr & (size - 1))) {
+    if (unlikely(addr & (size - 1)) &&
+        !host_atomic_unaligned_ok((uintptr_t)ret, size)) {
         cpu_loop_exit_atomic(cpu, retaddr);
     }
 
-    ret = g2h(cpu, addr);
     set_helper_retaddr(retaddr);
     return ret;
 }
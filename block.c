@@ -106,6 +106,8 @@ static void bdrv_reopen_abort(BDRVReopenState *reopen_state);
 
 static bool bdrv_backing_overridden(BlockDriverState *bs);
 
+static void bdrv_amc_clear(BdrvAllocMapCache *amc);
+
 static bool GRAPH_RDLOCK
 bdrv_change_aio_context(BlockDriverState *bs, AioContext *ctx,
                         GHashTable *visited, Transaction *tran, Error **errp);
@@ -429,6 +431,7 @@ BlockDriverState *bdrv_new(void)
 
     qemu_co_mutex_init(&bs->bsc_modify_lock);
     bs->block_status_cache = g_new0(BdrvBlockStatusCache, 1);
+    qemu_mutex_init(&bs->alloc_map_cache.lock);
 
     for (i = 0; i < bdrv_drain_all_count; i++) {
         bdrv_drained_begin(bs);
@@ -2993,6 +2996,11 @@ bdrv_replace_child_noperm(BdrvChild *child, BlockDriverState *new_bs)
     if (!new_bs_quiesce_counter && child->quiesced_parent) {
         bdrv_parent_drained_end_single(child);
     }
+
+    /* The chain below the parent changed, forget its allocation status */
+    if (child->klass == &child_of_bds) {
+        bdrv_amc_invalidate(child->opaque);
+    }
 }
 
 /**
@@ -5207,6 +5215,7 @@ static void bdrv_close(BlockDriverState *bs)
     bs->full_open_options = NULL;
     g_free(bs->block_status_cache);
     bs->block_status_cache = NULL;
+    bdrv_amc_clear(&bs->alloc_map_cache);
 
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
@@ -5590,6 +5599,7 @@ static void bdrv_delete(BlockDriverState *bs)
     bdrv_close(bs);
 
     qemu_mutex_destroy(&bs->reqs_lock);
+    qemu_mutex_destroy(&bs->alloc_map_cache.lock);
 
     g_free(bs);
 }
@@ -6954,6 +6964,9 @@ int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp)
     assert(!(bs->open_flags & BDRV_O_INACTIVE));
     assert_bdrv_graph_readable();
 
+    /* Another process may have written to the image */
+    bdrv_amc_invalidate(bs);
+
     if (bs->drv->bdrv_co_invalidate_cache) {
         bs->drv->bdrv_co_invalidate_cache(bs, &local_err);
         if (local_err) {
@@ -8565,3 +8578,214 @@ void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes)
         g_free_rcu(old_bsc, rcu);
     }
 }
+
+/* Bound for the number of entries in each allocation map cache */
+#define BDRV_AMC_MAX_ENTRIES 65536
+
+typedef struct BdrvAllocMapEntry {
+    IntervalTreeNode node;
+    int depth;
+} BdrvAllocMapEntry;
+
+static int bdrv_amc_depth(IntervalTreeNode *node)
+{
+    return container_of(node, BdrvAllocMapEntry, node)->depth;
+}
+
+static void bdrv_amc_insert_locked(BdrvAllocMapCache *amc, uint64_t start,
+                                   uint64_t last, int depth)
+{
+    BdrvAllocMapEntry *e = g_new(BdrvAllocMapEntry, 1);
+
+    e->node.start = start;
+    e->node.last = last;
+    e->depth = depth;
+    interval_tree_insert(&e->node, &amc->tree);
+    qatomic_set(&amc->nr_entries, amc->nr_entries + 1);
+}
+
+static void bdrv_amc_remove_locked(BdrvAllocMapCache *amc,
+                                   IntervalTreeNode *node)
+{
+    interval_tree_remove(node, &amc->tree);
+    g_free(container_of(node, BdrvAllocMapEntry, node));
+    qatomic_set(&amc->nr_entries, amc->nr_entries - 1);
+}
+
+/*
+ * Remove [start, last] from the cache.  Entries that only partially
+ * overlap are trimmed.
+ */
+static void bdrv_amc_punch_locked(BdrvAllocMapCache *amc, uint64_t start,
+                                  uint64_t last)
+{
+    IntervalTreeNode *node;
+
+    while ((node = interval_tree_iter_first(&amc->tree, start, last))) {
+        uint64_t node_start = node->start;
+        uint64_t node_last = node->last;
+        int depth = bdrv_amc_depth(node);
+
+        bdrv_amc_remove_locked(amc, node);
+        if (node_start < start) {
+            bdrv_amc_insert_locked(amc, node_start, start - 1, depth);
+        }
+        if (node_last > last) {
+            bdrv_amc_insert_locked(amc, last + 1, node_last, depth);
+        }
+    }
+}
+
+static void bdrv_amc_clear_locked(BdrvAllocMapCache *amc)
+{
+    bdrv_amc_punch_locked(amc, 0, UINT64_MAX);
+}
+
+static void bdrv_amc_clear(BdrvAllocMapCache *amc)
+{
+    QEMU_LOCK_GUARD(&amc->lock);
+    bdrv_amc_clear_locked(amc);
+}
+
+/**
+ * See block_int.h for this function's documentation.
+ */
+int bdrv_amc_lookup(BlockDriverState *bs, int64_t offset, int64_t *pnum,
+                    unsigned int *gen)
+{
+    BdrvAllocMapCache *amc = &bs->alloc_map_cache;
+    IntervalTreeNode *node;
+    IO_CODE();
+
+    /* Pairs with smp_mb() in bdrv_amc_invalidate_one() */
+    qatomic_inc(&amc->nr_queries);
+    smp_mb__after_rmw();
+
+    *gen = qatomic_read(&amc->gen);
+    if (!qatomic_read(&amc->nr_entries)) {
+        return 0;
+    }
+
+    QEMU_LOCK_GUARD(&amc->lock);
+    node = interval_tree_iter_first(&amc->tree, offset, offset);
+    if (!node) {
+        return 0;
+    }
+    *pnum = node->last + 1 - offset;
+    return bdrv_amc_depth(node);
+}
+
+static void bdrv_amc_record(BdrvAllocMapCache *amc, int64_t offset,
+                            int64_t bytes, int depth, unsigned int gen)
+{
+    uint64_t start = offset;
+    uint64_t last = offset + bytes - 1;
+    IntervalTreeNode *node;
+
+    QEMU_LOCK_GUARD(&amc->lock);
+    if (qatomic_read(&amc->gen) != gen) {
+        return;
+    }
+    if (amc->nr_entries >= BDRV_AMC_MAX_ENTRIES) {
+        bdrv_amc_clear_locked(amc);
+    }
+
+    bdrv_amc_punch_locked(amc, start, last);
+
+    /* Merge with the neighbours if they skip the same number of nodes */
+    if (start > 0) {
+        node = interval_tree_iter_first(&amc->tree, start - 1, start - 1);
+        if (node && bdrv_amc_depth(node) == depth) {
+            start = node->start;
+            bdrv_amc_remove_locked(amc, node);
+        }
+    }
+    node = interval_tree_iter_first(&amc->tree, last + 1, last + 1);
+    if (node && bdrv_amc_depth(node) == depth) {
+        last = node->last;
+        bdrv_amc_remove_locked(amc, node);
+    }
+    bdrv_amc_insert_locked(amc, start, last, depth);
+
+    /*
+     * Pairs with smp_mb__after_rmw() in bdrv_amc_invalidate_one(): either
+     * the invalidation sees the new entry and removes it once we drop the
+     * lock, or we see that the chain changed while its status was read.
+     */
+    smp_mb();
+    if (qatomic_read(&amc->gen) != gen) {
+        bdrv_amc_clear_locked(amc);
+    }
+}
+
+/**
+ * See block_int.h for this function's documentation.
+ */
+void bdrv_amc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                   int depth, unsigned int gen)
+{
+    BdrvAllocMapCache *amc = &bs->alloc_map_cache;
+    IO_CODE();
+
+    assert(bytes >= 0 && depth >= 0);
+
+    if (bytes && depth) {
+        bdrv_amc_record(amc, offset, bytes, depth, gen);
+    }
+
+    /* The entries are visible to whoever sees the query end */
+    qatomic_dec(&amc->nr_queries);
+}
+
+static void bdrv_amc_invalidate_one(BdrvAllocMapCache *amc,
+                                    int64_t offset, int64_t bytes)
+{
+    /*
+     * Pairs with smp_mb__after_rmw() in bdrv_amc_lookup(): either the
+     * query sees this write when it reads the chain, or we see the query
+     * and make its fill fail.  Without queries and entries, nothing has
+     * to be done; this is the case for most writes.
+     */
+    smp_mb();
+    if (!qatomic_load_acquire(&amc->nr_queries) &&
+        !qatomic_read(&amc->nr_entries)) {
+        return;
+    }
+
+    qatomic_inc(&amc->gen);
+    smp_mb__after_rmw();
+
+    if (qatomic_read(&amc->nr_entries) && bytes > 0) {
+        QEMU_LOCK_GUARD(&amc->lock);
+        bdrv_amc_punch_locked(amc, offset, offset + bytes - 1);
+    }
+}
+
+/**
+ * See block_int.h for this function's documentation.
+ */
+void bdrv_amc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes)
+{
+    BdrvChild *c;
+    IO_CODE();
+
+    bdrv_amc_invalidate_one(&bs->alloc_map_cache, offset, bytes);
+
+    /* Offsets are the same in the nodes that have @bs in their chain */
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->klass == &child_of_bds &&
+            c == bdrv_filter_or_cow_child(c->opaque)) {
+            bdrv_amc_invalidate_range(c->opaque, offset, bytes);
+        }
+    }
+}
+
+/**
+ * See block_int.h for this function's documentation.
+ */
+void bdrv_amc_invalidate(BlockDriverState *bs)
+{
+    IO_CODE();
+    bdrv_amc_invalidate_range(bs, 0, INT64_MAX);
+}
@@ -33,6 +33,11 @@
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
+/* Requests that a BlockBackend holds back to merge them, at most */
+#define BLK_MERGE_MAX_REQS 32
+
+typedef struct BlkAioEmAIOCB BlkAioEmAIOCB;
+
 typedef struct BlockBackendAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
     void (*detach_aio_context)(void *opaque);
@@ -92,6 +97,16 @@ struct BlockBackend {
      * Accessed with atomic ops.
      */
     unsigned int in_flight;
+
+    /*
+     * Request merging, see blk_set_request_merging().  The queue is only
+     * accessed from the home AioContext of the BlockBackend.
+     */
+    bool merge_enabled;
+    int64_t merge_window_ns;
+    QEMUTimer merge_timer;
+    BlkAioEmAIOCB *merge_reqs[BLK_MERGE_MAX_REQS];
+    unsigned int merge_nr_reqs;
 };
 
 typedef struct BlockBackendAIOCB {
@@ -494,6 +509,7 @@ static void blk_delete(BlockBackend *blk)
     assert(QLIST_EMPTY(&blk->insert_bs_notifiers.notifiers));
     assert(QLIST_EMPTY(&blk->aio_notifiers));
     assert(qemu_co_queue_empty(&blk->queued_requests));
+    assert(!blk->merge_nr_reqs);
     qemu_mutex_destroy(&blk->queued_requests_lock);
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
@@ -1553,12 +1569,24 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     return &acb->common;
 }
 
-typedef struct BlkAioEmAIOCB {
+struct BlkAioEmAIOCB {
     BlockAIOCB common;
     BlkRwCo rwco;
     int64_t bytes;
     bool has_returned;
-} BlkAioEmAIOCB;
+
+    /* For requests held back by request merging */
+    CoroutineEntry *co_entry;
+    unsigned int merge_seq;
+    BlkAioEmAIOCB *merge_next;
+    bool merge_dropped_ref; /* in_flight reference passed to the merge */
+};
+
+typedef struct BlkMergedRequest {
+    BlkAioEmAIOCB *first;
+    QEMUIOVector qiov;
+    bool is_write;
+} BlkMergedRequest;
 
 static const AIOCBInfo blk_aio_em_aiocb_info = {
     .aiocb_size         = sizeof(BlkAioEmAIOCB),
@@ -1568,7 +1596,9 @@ static void blk_aio_complete(BlkAioEmAIOCB *acb)
 {
     if (acb->has_returned) {
         acb->common.cb(acb->common.opaque, acb->rwco.ret);
-        blk_dec_in_flight(acb->rwco.blk);
+        if (!acb->merge_dropped_ref) {
+            blk_dec_in_flight(acb->rwco.blk);
+        }
         qemu_aio_unref(acb);
     }
 }
@@ -1580,6 +1610,249 @@ static void blk_aio_complete_bh(void *opaque)
     blk_aio_complete(acb);
 }
 
+static void coroutine_fn blk_aio_read_entry(void *opaque);
+static void coroutine_fn blk_aio_write_entry(void *opaque);
+
+static void coroutine_fn blk_aio_merged_entry(void *opaque)
+{
+    BlkMergedRequest *mr = opaque;
+    BlkAioEmAIOCB *acb = mr->first;
+    BlkRwCo *rwco = &acb->rwco;
+    BlkAioEmAIOCB *next;
+    int ret;
+
+    if (mr->is_write) {
+        ret = blk_co_do_pwritev_part(rwco->blk, rwco->offset, mr->qiov.size,
+                                     &mr->qiov, 0, rwco->flags);
+    } else {
+        ret = blk_co_do_preadv_part(rwco->blk, rwco->offset, mr->qiov.size,
+                                    &mr->qiov, 0, rwco->flags);
+    }
+
+    qemu_iovec_destroy(&mr->qiov);
+    g_free(mr);
+
+    /*
+     * Complete the first request last, it owns the only in_flight reference
+     * of the merged request.
+     */
+    for (next = acb->merge_next; next; next = next->merge_next) {
+        next->rwco.ret = ret;
+        blk_aio_complete(next);
+    }
+    acb->rwco.ret = ret;
+    blk_aio_complete(acb);
+}
+
+static int blk_merge_compare(const void *a, const void *b)
+{
+    const BlkAioEmAIOCB *req1 = *(BlkAioEmAIOCB **)a;
+    const BlkAioEmAIOCB *req2 = *(BlkAioEmAIOCB **)b;
+
+    /* By offset, then in submission order */
+    if (req1->rwco.offset != req2->rwco.offset) {
+        return req1->rwco.offset > req2->rwco.offset ? 1 : -1;
+    }
+    if (req1->merge_seq != req2->merge_seq) {
+        return req1->merge_seq > req2->merge_seq ? 1 : -1;
+    }
+    return 0;
+}
+
+/* Submit @nr_reqs sorted and adjacent requests as a single one */
+static void blk_merge_submit(BlockBackend *blk, BlkAioEmAIOCB **reqs,
+                             unsigned int nr_reqs, int niov)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    BlkMergedRequest *mr;
+    unsigned int i;
+
+    if (nr_reqs == 1) {
+        aio_co_enter(ctx, qemu_coroutine_create(reqs[0]->co_entry, reqs[0]));
+        return;
+    }
+
+    mr = g_new(BlkMergedRequest, 1);
+    mr->first = reqs[0];
+    mr->is_write = reqs[0]->co_entry == blk_aio_write_entry;
+    qemu_iovec_init(&mr->qiov, niov);
+    for (i = 0; i < nr_reqs; i++) {
+        qemu_iovec_concat(&mr->qiov, reqs[i]->rwco.iobuf, 0, reqs[i]->bytes);
+        reqs[i]->merge_next = i + 1 < nr_reqs ? reqs[i + 1] : NULL;
+    }
+
+    /*
+     * blk_wait_while_drained() drops a single in_flight reference for the
+     * merged request, so it must not hold more than one.
+     */
+    for (i = 1; i < nr_reqs; i++) {
+        reqs[i]->merge_dropped_ref = true;
+        blk_dec_in_flight(blk);
+    }
+
+    trace_blk_merge_submit(blk, reqs[0]->rwco.offset, mr->qiov.size, nr_reqs,
+                           mr->is_write);
+    block_acct_merge_done(blk_get_stats(blk),
+                          mr->is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ,
+                          nr_reqs - 1);
+
+    aio_co_enter(ctx, qemu_coroutine_create(blk_aio_merged_entry, mr));
+}
+
+/* Merge the held back requests where possible and submit them */
+static void blk_merge_flush(BlockBackend *blk)
+{
+    BlkAioEmAIOCB *reqs[BLK_MERGE_MAX_REQS];
+    unsigned int nr_reqs = blk->merge_nr_reqs;
+    uint32_t max_transfer = blk_get_max_transfer(blk);
+    int max_iov = blk_get_max_iov(blk);
+    unsigned int i, start = 0;
+    int64_t bytes = 0;
+    int niov = 0;
+
+    timer_del(&blk->merge_timer);
+
+    /* Completion callbacks may submit new requests while we're here */
+    memcpy(reqs, blk->merge_reqs, nr_reqs * sizeof(reqs[0]));
+    blk->merge_nr_reqs = 0;
+
+    qsort(reqs, nr_reqs, sizeof(reqs[0]), blk_merge_compare);
+
+    /*
+     * The flush can be called from the submission of another request, so
+     * completion callbacks must not run from here.  Hold them back like
+     * blk_aio_prwv() does until all requests are submitted.
+     */
+    for (i = 0; i < nr_reqs; i++) {
+        reqs[i]->has_returned = false;
+    }
+
+    for (i = 0; i < nr_reqs; i++) {
+        BlkAioEmAIOCB *req = reqs[i];
+        QEMUIOVector *qiov = req->rwco.iobuf;
+
+        if (i > start &&
+            (req->rwco.flags != reqs[start]->rwco.flags ||
+             reqs[start]->rwco.offset + bytes != req->rwco.offset ||
+             niov > max_iov - qiov->niov ||
+             bytes + req->bytes > max_transfer)) {
+            blk_merge_submit(blk, &reqs[start], i - start, niov);
+            start = i;
+        }
+        if (i == start) {
+            bytes = niov = 0;
+        }
+        bytes += req->bytes;
+        niov += qiov->niov;
+    }
+
+    if (nr_reqs) {
+        blk_merge_submit(blk, &reqs[start], nr_reqs - start, niov);
+    }
+
+    for (i = 0; i < nr_reqs; i++) {
+        BlkAioEmAIOCB *req = reqs[i];
+
+        req->has_returned = true;
+        if (req->rwco.ret != NOT_DONE) {
+            /* Each completion BH needs its own in_flight reference */
+            if (req->merge_dropped_ref) {
+                req->merge_dropped_ref = false;
+                blk_inc_in_flight(blk);
+            }
+            replay_bh_schedule_oneshot_event(qemu_get_current_aio_context(),
+                                             blk_aio_complete_bh, req);
+        }
+    }
+}
+
+static void blk_merge_timer_cb(void *opaque)
+{
+    blk_merge_flush(opaque);
+}
+
+static void blk_merge_flush_bh(void *opaque)
+{
+    BlockBackend *blk = opaque;
+
+    if (blk->merge_nr_reqs) {
+        blk_merge_flush(blk);
+    }
+    blk_dec_in_flight(blk);
+}
+
+/*
+ * Submit the held back requests now instead of waiting for the merge window
+ * to expire, so that draining doesn't wait for the timer.
+ */
+static void blk_merge_drain(BlockBackend *blk)
+{
+    AioContext *ctx = blk_get_aio_context(blk);
+
+    if (!blk->merge_enabled) {
+        return;
+    }
+
+    if (ctx == qemu_get_current_aio_context()) {
+        if (blk->merge_nr_reqs) {
+            blk_merge_flush(blk);
+        }
+    } else {
+        /* The queue belongs to the home AioContext */
+        blk_inc_in_flight(blk);
+        aio_bh_schedule_oneshot(ctx, blk_merge_flush_bh, blk);
+    }
+}
+
+/*
+ * Hold back a read or write to merge it with adjacent requests submitted
+ * within the merge window.  Requests are only merged in the home
+ * AioContext of the BlockBackend, so that completion callbacks keep
+ * running in the thread that submitted the request.
+ */
+static bool blk_merge_queue(BlockBackend *blk, BlkAioEmAIOCB *acb)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    if (!blk->merge_enabled || ctx != blk_get_aio_context(blk)) {
+        return false;
+    }
+
+    if (!acb->rwco.iobuf || qatomic_read(&blk->quiesce_counter) ||
+        (acb->co_entry != blk_aio_read_entry &&
+         acb->co_entry != blk_aio_write_entry)) {
+        /* Keep other requests ordered after the held back ones */
+        if (blk->merge_nr_reqs) {
+            blk_merge_flush(blk);
+        }
+        return false;
+    }
+
+    /*
+     * Never submit @acb itself from here, its completion callback must not
+     * run before blk_aio_prwv() returns.  Like virtio-blk, a read after a
+     * write (or the other way round) submits the batch before it, so that
+     * requests of one type are never reordered around the other.
+     */
+    if (blk->merge_nr_reqs == BLK_MERGE_MAX_REQS ||
+        (blk->merge_nr_reqs &&
+         blk->merge_reqs[0]->co_entry != acb->co_entry)) {
+        blk_merge_flush(blk);
+    }
+
+    if (!blk->merge_nr_reqs) {
+        aio_timer_init(ctx, &blk->merge_timer, QEMU_CLOCK_REALTIME, SCALE_NS,
+                       blk_merge_timer_cb, blk);
+        timer_mod(&blk->merge_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                  blk->merge_window_ns);
+    }
+
+    acb->merge_seq = blk->merge_nr_reqs;
+    blk->merge_reqs[blk->merge_nr_reqs++] = acb;
+    return true;
+}
+
 static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset,
                                 int64_t bytes,
                                 void *iobuf, CoroutineEntry co_entry,
@@ -1599,6 +1872,14 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset,
         .ret    = NOT_DONE,
     };
     acb->bytes = bytes;
+    acb->co_entry = co_entry;
+    acb->merge_dropped_ref = false;
+
+    /* The request cannot complete before it is submitted from the queue */
+    acb->has_returned = true;
+    if (blk_merge_queue(blk, acb)) {
+        return &acb->common;
+    }
     acb->has_returned = false;
 
     co = qemu_coroutine_create(co_entry, acb);
@@ -2244,6 +2525,25 @@ void blk_set_enable_write_cache(BlockBackend *blk, bool wce)
     blk->enable_write_cache = wce;
 }
 
+/*
+ * Hold back reads and writes that are submitted with blk_aio_preadv() and
+ * blk_aio_pwritev() for up to @window_ns nanoseconds, and submit adjacent
+ * ones as a single request.  With a window of 0 the requests submitted
+ * while handling one batch of AioContext events are merged.
+ *
+ * Must be called with no requests in flight.  Request merging is
+ * disabled with record/replay, which needs requests to be submitted
+ * deterministically.
+ */
+void blk_set_request_merging(BlockBackend *blk, bool enable, int64_t window_ns)
+{
+    GLOBAL_STATE_CODE();
+    assert(!blk->merge_nr_reqs);
+
+    blk->merge_enabled = enable && replay_mode == REPLAY_MODE_NONE;
+    blk->merge_window_ns = window_ns;
+}
+
 bool coroutine_fn blk_co_is_inserted(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
@@ -2732,6 +3032,8 @@ static void blk_root_drained_begin(BdrvChild *child)
     BlockBackend *blk = child->opaque;
     ThrottleGroupMember *tgm = &blk->public.throttle_group_member;
 
+    blk_merge_drain(blk);
+
     if (qatomic_fetch_inc(&blk->quiesce_counter) == 0) {
         if (blk->dev_ops && blk->dev_ops->drained_begin) {
             blk->dev_ops->drained_begin(blk->dev_opaque);
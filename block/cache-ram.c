@@ -0,0 +1,782 @@
+/*
+ * Host memory read cache filter driver
+ *
+ * Keeps recently and frequently read clusters of the filtered node in host
+ * memory.  All cache-ram nodes in the same AioContext share one cache,
+ * whose capacity is the sum of the sizes of its nodes, so that the hot
+ * data of all those nodes competes for the memory.  Replacement follows
+ * ARC (Megiddo and Modha, "ARC: A Self-Tuning, Low Overhead Replacement
+ * Cache"), which balances recency against frequency and is not flushed by
+ * a single sequential scan.
+ *
+ * Writes go straight to the child and drop the clusters they touch from
+ * the cache.  The child may not be written by anyone else.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define CACHE_RAM_CLUSTER_SIZE (64 * KiB)
+#define CACHE_RAM_DEFAULT_SIZE (64 * MiB)
+
+/* Misses read from the child with a single request */
+#define CACHE_RAM_MAX_RUN 32
+
+#define CACHE_RAM_OPT_SIZE "size"
+
+typedef enum {
+    CACHE_RAM_T1,       /* resident, seen once recently */
+    CACHE_RAM_T2,       /* resident, seen at least twice recently */
+    CACHE_RAM_B1,       /* ghost, evicted from T1 */
+    CACHE_RAM_B2,       /* ghost, evicted from T2 */
+    CACHE_RAM__MAX,
+} CacheRamList;
+
+typedef struct BDRVCacheRamState BDRVCacheRamState;
+
+typedef struct CacheRamKey {
+    BDRVCacheRamState *node;
+    uint64_t cluster;
+} CacheRamKey;
+
+typedef struct CacheRamEntry {
+    CacheRamKey key;
+    CacheRamList list;
+    /* NULL for ghost entries */
+    void *data;
+    QTAILQ_ENTRY(CacheRamEntry) next;
+} CacheRamEntry;
+
+typedef struct CacheRam {
+    AioContext *ctx;
+    unsigned refcnt;
+    QLIST_ENTRY(CacheRam) next;
+
+    /*
+     * Protects everything below, and the counters in BDRVCacheRamState.
+     * A node can get requests from several threads with multiqueue.
+     */
+    QemuMutex lock;
+
+    /* In clusters */
+    uint64_t capacity;
+    /* ARC's p: target length of T1 */
+    uint64_t target;
+
+    GHashTable *entries;
+    /* Most recently used first */
+    QTAILQ_HEAD(, CacheRamEntry) lists[CACHE_RAM__MAX];
+    uint64_t len[CACHE_RAM__MAX];
+} CacheRam;
+
+struct BDRVCacheRamState {
+    CacheRam *cache;
+    /* Contribution to the capacity of the cache, in clusters */
+    uint64_t size;
+
+    /* Reads only fill the cache while no write is in flight */
+    unsigned writes_in_flight;
+    uint64_t write_gen;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t resident;
+};
+
+/* One cache per AioContext, protected by the BQL */
+static QLIST_HEAD(, CacheRam) cache_ram_list =
+    QLIST_HEAD_INITIALIZER(cache_ram_list);
+
+static guint cache_ram_key_hash(gconstpointer p)
+{
+    const CacheRamKey *key = p;
+
+    return g_direct_hash(key->node) ^ g_int64_hash(&key->cluster);
+}
+
+static gboolean cache_ram_key_equal(gconstpointer a, gconstpointer b)
+{
+    const CacheRamKey *ka = a;
+    const CacheRamKey *kb = b;
+
+    return ka->node == kb->node && ka->cluster == kb->cluster;
+}
+
+static inline uint64_t cache_ram_resident(CacheRam *cache)
+{
+    return cache->len[CACHE_RAM_T1] + cache->len[CACHE_RAM_T2];
+}
+
+static inline uint64_t cache_ram_ghosts(CacheRam *cache)
+{
+    return cache->len[CACHE_RAM_B1] + cache->len[CACHE_RAM_B2];
+}
+
+/* Make @e the most recently used entry of @list */
+static void cache_ram_move(CacheRam *cache, CacheRamEntry *e,
+                           CacheRamList list)
+{
+    QTAILQ_REMOVE(&cache->lists[e->list], e, next);
+    cache->len[e->list]--;
+    QTAILQ_INSERT_HEAD(&cache->lists[list], e, next);
+    cache->len[list]++;
+    e->list = list;
+}
+
+static void cache_ram_free_data(CacheRamEntry *e)
+{
+    if (e->data) {
+        qemu_vfree(e->data);
+        e->data = NULL;
+        e->key.node->resident--;
+    }
+}
+
+static void cache_ram_remove(CacheRam *cache, CacheRamEntry *e)
+{
+    QTAILQ_REMOVE(&cache->lists[e->list], e, next);
+    cache->len[e->list]--;
+    g_hash_table_remove(cache->entries, &e->key);
+    cache_ram_free_data(e);
+    g_free(e);
+}
+
+static void cache_ram_remove_lru(CacheRam *cache, CacheRamList list)
+{
+    CacheRamEntry *e = QTAILQ_LAST(&cache->lists[list]);
+
+    if (e) {
+        if (e->data) {
+            e->key.node->evictions++;
+        }
+        cache_ram_remove(cache, e);
+    }
+}
+
+/*
+ * ARC's REPLACE: evict the least recently used resident cluster of T1 or
+ * T2, depending on whether T1 exceeds its target length, and remember it
+ * in the matching ghost list.
+ */
+static void cache_ram_replace(CacheRam *cache, bool ghost_hit_in_b2)
+{
+    uint64_t t1 = cache->len[CACHE_RAM_T1];
+    CacheRamList from, to;
+    CacheRamEntry *e;
+
+    if (t1 && (t1 > cache->target ||
+               (ghost_hit_in_b2 && t1 == cache->target) ||
+               !cache->len[CACHE_RAM_T2])) {
+        from = CACHE_RAM_T1;
+        to = CACHE_RAM_B1;
+    } else if (cache->len[CACHE_RAM_T2]) {
+        from = CACHE_RAM_T2;
+        to = CACHE_RAM_B2;
+    } else {
+        return;
+    }
+
+    e = QTAILQ_LAST(&cache->lists[from]);
+    e->key.node->evictions++;
+    cache_ram_free_data(e);
+    cache_ram_move(cache, e, to);
+}
+
+/* Restore the ARC invariants after the capacity went down */
+static void cache_ram_trim(CacheRam *cache)
+{
+    cache->target = MIN(cache->target, cache->capacity);
+
+    while (cache_ram_resident(cache) > cache->capacity) {
+        cache_ram_replace(cache, false);
+    }
+    while (cache_ram_resident(cache) + cache_ram_ghosts(cache) >
+           2 * cache->capacity) {
+        cache_ram_remove_lru(cache, cache->len[CACHE_RAM_B1] ?
+                                    CACHE_RAM_B1 : CACHE_RAM_B2);
+    }
+}
+
+static CacheRamEntry *cache_ram_lookup(CacheRam *cache, BDRVCacheRamState *s,
+                                       uint64_t cluster)
+{
+    CacheRamKey key = { .node = s, .cluster = cluster };
+
+    return g_hash_table_lookup(cache->entries, &key);
+}
+
+/*
+ * Insert the freshly read @data for @cluster.  Returns false if the
+ * cluster became resident in the meantime; @data is not used then.
+ */
+static bool cache_ram_insert(CacheRam *cache, BDRVCacheRamState *s,
+                             uint64_t cluster, void *data)
+{
+    CacheRamEntry *e = cache_ram_lookup(cache, s, cluster);
+    uint64_t c = cache->capacity;
+    bool full = cache_ram_resident(cache) >= c;
+
+    if (e && e->data) {
+        return false;
+    }
+
+    if (e && e->list == CACHE_RAM_B1) {
+        /* Recency would have hit: give T1 more room */
+        uint64_t delta = MAX(cache->len[CACHE_RAM_B2] /
+                             cache->len[CACHE_RAM_B1], 1);
+
+        cache->target = MIN(cache->target + delta, c);
+        if (full) {
+            cache_ram_replace(cache, false);
+        }
+        cache_ram_move(cache, e, CACHE_RAM_T2);
+    } else if (e) {
+        /* Frequency would have hit: give T2 more room */
+        uint64_t delta = MAX(cache->len[CACHE_RAM_B1] /
+                             cache->len[CACHE_RAM_B2], 1);
+
+        cache->target -= MIN(cache->target, delta);
+        if (full) {
+            cache_ram_replace(cache, true);
+        }
+        cache_ram_move(cache, e, CACHE_RAM_T2);
+    } else {
+        if (cache->len[CACHE_RAM_T1] + cache->len[CACHE_RAM_B1] >= c) {
+            if (cache->len[CACHE_RAM_T1] < c) {
+                cache_ram_remove_lru(cache, CACHE_RAM_B1);
+                if (full) {
+                    cache_ram_replace(cache, false);
+                }
+            } else {
+                cache_ram_remove_lru(cache, CACHE_RAM_T1);
+            }
+        } else if (cache_ram_resident(cache) + cache_ram_ghosts(cache) >= c) {
+            if (cache_ram_resident(cache) + cache_ram_ghosts(cache) >= 2 * c) {
+                cache_ram_remove_lru(cache, CACHE_RAM_B2);
+            }
+            if (full) {
+                cache_ram_replace(cache, false);
+            }
+        }
+
+        e = g_new0(CacheRamEntry, 1);
+        e->key.node = s;
+        e->key.cluster = cluster;
+        e->list = CACHE_RAM_T1;
+        QTAILQ_INSERT_HEAD(&cache->lists[CACHE_RAM_T1], e, next);
+        cache->len[CACHE_RAM_T1]++;
+        g_hash_table_add(cache->entries, &e->key);
+    }
+
+    e->data = data;
+    s->resident++;
+    return true;
+}
+
+/* Drop clusters [@first, @end) of @s, called with the cache lock held */
+static void cache_ram_invalidate(BDRVCacheRamState *s, uint64_t first,
+                                 uint64_t end)
+{
+    CacheRam *cache = s->cache;
+    CacheRamEntry *e, *next;
+    uint64_t cluster;
+    int i;
+
+    if (end - first <= g_hash_table_size(cache->entries)) {
+        for (cluster = first; cluster < end; cluster++) {
+            e = cache_ram_lookup(cache, s, cluster);
+            if (e) {
+                cache_ram_remove(cache, e);
+            }
+        }
+        return;
+    }
+
+    /* Large discards and the like: walking the lists is cheaper */
+    for (i = 0; i < CACHE_RAM__MAX; i++) {
+        QTAILQ_FOREACH_SAFE(e, &cache->lists[i], next, next) {
+            if (e->key.node == s && e->key.cluster >= first &&
+                e->key.cluster < end) {
+                cache_ram_remove(cache, e);
+            }
+        }
+    }
+}
+
+/* Drop all clusters of @s, called with the cache lock held */
+static void cache_ram_invalidate_node(BDRVCacheRamState *s)
+{
+    cache_ram_invalidate(s, 0, UINT64_MAX);
+}
+
+static void cache_ram_join(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVCacheRamState *s = bs->opaque;
+    CacheRam *cache;
+    int i;
+
+    GLOBAL_STATE_CODE();
+
+    QLIST_FOREACH(cache, &cache_ram_list, next) {
+        if (cache->ctx == ctx) {
+            break;
+        }
+    }
+
+    if (!cache) {
+        cache = g_new0(CacheRam, 1);
+        cache->ctx = ctx;
+        qemu_mutex_init(&cache->lock);
+        cache->entries = g_hash_table_new(cache_ram_key_hash,
+                                          cache_ram_key_equal);
+        for (i = 0; i < CACHE_RAM__MAX; i++) {
+            QTAILQ_INIT(&cache->lists[i]);
+        }
+        QLIST_INSERT_HEAD(&cache_ram_list, cache, next);
+    }
+
+    qemu_mutex_lock(&cache->lock);
+    cache->refcnt++;
+    cache->capacity += s->size;
+    qemu_mutex_unlock(&cache->lock);
+
+    s->cache = cache;
+    trace_cache_ram_join(bs, ctx, cache->capacity * CACHE_RAM_CLUSTER_SIZE);
+}
+
+static void cache_ram_leave(BlockDriverState *bs)
+{
+    BDRVCacheRamState *s = bs->opaque;
+    CacheRam *cache = s->cache;
+
+    GLOBAL_STATE_CODE();
+
+    qemu_mutex_lock(&cache->lock);
+    cache_ram_invalidate_node(s);
+    cache->capacity -= s->size;
+    cache_ram_trim(cache);
+    qemu_mutex_unlock(&cache->lock);
+
+    s->cache = NULL;
+    if (--cache->refcnt) {
+        return;
+    }
+
+    assert(!g_hash_table_size(cache->entries));
+    QLIST_REMOVE(cache, next);
+    g_hash_table_unref(cache->entries);
+    qemu_mutex_destroy(&cache->lock);
+    g_free(cache);
+}
+
+static QemuOptsList cache_ram_runtime_opts = {
+    .name = "cache-ram",
+    .head = QTAILQ_HEAD_INITIALIZER(cache_ram_runtime_opts.head),
+    .desc = {
+        {
+            .name = CACHE_RAM_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "host memory added to the read cache of the iothread, "
+                "default 64M",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int cache_ram_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVCacheRamState *s = bs->opaque;
+    QemuOpts *opts;
+    uint64_t size;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&cache_ram_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    size = qemu_opt_get_size(opts, CACHE_RAM_OPT_SIZE, CACHE_RAM_DEFAULT_SIZE);
+    qemu_opts_del(opts);
+
+    if (size < CACHE_RAM_CLUSTER_SIZE) {
+        error_setg(errp, "cache-ram size must be at least %d bytes",
+                   CACHE_RAM_CLUSTER_SIZE);
+        return -EINVAL;
+    }
+    s->size = size / CACHE_RAM_CLUSTER_SIZE;
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    cache_ram_join(bs, bdrv_get_aio_context(bs));
+    return 0;
+}
+
+static void cache_ram_close(BlockDriverState *bs)
+{
+    cache_ram_leave(bs);
+}
+
+static void cache_ram_detach_aio_context(BlockDriverState *bs)
+{
+    cache_ram_leave(bs);
+}
+
+static void cache_ram_attach_aio_context(BlockDriverState *bs,
+                                         AioContext *new_context)
+{
+    cache_ram_join(bs, new_context);
+}
+
+static int cache_ram_reopen_prepare(BDRVReopenState *reopen_state,
+                                    BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void cache_ram_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                 BdrvChildRole role,
+                                 BlockReopenQueue *reopen_queue,
+                                 uint64_t perm, uint64_t shared,
+                                 uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /* Writes that bypass the filter would leave stale data in the cache */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+cache_ram_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+/* Copy the part of cluster @cluster that the request covers into @qiov */
+static void cache_ram_copy_out(uint64_t cluster, const void *data,
+                               int64_t offset, int64_t bytes,
+                               QEMUIOVector *qiov, size_t qiov_offset)
+{
+    int64_t cluster_offset = cluster * CACHE_RAM_CLUSTER_SIZE;
+    int64_t start = MAX(cluster_offset, offset);
+    int64_t end = MIN(cluster_offset + CACHE_RAM_CLUSTER_SIZE,
+                      offset + bytes);
+
+    qemu_iovec_from_buf(qiov, qiov_offset + start - offset,
+                        data + start - cluster_offset, end - start);
+}
+
+/*
+ * Read @n missing clusters starting at @cluster from the child with one
+ * request and add them to the cache, unless a write came in between.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+cache_ram_co_fill(BlockDriverState *bs, uint64_t cluster, uint64_t n,
+                  int64_t offset, int64_t bytes, QEMUIOVector *qiov,
+                  size_t qiov_offset, bool may_insert, uint64_t write_gen)
+{
+    BDRVCacheRamState *s = bs->opaque;
+    CacheRam *cache = s->cache;
+    int64_t fill_offset = cluster * CACHE_RAM_CLUSTER_SIZE;
+    int64_t fill_bytes, length;
+    void *data[CACHE_RAM_MAX_RUN] = { NULL };
+    QEMUIOVector local_qiov;
+    uint64_t i;
+    int ret;
+
+    length = bdrv_co_getlength(bs->file->bs);
+    if (length < 0) {
+        return length;
+    }
+    fill_bytes = MIN(n * CACHE_RAM_CLUSTER_SIZE, length - fill_offset);
+
+    qemu_iovec_init(&local_qiov, n);
+    for (i = 0; i < n; i++) {
+        size_t len = MIN(CACHE_RAM_CLUSTER_SIZE,
+                         fill_bytes - i * CACHE_RAM_CLUSTER_SIZE);
+
+        data[i] = qemu_try_blockalign(bs->file->bs, CACHE_RAM_CLUSTER_SIZE);
+        if (!data[i]) {
+            /* Out of memory, just pass the request through */
+            int64_t start = MAX(fill_offset, offset);
+            int64_t end = MIN(fill_offset + n * CACHE_RAM_CLUSTER_SIZE,
+                              offset + bytes);
+
+            ret = bdrv_co_preadv_part(bs->file, start, end - start, qiov,
+                                      qiov_offset + start - offset, 0);
+            goto out;
+        }
+        if (len < CACHE_RAM_CLUSTER_SIZE) {
+            /* Tail of the image */
+            memset(data[i] + len, 0, CACHE_RAM_CLUSTER_SIZE - len);
+        }
+        qemu_iovec_add(&local_qiov, data[i], len);
+    }
+
+    ret = bdrv_co_preadv(bs->file, fill_offset, fill_bytes, &local_qiov, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        cache_ram_copy_out(cluster + i, data[i], offset, bytes, qiov,
+                           qiov_offset);
+    }
+
+    qemu_mutex_lock(&cache->lock);
+    if (may_insert && s->write_gen == write_gen) {
+        for (i = 0; i < n; i++) {
+            if (cache_ram_insert(cache, s, cluster + i, data[i])) {
+                data[i] = NULL;
+            }
+        }
+    }
+    qemu_mutex_unlock(&cache->lock);
+
+out:
+    for (i = 0; i < n; i++) {
+        qemu_vfree(data[i]);
+    }
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+cache_ram_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                         QEMUIOVector *qiov, size_t qiov_offset,
+                         BdrvRequestFlags flags)
+{
+    BDRVCacheRamState *s = bs->opaque;
+    CacheRam *cache = s->cache;
+    uint64_t cluster = offset / CACHE_RAM_CLUSTER_SIZE;
+    uint64_t end = DIV_ROUND_UP(offset + bytes, CACHE_RAM_CLUSTER_SIZE);
+    int ret;
+
+    while (cluster < end) {
+        CacheRamEntry *e;
+        bool may_insert;
+        uint64_t write_gen;
+        uint64_t n;
+
+        qemu_mutex_lock(&cache->lock);
+
+        /* Serve hits up to the next miss */
+        while (cluster < end) {
+            e = cache_ram_lookup(cache, s, cluster);
+            if (!e || !e->data) {
+                break;
+            }
+            cache_ram_copy_out(cluster, e->data, offset, bytes, qiov,
+                               qiov_offset);
+            cache_ram_move(cache, e, CACHE_RAM_T2);
+            s->hits++;
+            cluster++;
+        }
+        if (cluster == end) {
+            qemu_mutex_unlock(&cache->lock);
+            break;
+        }
+
+        /* Then read the following misses together */
+        for (n = 1; cluster + n < end && n < CACHE_RAM_MAX_RUN; n++) {
+            e = cache_ram_lookup(cache, s, cluster + n);
+            if (e && e->data) {
+                break;
+            }
+        }
+        s->misses += n;
+        may_insert = !s->writes_in_flight;
+        write_gen = s->write_gen;
+
+        qemu_mutex_unlock(&cache->lock);
+
+        trace_cache_ram_miss(bs, cluster, n);
+        ret = cache_ram_co_fill(bs, cluster, n, offset, bytes, qiov,
+                                qiov_offset, may_insert, write_gen);
+        if (ret < 0) {
+            return ret;
+        }
+        cluster += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Drop the clusters that a write modifies, and keep reads that race with
+ * the write from adding them back with old data.
+ */
+static void cache_ram_write_begin(BlockDriverState *bs, int64_t offset,
+                                  int64_t bytes)
+{
+    BDRVCacheRamState *s = bs->opaque;
+
+    qemu_mutex_lock(&s->cache->lock);
+    s->writes_in_flight++;
+    s->write_gen++;
+    cache_ram_invalidate(s, offset / CACHE_RAM_CLUSTER_SIZE,
+                         DIV_ROUND_UP(offset + bytes, CACHE_RAM_CLUSTER_SIZE));
+    qemu_mutex_unlock(&s->cache->lock);
+}
+
+static void cache_ram_write_end(BlockDriverState *bs)
+{
+    BDRVCacheRamState *s = bs->opaque;
+
+    qemu_mutex_lock(&s->cache->lock);
+    s->writes_in_flight--;
+    qemu_mutex_unlock(&s->cache->lock);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+cache_ram_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          QEMUIOVector *qiov, size_t qiov_offset,
+                          BdrvRequestFlags flags)
+{
+    int ret;
+
+    cache_ram_write_begin(bs, offset, bytes);
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+    cache_ram_write_end(bs);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+cache_ram_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                           BdrvRequestFlags flags)
+{
+    int ret;
+
+    cache_ram_write_begin(bs, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    cache_ram_write_end(bs);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+cache_ram_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    int ret;
+
+    cache_ram_write_begin(bs, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    cache_ram_write_end(bs);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+cache_ram_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                      PreallocMode prealloc, BdrvRequestFlags flags,
+                      Error **errp)
+{
+    BDRVCacheRamState *s = bs->opaque;
+    int ret;
+
+    qemu_mutex_lock(&s->cache->lock);
+    s->writes_in_flight++;
+    s->write_gen++;
+    cache_ram_invalidate_node(s);
+    qemu_mutex_unlock(&s->cache->lock);
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+    cache_ram_write_end(bs);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK cache_ram_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+cache_ram_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVCacheRamState *s = bs->opaque;
+
+    /* The image may have been changed by the migration source */
+    qemu_mutex_lock(&s->cache->lock);
+    s->write_gen++;
+    cache_ram_invalidate_node(s);
+    qemu_mutex_unlock(&s->cache->lock);
+}
+
+static BlockStatsSpecific *cache_ram_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVCacheRamState *s = bs->opaque;
+    CacheRam *cache = s->cache;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_CACHE_RAM;
+
+    qemu_mutex_lock(&cache->lock);
+    stats->u.cache_ram = (BlockStatsSpecificCacheRam) {
+        .hits = s->hits,
+        .misses = s->misses,
+        .evictions = s->evictions,
+        .cached_bytes = s->resident * CACHE_RAM_CLUSTER_SIZE,
+        .cache_size = cache->capacity * CACHE_RAM_CLUSTER_SIZE,
+        .cache_used = cache_ram_resident(cache) * CACHE_RAM_CLUSTER_SIZE,
+    };
+    qemu_mutex_unlock(&cache->lock);
+
+    return stats;
+}
+
+static BlockDriver bdrv_cache_ram = {
+    .format_name                        = "cache-ram",
+    .instance_size                      = sizeof(BDRVCacheRamState),
+
+    .bdrv_open                          = cache_ram_open,
+    .bdrv_close                         = cache_ram_close,
+    .bdrv_reopen_prepare                = cache_ram_reopen_prepare,
+    .bdrv_child_perm                    = cache_ram_child_perm,
+
+    .bdrv_co_getlength                  = cache_ram_co_getlength,
+
+    .bdrv_co_preadv_part                = cache_ram_co_preadv_part,
+    .bdrv_co_pwritev_part               = cache_ram_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = cache_ram_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = cache_ram_co_pdiscard,
+    .bdrv_co_truncate                   = cache_ram_co_truncate,
+    .bdrv_co_flush                      = cache_ram_co_flush,
+    .bdrv_co_invalidate_cache           = cache_ram_co_invalidate_cache,
+
+    .bdrv_detach_aio_context            = cache_ram_detach_aio_context,
+    .bdrv_attach_aio_context            = cache_ram_attach_aio_context,
+
+    .bdrv_get_specific_stats            = cache_ram_get_specific_stats,
+
+    .is_filter                          = true,
+};
+
+static void bdrv_cache_ram_init(void)
+{
+    bdrv_register(&bdrv_cache_ram);
+}
+
+block_init(bdrv_cache_ram_init);
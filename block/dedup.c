@@ -0,0 +1,1847 @@
+/*
+ * Deduplicating block filter
+ *
+ * A dedup node sits on top of the image of one guest, its "file" child, and
+ * moves the clusters written through it into a content-addressed store that
+ * the dedup nodes of many guests share, a dedup-store node.  Clusters with
+ * the same contents are kept once, however many guests write them.  A
+ * per-guest map, the "map" child, records which guest clusters are in the
+ * store; all other clusters are read from and written to the file child.
+ *
+ * Store slots are reference counted.  A slot is referenced on disk before
+ * a map that points to it reaches the disk, and released only after the
+ * maps that pointed to it have been written back, so a crash can leak
+ * slots but never lets a guest see data that is not its own.
+ *
+ * See docs/interop/dedup.rst for the on-disk formats.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qobject-input-visitor.h"
+#include "qapi/qapi-visit-block-core.h"
+#include "block/block_int.h"
+#include "block/qdict.h"
+#include "block/thread-pool.h"
+#include "crypto/hash.h"
+#include "system/block-backend.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/lockable.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "qemu/uuid.h"
+#include "trace.h"
+
+#define DEDUP_STORE_MAGIC ('Q' | 'D' << 8 | 'S' << 16 | 0xfbU << 24)
+#define DEDUP_MAP_MAGIC ('Q' | 'D' << 8 | 'M' << 16 | 0xfbU << 24)
+#define DEDUP_VERSION 1
+
+#define DEDUP_MIN_CLUSTER_BITS 12
+#define DEDUP_MAX_CLUSTER_BITS 21
+#define DEDUP_DEFAULT_CLUSTER_SIZE (64 * KiB)
+
+/* Keeps slot numbers + 1 within 32 bits */
+#define DEDUP_MAX_SLOTS (1U << 31)
+
+#define DEDUP_HASH_SIZE QCRYPTO_HASH_DIGEST_LEN_SHA256
+
+/* Map entries follow the header and are written back in blocks */
+#define DEDUP_MAP_HEADER_SIZE 4096
+#define DEDUP_MAP_BLOCK_SIZE 4096
+#define DEDUP_MAP_BLOCK_ENTRIES (DEDUP_MAP_BLOCK_SIZE / sizeof(uint32_t))
+
+typedef struct QEMU_PACKED DedupStoreHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint32_t reserved;
+    uint64_t nb_slots;
+    uint8_t id[16];
+} DedupStoreHeader;
+
+typedef struct QEMU_PACKED DedupStoreEntry {
+    uint8_t hash[DEDUP_HASH_SIZE];
+    uint64_t refcount;
+    uint8_t reserved[24];
+} DedupStoreEntry;
+
+QEMU_BUILD_BUG_ON(sizeof(DedupStoreEntry) != 64);
+
+typedef struct QEMU_PACKED DedupMapHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint32_t reserved;
+    uint64_t nb_clusters;
+    uint8_t store_id[16];
+} DedupMapHeader;
+
+typedef struct DedupSlot {
+    /* Must come first, it is the key of the index */
+    uint8_t hash[DEDUP_HASH_SIZE];
+    uint32_t index;
+    /* Map entries and writes in flight that reference the slot */
+    uint64_t refcount;
+    /* Reads in flight from the slot */
+    uint32_t readers;
+    /* The data is written, other writes may reference the slot */
+    bool published;
+    /* Value of flush_gen when the slot was published */
+    uint64_t publish_gen;
+} DedupSlot;
+
+/* The slots described by one store table cluster */
+typedef struct DedupChunk {
+    /* The store table cluster must be written back */
+    bool dirty;
+    DedupSlot slots[];
+} DedupChunk;
+
+typedef struct BDRVDedupStoreState {
+    DedupStoreHeader header;
+    uint32_t cluster_size;
+    uint32_t slots_per_chunk;
+
+    /* Protects everything below, never held across I/O */
+    QemuMutex lock;
+    /* Chunks are allocated separately, so DedupSlot pointers stay valid */
+    DedupChunk **chunks;
+    uint32_t nb_chunks;
+    uint32_t nb_slots;
+    /* Published DedupSlots with a reference, keyed by hash */
+    GHashTable *index;
+    /* Slots that can be reused */
+    GArray *free;
+    /* Unreferenced slots that may still be referenced on disk */
+    GArray *released;
+    uint64_t flush_gen;
+
+    /* Serializes flushes */
+    CoMutex flush_lock;
+
+    /* Maps of the dedup nodes that use the store, only for checks */
+    BdrvChild **maps;
+    int nb_maps;
+} BDRVDedupStoreState;
+
+typedef struct BDRVDedupState {
+    BdrvChild *store;
+    BdrvChild *map_child;
+    uint32_t cluster_size;
+    /* Clusters that lie completely inside the image, the tail never moves */
+    uint32_t nb_clusters;
+
+    /* Protects everything below, held while a stored cluster is copied */
+    CoMutex lock;
+    /* Guest cluster -> store slot + 1, or 0 if the file child has it */
+    uint32_t *map;
+    /* Map blocks that must be written back */
+    unsigned long *dirty_blocks;
+    /* The map child has no header yet */
+    bool map_empty;
+    /* Slots that the map stopped referencing, released after write back */
+    GArray *pending_unref;
+
+    /* Serializes flushes */
+    CoMutex flush_lock;
+} BDRVDedupState;
+
+static BlockDriver bdrv_dedup_store;
+static QemuOptsList dedup_store_create_opts;
+
+static void dedup_store_header_to_cpu(DedupStoreHeader *header)
+{
+    header->magic = le32_to_cpu(header->magic);
+    header->version = le32_to_cpu(header->version);
+    header->cluster_bits = le32_to_cpu(header->cluster_bits);
+    header->nb_slots = le64_to_cpu(header->nb_slots);
+}
+
+static void dedup_store_header_to_le(DedupStoreHeader *header)
+{
+    header->magic = cpu_to_le32(header->magic);
+    header->version = cpu_to_le32(header->version);
+    header->cluster_bits = cpu_to_le32(header->cluster_bits);
+    header->nb_slots = cpu_to_le64(header->nb_slots);
+}
+
+/*
+ * The store is a header cluster followed by chunks, each of which is a
+ * store table cluster followed by the data of the slots it describes.
+ */
+static uint64_t dedup_store_table_offset(BDRVDedupStoreState *st,
+                                         uint32_t chunk)
+{
+    return st->cluster_size +
+           (uint64_t)chunk * (st->slots_per_chunk + 1) * st->cluster_size;
+}
+
+static uint64_t dedup_store_slot_offset(BDRVDedupStoreState *st,
+                                        uint32_t index)
+{
+    return dedup_store_table_offset(st, index / st->slots_per_chunk) +
+           (uint64_t)(index % st->slots_per_chunk + 1) * st->cluster_size;
+}
+
+/* Called with st->lock held */
+static DedupSlot *dedup_store_slot(BDRVDedupStoreState *st, uint32_t index)
+{
+    DedupChunk *chunk;
+
+    assert(index < st->nb_slots);
+    chunk = st->chunks[index / st->slots_per_chunk];
+    return &chunk->slots[index % st->slots_per_chunk];
+}
+
+/* Called with st->lock held */
+static void dedup_store_mark_dirty(BDRVDedupStoreState *st, DedupSlot *slot)
+{
+    st->chunks[slot->index / st->slots_per_chunk]->dirty = true;
+}
+
+/* Make slots [0, nb_slots) addressable.  Called with st->lock held. */
+static void dedup_store_grow(BDRVDedupStoreState *st, uint32_t nb_slots)
+{
+    uint32_t nb_chunks = DIV_ROUND_UP(nb_slots, st->slots_per_chunk);
+    uint32_t i, j;
+
+    if (nb_chunks > st->nb_chunks) {
+        st->chunks = g_renew(DedupChunk *, st->chunks, nb_chunks);
+        for (i = st->nb_chunks; i < nb_chunks; i++) {
+            st->chunks[i] = g_malloc0(sizeof(DedupChunk) +
+                                      st->slots_per_chunk * sizeof(DedupSlot));
+            for (j = 0; j < st->slots_per_chunk; j++) {
+                st->chunks[i]->slots[j].index = i * st->slots_per_chunk + j;
+            }
+        }
+        st->nb_chunks = nb_chunks;
+    }
+    st->nb_slots = MAX(st->nb_slots, nb_slots);
+}
+
+static guint dedup_hash(gconstpointer key)
+{
+    return ldl_he_p(key);
+}
+
+static gboolean dedup_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, DEDUP_HASH_SIZE);
+}
+
+typedef struct DedupHashTask {
+    const void *buf;
+    size_t len;
+    uint8_t *hash;
+} DedupHashTask;
+
+static int dedup_hash_func(void *opaque)
+{
+    DedupHashTask *task = opaque;
+    size_t hash_len = DEDUP_HASH_SIZE;
+
+    return qcrypto_hash_bytes(QCRYPTO_HASH_ALGO_SHA256, task->buf, task->len,
+                              &task->hash, &hash_len, NULL);
+}
+
+/* Hashing a cluster is too slow for the AioContext, use a worker thread */
+static int coroutine_fn dedup_co_hash(const void *buf, size_t len,
+                                      uint8_t *hash)
+{
+    DedupHashTask task = {
+        .buf = buf,
+        .len = len,
+        .hash = hash,
+    };
+
+    return thread_pool_submit_co(dedup_hash_func, &task) < 0 ? -EIO : 0;
+}
+
+/* Take a new reference to the slot holding data with @hash, if any */
+static DedupSlot *dedup_store_ref(BDRVDedupStoreState *st, const uint8_t *hash)
+{
+    DedupSlot *slot;
+
+    QEMU_LOCK_GUARD(&st->lock);
+    slot = g_hash_table_lookup(st->index, hash);
+    if (slot) {
+        slot->refcount++;
+        dedup_store_mark_dirty(st, slot);
+    }
+    return slot;
+}
+
+/*
+ * Allocate a slot for new data with @hash.  It has one reference and is
+ * not found by dedup_store_ref() until dedup_store_publish() is called.
+ */
+static DedupSlot *dedup_store_alloc(BDRVDedupStoreState *st,
+                                    const uint8_t *hash)
+{
+    DedupSlot *slot;
+    uint32_t index;
+
+    QEMU_LOCK_GUARD(&st->lock);
+    if (st->free->len) {
+        index = g_array_index(st->free, uint32_t, st->free->len - 1);
+        g_array_set_size(st->free, st->free->len - 1);
+    } else if (st->nb_slots < DEDUP_MAX_SLOTS) {
+        index = st->nb_slots;
+        dedup_store_grow(st, index + 1);
+    } else {
+        return NULL;
+    }
+
+    slot = dedup_store_slot(st, index);
+    assert(!slot->refcount && !slot->readers);
+    memcpy(slot->hash, hash, DEDUP_HASH_SIZE);
+    slot->refcount = 1;
+    slot->published = false;
+    dedup_store_mark_dirty(st, slot);
+    return slot;
+}
+
+/* The data of @slot is written, let other writes find it */
+static void dedup_store_publish(BDRVDedupStoreState *st, DedupSlot *slot)
+{
+    QEMU_LOCK_GUARD(&st->lock);
+    slot->published = true;
+    slot->publish_gen = st->flush_gen;
+    /* A concurrent write of the same data may have been faster */
+    if (!g_hash_table_contains(st->index, slot->hash)) {
+        g_hash_table_add(st->index, slot);
+    }
+}
+
+/* Called with st->lock held */
+static void dedup_store_release(BDRVDedupStoreState *st, DedupSlot *slot)
+{
+    if (!slot->refcount && !slot->readers) {
+        g_array_append_val(st->released, slot->index);
+    }
+}
+
+static void dedup_store_unref(BDRVDedupStoreState *st, DedupSlot *slot)
+{
+    QEMU_LOCK_GUARD(&st->lock);
+    assert(slot->refcount);
+    dedup_store_mark_dirty(st, slot);
+    if (--slot->refcount) {
+        return;
+    }
+    if (g_hash_table_lookup(st->index, slot->hash) == slot) {
+        g_hash_table_remove(st->index, slot->hash);
+    }
+    dedup_store_release(st, slot);
+}
+
+static void dedup_store_unref_index(BDRVDedupStoreState *st, uint32_t index)
+{
+    DedupSlot *slot;
+
+    WITH_QEMU_LOCK_GUARD(&st->lock) {
+        slot = dedup_store_slot(st, index);
+    }
+    dedup_store_unref(st, slot);
+}
+
+/* Keep the slot from being reused while it is read */
+static DedupSlot *dedup_store_get_reader(BDRVDedupStoreState *st,
+                                         uint32_t index)
+{
+    DedupSlot *slot;
+
+    QEMU_LOCK_GUARD(&st->lock);
+    slot = dedup_store_slot(st, index);
+    slot->readers++;
+    return slot;
+}
+
+static void dedup_store_put_reader(BDRVDedupStoreState *st, DedupSlot *slot)
+{
+    QEMU_LOCK_GUARD(&st->lock);
+    assert(slot->readers);
+    slot->readers--;
+    dedup_store_release(st, slot);
+}
+
+/*
+ * Read @bytes at @offset inside the data of slot @index.  The dedup nodes
+ * only access the store through their "store" child and these functions,
+ * its file belongs to the dedup-store node.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_read_slot(BdrvChild *store, uint32_t index, uint64_t offset,
+                         int64_t bytes, QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BlockDriverState *bs = store->bs;
+    BDRVDedupStoreState *st = bs->opaque;
+    int ret;
+
+    assert(offset + bytes <= st->cluster_size);
+    bdrv_inc_in_flight(bs);
+    ret = bdrv_co_preadv_part(bs->file,
+                              dedup_store_slot_offset(st, index) + offset,
+                              bytes, qiov, qiov_offset, 0);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
+/* Write the data of @slot, which must not be published yet */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_write_slot(BdrvChild *store, DedupSlot *slot, const void *buf)
+{
+    BlockDriverState *bs = store->bs;
+    BDRVDedupStoreState *st = bs->opaque;
+    int ret;
+
+    assert(!slot->published);
+    bdrv_inc_in_flight(bs);
+    ret = bdrv_co_pwrite(bs->file, dedup_store_slot_offset(st, slot->index),
+                         st->cluster_size, buf, 0);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
+/* Host offset and node of the data of slot @index, for block status */
+static int64_t GRAPH_RDLOCK
+dedup_store_slot_map(BdrvChild *store, uint32_t index,
+                     BlockDriverState **file)
+{
+    BlockDriverState *bs = store->bs;
+
+    *file = bs->file->bs;
+    return dedup_store_slot_offset(bs->opaque, index);
+}
+
+/* Drop the in-memory state of the store */
+static void dedup_store_reset(BDRVDedupStoreState *st)
+{
+    uint32_t i;
+
+    for (i = 0; i < st->nb_chunks; i++) {
+        g_free(st->chunks[i]);
+    }
+    g_free(st->chunks);
+    st->chunks = NULL;
+    st->nb_chunks = 0;
+    st->nb_slots = 0;
+    g_hash_table_remove_all(st->index);
+    g_array_set_size(st->free, 0);
+    g_array_set_size(st->released, 0);
+}
+
+static int coroutine_mixed_fn GRAPH_RDLOCK
+dedup_store_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVDedupStoreState *st = bs->opaque;
+    DedupStoreHeader *header = &st->header;
+    DedupStoreEntry *table;
+    uint32_t i, j;
+    int ret;
+
+    ret = bdrv_pread(bs->file, 0, sizeof(*header), header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read header");
+        return ret;
+    }
+    dedup_store_header_to_cpu(header);
+
+    if (header->magic != DEDUP_STORE_MAGIC) {
+        error_setg(errp, "Image not in dedup-store format");
+        return -EINVAL;
+    }
+    if (header->version != DEDUP_VERSION) {
+        error_setg(errp, "Unsupported dedup-store version %" PRIu32,
+                   header->version);
+        return -ENOTSUP;
+    }
+    if (header->cluster_bits < DEDUP_MIN_CLUSTER_BITS ||
+        header->cluster_bits > DEDUP_MAX_CLUSTER_BITS) {
+        error_setg(errp, "Unsupported cluster size: 2^%" PRIu32,
+                   header->cluster_bits);
+        return -EINVAL;
+    }
+    if (header->nb_slots > DEDUP_MAX_SLOTS) {
+        error_setg(errp, "Too many slots: %" PRIu64, header->nb_slots);
+        return -EINVAL;
+    }
+
+    st->cluster_size = 1U << header->cluster_bits;
+    st->slots_per_chunk = st->cluster_size / sizeof(DedupStoreEntry);
+
+    table = qemu_try_blockalign(bs->file->bs, st->cluster_size);
+    if (!table) {
+        error_setg(errp, "Could not allocate the store table buffer");
+        return -ENOMEM;
+    }
+
+    /* Nothing uses the store before it is opened or activated */
+    qemu_mutex_lock(&st->lock);
+    dedup_store_grow(st, header->nb_slots);
+    qemu_mutex_unlock(&st->lock);
+
+    for (i = 0; i < st->nb_chunks; i++) {
+        ret = bdrv_pread(bs->file, dedup_store_table_offset(st, i),
+                         st->cluster_size, table, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the store table");
+            goto out;
+        }
+        for (j = 0; j < st->slots_per_chunk; j++) {
+            DedupSlot *slot = &st->chunks[i]->slots[j];
+
+            if (slot->index >= st->nb_slots) {
+                break;
+            }
+            slot->refcount = le64_to_cpu(table[j].refcount);
+            if (!slot->refcount) {
+                g_array_append_val(st->free, slot->index);
+                continue;
+            }
+            memcpy(slot->hash, table[j].hash, DEDUP_HASH_SIZE);
+            slot->published = true;
+            if (!g_hash_table_contains(st->index, slot->hash)) {
+                g_hash_table_add(st->index, slot);
+            }
+        }
+    }
+
+    trace_dedup_store_load(bs, st->nb_slots);
+    ret = 0;
+out:
+    qemu_vfree(table);
+    return ret;
+}
+
+/*
+ * Fill @table with the entries of @chunk.  Slots whose data may not be
+ * stable on disk yet are written as free.  Returns whether there were
+ * any, so that the chunk stays dirty.
+ *
+ * Called with st->lock held.
+ */
+static bool dedup_store_fill_table(BDRVDedupStoreState *st, DedupChunk *chunk,
+                                   DedupStoreEntry *table, uint64_t gen)
+{
+    bool pending = false;
+    uint32_t j;
+
+    memset(table, 0, st->cluster_size);
+    for (j = 0; j < st->slots_per_chunk; j++) {
+        DedupSlot *slot = &chunk->slots[j];
+
+        if (!slot->refcount) {
+            continue;
+        }
+        if (!slot->published || slot->publish_gen >= gen) {
+            pending = true;
+            continue;
+        }
+        memcpy(table[j].hash, slot->hash, DEDUP_HASH_SIZE);
+        table[j].refcount = cpu_to_le64(slot->refcount);
+    }
+    return pending;
+}
+
+/*
+ * Write back the store table: data first, then the entries that describe
+ * it.  Slots released before the flush can be reused once it is done.
+ */
+static int coroutine_fn GRAPH_RDLOCK dedup_store_co_flush(BlockDriverState *bs)
+{
+    BDRVDedupStoreState *st = bs->opaque;
+    g_autoptr(GArray) released = NULL;
+    DedupStoreEntry *table = NULL;
+    DedupStoreHeader header;
+    uint32_t nb_chunks, i;
+    uint64_t gen;
+    int ret;
+
+    QEMU_LOCK_GUARD(&st->flush_lock);
+
+    WITH_QEMU_LOCK_GUARD(&st->lock) {
+        gen = ++st->flush_gen;
+        released = st->released;
+        st->released = g_array_new(false, false, sizeof(uint32_t));
+        nb_chunks = st->nb_chunks;
+        header = st->header;
+        header.nb_slots = st->nb_slots;
+    }
+
+    /* Data of the slots published before @gen must be stable first */
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    table = qemu_try_blockalign(bs->file->bs, st->cluster_size);
+    if (!table) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    for (i = 0; i < nb_chunks; i++) {
+        DedupChunk *chunk;
+        bool dirty;
+
+        WITH_QEMU_LOCK_GUARD(&st->lock) {
+            chunk = st->chunks[i];
+            dirty = chunk->dirty;
+            if (dirty) {
+                chunk->dirty = dedup_store_fill_table(st, chunk, table, gen);
+            }
+        }
+        if (!dirty) {
+            continue;
+        }
+
+        ret = bdrv_co_pwrite(bs->file, dedup_store_table_offset(st, i),
+                             st->cluster_size, table, 0);
+        if (ret < 0) {
+            WITH_QEMU_LOCK_GUARD(&st->lock) {
+                chunk->dirty = true;
+            }
+            goto fail;
+        }
+    }
+
+    if (header.nb_slots != st->header.nb_slots) {
+        uint64_t nb_slots = header.nb_slots;
+
+        dedup_store_header_to_le(&header);
+        ret = bdrv_co_pwrite(bs->file, 0, sizeof(header), &header, 0);
+        if (ret < 0) {
+            goto fail;
+        }
+        WITH_QEMU_LOCK_GUARD(&st->lock) {
+            st->header.nb_slots = nb_slots;
+        }
+    }
+
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&st->lock) {
+        g_array_append_vals(st->free, released->data, released->len);
+    }
+    qemu_vfree(table);
+    return 0;
+
+fail:
+    WITH_QEMU_LOCK_GUARD(&st->lock) {
+        g_array_append_vals(st->released, released->data, released->len);
+    }
+    qemu_vfree(table);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVDedupStoreState *st = bs->opaque;
+
+    bdi->cluster_size = st->cluster_size;
+    return 0;
+}
+
+static int dedup_store_probe(const uint8_t *buf, int buf_size,
+                             const char *filename)
+{
+    const DedupStoreHeader *header = (const void *)buf;
+
+    if (buf_size >= sizeof(*header) &&
+        le32_to_cpu(header->magic) == DEDUP_STORE_MAGIC &&
+        le32_to_cpu(header->version) == DEDUP_VERSION) {
+        return 100;
+    }
+    return 0;
+}
+
+static void dedup_store_free(BDRVDedupStoreState *st)
+{
+    /* The map children themselves are dropped with the other children */
+    g_free(st->maps);
+    st->maps = NULL;
+    dedup_store_reset(st);
+    g_hash_table_unref(st->index);
+    g_array_unref(st->free);
+    g_array_unref(st->released);
+    qemu_mutex_destroy(&st->lock);
+}
+
+static int dedup_store_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVDedupStoreState *st = bs->opaque;
+    int i, ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    st->nb_maps = qdict_array_entries(options, "maps.");
+    if (st->nb_maps < 0) {
+        error_setg(errp, "Option maps is not a valid array");
+        return -EINVAL;
+    }
+    st->maps = g_new0(BdrvChild *, st->nb_maps);
+    for (i = 0; i < st->nb_maps; i++) {
+        g_autofree char *name = g_strdup_printf("maps.%d", i);
+
+        st->maps[i] = bdrv_open_child(NULL, options, name, bs, &child_of_bds,
+                                      BDRV_CHILD_METADATA, false, errp);
+        if (!st->maps[i]) {
+            g_free(st->maps);
+            st->maps = NULL;
+            return -EINVAL;
+        }
+    }
+
+    qemu_mutex_init(&st->lock);
+    qemu_co_mutex_init(&st->flush_lock);
+    st->index = g_hash_table_new(dedup_hash, dedup_hash_equal);
+    st->free = g_array_new(false, false, sizeof(uint32_t));
+    st->released = g_array_new(false, false, sizeof(uint32_t));
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    ret = dedup_store_load(bs, errp);
+    if (ret < 0) {
+        dedup_store_free(st);
+        return ret;
+    }
+
+    /* The store is only accessed through the dedup nodes that use it */
+    bs->total_sectors = 0;
+    return 0;
+}
+
+static int dedup_store_reopen_prepare(BDRVReopenState *state,
+                                      BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void dedup_store_close(BlockDriverState *bs)
+{
+    dedup_store_free(bs->opaque);
+}
+
+static int GRAPH_RDLOCK dedup_store_inactivate(BlockDriverState *bs)
+{
+    return bdrv_flush(bs);
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+dedup_store_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVDedupStoreState *st = bs->opaque;
+
+    /* The source of the migration changed the store while we were inactive */
+    dedup_store_reset(st);
+    dedup_store_load(bs, errp);
+}
+
+static void dedup_store_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                   BdrvChildRole role,
+                                   BlockReopenQueue *reopen_queue,
+                                   uint64_t perm, uint64_t shared,
+                                   uint64_t *nperm, uint64_t *nshared)
+{
+    if (role & BDRV_CHILD_PRIMARY) {
+        bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                           nperm, nshared);
+        return;
+    }
+
+    /* The maps are only read by checks */
+    *nperm = BLK_PERM_CONSISTENT_READ;
+    *nshared = BLK_PERM_ALL;
+}
+
+/*
+ * Count the references of map @m to each slot in @refs.  Returns 0 if the
+ * map could be read, even if it references slots that do not exist.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_count_refs(BlockDriverState *bs, BdrvChild *m, uint64_t *refs,
+                       BdrvCheckResult *res)
+{
+    BDRVDedupStoreState *st = bs->opaque;
+    g_autofree uint32_t *block = g_new(uint32_t, DEDUP_MAP_BLOCK_ENTRIES);
+    DedupMapHeader header;
+    uint64_t nb_clusters, i;
+    int64_t len;
+    int ret;
+
+    len = bdrv_co_getlength(m->bs);
+    if (len < 0) {
+        return len;
+    }
+    if (len == 0) {
+        /* Nothing was ever written to the store through this map */
+        return 0;
+    }
+
+    ret = bdrv_co_pread(m, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    if (le32_to_cpu(header.magic) != DEDUP_MAP_MAGIC ||
+        le32_to_cpu(header.version) != DEDUP_VERSION ||
+        le32_to_cpu(header.cluster_bits) != st->header.cluster_bits ||
+        memcmp(header.store_id, st->header.id, sizeof(header.store_id))) {
+        fprintf(stderr, "ERROR '%s' is not a map of this store\n",
+                bdrv_get_node_name(m->bs));
+        return -EINVAL;
+    }
+
+    nb_clusters = le64_to_cpu(header.nb_clusters);
+    for (i = 0; i < nb_clusters; i += DEDUP_MAP_BLOCK_ENTRIES) {
+        uint64_t n = MIN(DEDUP_MAP_BLOCK_ENTRIES, nb_clusters - i);
+        uint64_t j;
+
+        ret = bdrv_co_pread(m, DEDUP_MAP_HEADER_SIZE + i * sizeof(uint32_t),
+                            n * sizeof(uint32_t), block, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        for (j = 0; j < n; j++) {
+            uint32_t entry = le32_to_cpu(block[j]);
+
+            if (!entry) {
+                continue;
+            }
+            if (entry > st->nb_slots) {
+                fprintf(stderr, "ERROR '%s' cluster %" PRIu64 " references "
+                        "slot %" PRIu32 " beyond the end of the store\n",
+                        bdrv_get_node_name(m->bs), i + j, entry - 1);
+                res->corruptions++;
+                continue;
+            }
+            refs[entry - 1]++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Give a free slot back the reference of a map.  Its table entry was
+ * cleared, so the hash is computed again from the data.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_revive_slot(BlockDriverState *bs, DedupSlot *slot, void *buf)
+{
+    BDRVDedupStoreState *st = bs->opaque;
+    uint32_t i;
+    int ret;
+
+    ret = bdrv_co_pread(bs->file, dedup_store_slot_offset(st, slot->index),
+                        st->cluster_size, buf, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = dedup_co_hash(buf, st->cluster_size, slot->hash);
+    if (ret < 0) {
+        return ret;
+    }
+
+    QEMU_LOCK_GUARD(&st->lock);
+    for (i = 0; i < st->free->len; i++) {
+        if (g_array_index(st->free, uint32_t, i) == slot->index) {
+            g_array_remove_index_fast(st->free, i);
+            break;
+        }
+    }
+    slot->published = true;
+    slot->publish_gen = st->flush_gen;
+    if (!g_hash_table_contains(st->index, slot->hash)) {
+        g_hash_table_add(st->index, slot);
+    }
+    return 0;
+}
+
+/*
+ * Without maps, only the data of the slots in use is checked against its
+ * hash.  With the maps of all dedup nodes that use the store, the
+ * reference counts are also computed again: counts that are too high leak
+ * slots, counts that are too low let a slot be reused while a map still
+ * points to it.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_check(BlockDriverState *bs, BdrvCheckResult *res,
+                     BdrvCheckMode fix)
+{
+    BDRVDedupStoreState *st = bs->opaque;
+    g_autofree uint64_t *refs = NULL;
+    uint8_t *buf;
+    bool repaired = false;
+    uint32_t i;
+    int ret = 0;
+
+    if (st->nb_maps) {
+        refs = g_new0(uint64_t, st->nb_slots);
+        for (i = 0; i < st->nb_maps; i++) {
+            ret = dedup_store_count_refs(bs, st->maps[i], refs, res);
+            if (ret < 0) {
+                res->check_errors++;
+                return ret;
+            }
+        }
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, st->cluster_size);
+    if (!buf) {
+        res->check_errors++;
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < st->nb_slots; i++) {
+        DedupSlot *slot = dedup_store_slot(st, i);
+        uint64_t refcount = slot->refcount;
+        uint8_t hash[DEDUP_HASH_SIZE];
+
+        if (refcount) {
+            ret = bdrv_co_pread(bs->file, dedup_store_slot_offset(st, i),
+                                st->cluster_size, buf, 0);
+            if (ret < 0) {
+                res->check_errors++;
+                goto out;
+            }
+            ret = dedup_co_hash(buf, st->cluster_size, hash);
+            if (ret < 0) {
+                res->check_errors++;
+                goto out;
+            }
+            if (memcmp(hash, slot->hash, DEDUP_HASH_SIZE)) {
+                fprintf(stderr, "ERROR slot %" PRIu32 ": data does not match "
+                        "its hash\n", i);
+                res->corruptions++;
+            }
+        }
+
+        if (!refs || refs[i] == refcount) {
+            continue;
+        }
+
+        if (refs[i] < refcount) {
+            fprintf(stderr, "%s slot %" PRIu32 " refcount=%" PRIu64
+                    " reference=%" PRIu64 "\n",
+                    fix & BDRV_FIX_LEAKS ? "Repairing" : "Leaked",
+                    i, refcount, refs[i]);
+            res->leaks++;
+            if (!(fix & BDRV_FIX_LEAKS)) {
+                continue;
+            }
+            res->leaks_fixed++;
+        } else {
+            fprintf(stderr, "%s slot %" PRIu32 " refcount=%" PRIu64
+                    " reference=%" PRIu64 "\n",
+                    fix & BDRV_FIX_ERRORS ? "Repairing" : "ERROR",
+                    i, refcount, refs[i]);
+            res->corruptions++;
+            if (!(fix & BDRV_FIX_ERRORS)) {
+                continue;
+            }
+            if (!refcount) {
+                ret = dedup_store_co_revive_slot(bs, slot, buf);
+                if (ret < 0) {
+                    res->check_errors++;
+                    goto out;
+                }
+            }
+            res->corruptions_fixed++;
+        }
+
+        WITH_QEMU_LOCK_GUARD(&st->lock) {
+            slot->refcount = refs[i];
+            dedup_store_mark_dirty(st, slot);
+            if (!slot->refcount) {
+                if (g_hash_table_lookup(st->index, slot->hash) == slot) {
+                    g_hash_table_remove(st->index, slot->hash);
+                }
+                /* No map references the slot, it can be reused at once */
+                g_array_append_val(st->free, slot->index);
+            }
+        }
+        repaired = true;
+    }
+
+    if (repaired) {
+        ret = dedup_store_co_flush(bs);
+        if (ret < 0) {
+            res->check_errors++;
+            goto out;
+        }
+    }
+
+    res->image_end_offset = st->nb_slots ?
+        dedup_store_slot_offset(st, st->nb_slots - 1) + st->cluster_size :
+        st->cluster_size;
+    ret = 0;
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_UNLOCKED
+dedup_store_co_create(BlockdevCreateOptions *create_options, Error **errp)
+{
+    BlockdevCreateOptionsDedupStore *store_opts;
+    BlockDriverState *bs_file = NULL;
+    BlockBackend *blk = NULL;
+    DedupStoreHeader header = { 0 };
+    uint64_t cluster_size;
+    QemuUUID id;
+    int ret;
+
+    assert(create_options->driver == BLOCKDEV_DRIVER_DEDUP_STORE);
+    store_opts = &create_options->u.dedup_store;
+
+    cluster_size = store_opts->has_cluster_size ?
+                   store_opts->cluster_size : DEDUP_DEFAULT_CLUSTER_SIZE;
+    if (!is_power_of_2(cluster_size) ||
+        cluster_size < (1 << DEDUP_MIN_CLUSTER_BITS) ||
+        cluster_size > (1 << DEDUP_MAX_CLUSTER_BITS)) {
+        error_setg(errp, "Cluster size must be a power of two between "
+                   "%d and %dk", 1 << DEDUP_MIN_CLUSTER_BITS,
+                   1 << (DEDUP_MAX_CLUSTER_BITS - 10));
+        return -EINVAL;
+    }
+
+    bs_file = bdrv_co_open_blockdev_ref(store_opts->file, errp);
+    if (!bs_file) {
+        return -EIO;
+    }
+
+    blk = blk_co_new_with_bs(bs_file, BLK_PERM_WRITE | BLK_PERM_RESIZE,
+                             BLK_PERM_ALL, errp);
+    if (!blk) {
+        ret = -EPERM;
+        goto out;
+    }
+    blk_set_allow_write_beyond_eof(blk, true);
+
+    ret = blk_co_truncate(blk, 0, true, PREALLOC_MODE_OFF, 0, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Maps remember the store they were created for */
+    qemu_uuid_generate(&id);
+    header.magic = DEDUP_STORE_MAGIC;
+    header.version = DEDUP_VERSION;
+    header.cluster_bits = ctz32(cluster_size);
+    memcpy(header.id, id.data, sizeof(header.id));
+
+    dedup_store_header_to_le(&header);
+    ret = blk_co_pwrite(blk, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write header");
+        goto out;
+    }
+
+    ret = 0;
+out:
+    blk_co_unref(blk);
+    bdrv_co_unref(bs_file);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_UNLOCKED
+dedup_store_co_create_opts(BlockDriver *drv, const char *filename,
+                           QemuOpts *opts, Error **errp)
+{
+    BlockdevCreateOptions *create_options = NULL;
+    BlockDriverState *bs_file = NULL;
+    QDict *qdict;
+    Visitor *v;
+    int ret;
+
+    static const QDictRenames opt_renames[] = {
+        { BLOCK_OPT_CLUSTER_SIZE,       "cluster-size" },
+        { NULL, NULL },
+    };
+
+    qdict = qemu_opts_to_qdict_filtered(opts, NULL, &dedup_store_create_opts,
+                                        true);
+    if (!qdict_rename_keys(qdict, opt_renames, errp)) {
+        ret = -EINVAL;
+        goto done;
+    }
+
+    ret = bdrv_co_create_file(filename, opts, errp);
+    if (ret < 0) {
+        goto done;
+    }
+
+    bs_file = bdrv_co_open(filename, NULL, NULL,
+                           BDRV_O_RDWR | BDRV_O_RESIZE | BDRV_O_PROTOCOL, errp);
+    if (!bs_file) {
+        ret = -EIO;
+        goto done;
+    }
+
+    qdict_put_str(qdict, "driver", "dedup-store");
+    qdict_put_str(qdict, "file", bs_file->node_name);
+
+    v = qobject_input_visitor_new_flat_confused(qdict, errp);
+    if (!v) {
+        ret = -EINVAL;
+        goto done;
+    }
+    visit_type_BlockdevCreateOptions(v, NULL, &create_options, errp);
+    visit_free(v);
+    if (!create_options) {
+        ret = -EINVAL;
+        goto done;
+    }
+
+    ret = dedup_store_co_create(create_options, errp);
+done:
+    qobject_unref(qdict);
+    qapi_free_BlockdevCreateOptions(create_options);
+    bdrv_co_unref(bs_file);
+    return ret;
+}
+
+static QemuOptsList dedup_store_create_opts = {
+    .name = "dedup-store-create-opts",
+    .head = QTAILQ_HEAD_INITIALIZER(dedup_store_create_opts.head),
+    .desc = {
+        {
+            .name = BLOCK_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Deduplication granularity",
+            .def_value_str = stringify(DEDUP_DEFAULT_CLUSTER_SIZE)
+        },
+        { /* end of list */ }
+    }
+};
+
+/*
+ * Put the data of guest @cluster into the store and return its slot, with
+ * a new reference, in @pslot.  Clusters of zeroes are written to the file
+ * child instead, and @pslot is set to NULL.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_put_cluster(BlockDriverState *bs, uint32_t cluster,
+                     const uint8_t *buf, DedupSlot **pslot)
+{
+    BDRVDedupState *s = bs->opaque;
+    BDRVDedupStoreState *st = s->store->bs->opaque;
+    uint8_t hash[DEDUP_HASH_SIZE];
+    DedupSlot *slot;
+    int ret;
+
+    *pslot = NULL;
+    if (buffer_is_zero(buf, s->cluster_size)) {
+        return bdrv_co_pwrite_zeroes(bs->file,
+                                     (uint64_t)cluster * s->cluster_size,
+                                     s->cluster_size, 0);
+    }
+
+    ret = dedup_co_hash(buf, s->cluster_size, hash);
+    if (ret < 0) {
+        return ret;
+    }
+
+    slot = dedup_store_ref(st, hash);
+    if (slot) {
+        trace_dedup_write_cluster(bs, cluster, slot->index, true);
+        *pslot = slot;
+        return 0;
+    }
+
+    slot = dedup_store_alloc(st, hash);
+    if (!slot) {
+        return -ENOSPC;
+    }
+    trace_dedup_write_cluster(bs, cluster, slot->index, false);
+
+    ret = dedup_store_co_write_slot(s->store, slot, buf);
+    if (ret < 0) {
+        dedup_store_unref(st, slot);
+        return ret;
+    }
+
+    dedup_store_publish(st, slot);
+    *pslot = slot;
+    return 0;
+}
+
+/* Called with s->lock held */
+static int coroutine_fn GRAPH_RDLOCK dedup_co_init_map(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    BDRVDedupStoreState *st = s->store->bs->opaque;
+    DedupMapHeader header = {
+        .magic          = cpu_to_le32(DEDUP_MAP_MAGIC),
+        .version        = cpu_to_le32(DEDUP_VERSION),
+        .cluster_bits   = cpu_to_le32(ctz32(s->cluster_size)),
+        .nb_clusters    = cpu_to_le64(s->nb_clusters),
+    };
+    int ret;
+
+    if (!s->map_empty) {
+        return 0;
+    }
+
+    memcpy(header.store_id, st->header.id, sizeof(header.store_id));
+    ret = bdrv_co_pwrite_sync(s->map_child, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    s->map_empty = false;
+    return 0;
+}
+
+/*
+ * Point guest @cluster to @slot, whose reference passes to the map, or to
+ * the file child if @slot is NULL.  The slot that it pointed to before is
+ * released once the map has been written back.
+ *
+ * Called with s->lock held.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_set_map(BlockDriverState *bs, uint32_t cluster, DedupSlot *slot)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint32_t old = s->map[cluster];
+    uint32_t entry = slot ? slot->index + 1 : 0;
+    int ret;
+
+    if (entry) {
+        ret = dedup_co_init_map(bs);
+        if (ret < 0) {
+            dedup_store_unref(s->store->bs->opaque, slot);
+            return ret;
+        }
+    }
+
+    s->map[cluster] = entry;
+    if (entry != old) {
+        set_bit(cluster / DEDUP_MAP_BLOCK_ENTRIES, s->dirty_blocks);
+    }
+    if (old) {
+        old--;
+        g_array_append_val(s->pending_unref, old);
+    }
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_write_cluster(BlockDriverState *bs, uint32_t cluster,
+                       const uint8_t *buf)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupSlot *slot;
+    int ret;
+
+    ret = dedup_co_put_cluster(bs, cluster, buf, &slot);
+    if (ret < 0) {
+        return ret;
+    }
+
+    QEMU_LOCK_GUARD(&s->lock);
+    return dedup_co_set_map(bs, cluster, slot);
+}
+
+/*
+ * Write part of one cluster, or zeroes if @qiov is NULL.  Clusters in the
+ * store are copied, the others are written to the file child.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_write_partial(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                       QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint32_t cluster = offset / s->cluster_size;
+    uint64_t in_cluster = offset % s->cluster_size;
+    uint8_t *buf = NULL;
+    QEMUIOVector buf_qiov;
+    DedupSlot *slot;
+    uint32_t entry;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    entry = cluster < s->nb_clusters ? s->map[cluster] : 0;
+    if (!entry) {
+        qemu_co_mutex_unlock(&s->lock);
+        if (!qiov) {
+            return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, 0);
+        }
+        return bdrv_co_pwritev_part(bs->file, offset, bytes, qiov,
+                                    qiov_offset, 0);
+    }
+
+    /* The lock keeps other writes to the cluster out until it is copied */
+    buf = qemu_try_blockalign(bs, s->cluster_size);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    qemu_iovec_init_buf(&buf_qiov, buf, s->cluster_size);
+    ret = dedup_store_co_read_slot(s->store, entry - 1, 0, s->cluster_size,
+                                   &buf_qiov, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (qiov) {
+        qemu_iovec_to_buf(qiov, qiov_offset, buf + in_cluster, bytes);
+    } else {
+        memset(buf + in_cluster, 0, bytes);
+    }
+
+    ret = dedup_co_put_cluster(bs, cluster, buf, &slot);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = dedup_co_set_map(bs, cluster, slot);
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                      QEMUIOVector *qiov, size_t qiov_offset,
+                      BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint8_t *buf = NULL;
+    int ret = 0;
+
+    while (bytes) {
+        uint32_t cluster = offset / s->cluster_size;
+        int64_t n = MIN(bytes, s->cluster_size - offset % s->cluster_size);
+
+        if (n < s->cluster_size || cluster >= s->nb_clusters) {
+            ret = dedup_co_write_partial(bs, offset, n, qiov, qiov_offset);
+        } else {
+            if (!buf) {
+                buf = qemu_try_blockalign(bs, s->cluster_size);
+                if (!buf) {
+                    ret = -ENOMEM;
+                    break;
+                }
+            }
+            qemu_iovec_to_buf(qiov, qiov_offset, buf, s->cluster_size);
+            ret = dedup_co_write_cluster(bs, cluster, buf);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                       BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    int ret = 0;
+
+    while (bytes) {
+        uint32_t cluster = offset / s->cluster_size;
+        int64_t n = MIN(bytes, s->cluster_size - offset % s->cluster_size);
+        uint32_t i;
+
+        if (n < s->cluster_size || cluster >= s->nb_clusters) {
+            ret = dedup_co_write_partial(bs, offset, n, NULL, 0);
+        } else {
+            /* Whole clusters go back to the file child */
+            n = MIN(QEMU_ALIGN_DOWN(bytes, s->cluster_size),
+                    (int64_t)(s->nb_clusters - cluster) * s->cluster_size);
+            ret = bdrv_co_pwrite_zeroes(bs->file, offset, n,
+                                        flags & BDRV_REQ_MAY_UNMAP);
+            if (ret >= 0) {
+                QEMU_LOCK_GUARD(&s->lock);
+                for (i = cluster; i < cluster + n / s->cluster_size; i++) {
+                    if (s->map[i]) {
+                        dedup_co_set_map(bs, i, NULL);
+                    }
+                }
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        offset += n;
+        bytes -= n;
+    }
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVDedupState *s = bs->opaque;
+    int64_t start = ROUND_UP(offset, s->cluster_size);
+    int64_t end = MIN(QEMU_ALIGN_DOWN(offset + bytes, s->cluster_size),
+                      (int64_t)s->nb_clusters * s->cluster_size);
+
+    /* Discarding is advisory, only drop whole clusters */
+    if (start >= end) {
+        return 0;
+    }
+    return dedup_co_pwrite_zeroes(bs, start, end - start, BDRV_REQ_MAY_UNMAP);
+}
+
+/*
+ * Length of the run of clusters at @offset that are in the file child.
+ * Called with s->lock held.
+ */
+static int64_t dedup_file_run(BDRVDedupState *s, int64_t offset, int64_t bytes)
+{
+    uint64_t end = offset + bytes;
+    uint64_t cluster = offset / s->cluster_size + 1;
+
+    while (cluster * s->cluster_size < end &&
+           (cluster >= s->nb_clusters || !s->map[cluster])) {
+        cluster++;
+    }
+    return MIN(cluster * s->cluster_size, end) - offset;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     QEMUIOVector *qiov, size_t qiov_offset,
+                     BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    BDRVDedupStoreState *st = s->store->bs->opaque;
+    int ret = 0;
+
+    while (bytes) {
+        uint32_t cluster = offset / s->cluster_size;
+        uint64_t in_cluster = offset % s->cluster_size;
+        DedupSlot *slot = NULL;
+        int64_t n;
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            if (cluster < s->nb_clusters && s->map[cluster]) {
+                slot = dedup_store_get_reader(st, s->map[cluster] - 1);
+                n = MIN(bytes, s->cluster_size - in_cluster);
+            } else {
+                n = dedup_file_run(s, offset, bytes);
+            }
+        }
+
+        if (slot) {
+            ret = dedup_store_co_read_slot(s->store, slot->index, in_cluster,
+                                           n, qiov, qiov_offset);
+            dedup_store_put_reader(st, slot);
+        } else {
+            ret = bdrv_co_preadv_part(bs->file, offset, n, qiov, qiov_offset,
+                                      0);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_block_status(BlockDriverState *bs, unsigned int mode,
+                      int64_t offset, int64_t bytes, int64_t *pnum,
+                      int64_t *map, BlockDriverState **file)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint32_t cluster = offset / s->cluster_size;
+    uint64_t in_cluster = offset % s->cluster_size;
+    uint32_t entry = 0;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (cluster < s->nb_clusters) {
+        entry = s->map[cluster];
+    }
+    if (!entry) {
+        *pnum = dedup_file_run(s, offset, bytes);
+        *map = offset;
+        *file = bs->file->bs;
+        return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+    }
+
+    *pnum = MIN(bytes, s->cluster_size - in_cluster);
+    *map = dedup_store_slot_map(s->store, entry - 1, file) + in_cluster;
+    return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
+}
+
+/*
+ * Write back the map.  The file child and the store are flushed first, so
+ * that everything the map points to is stable, and the slots that the map
+ * stopped referencing are released afterwards.
+ */
+static int coroutine_fn GRAPH_RDLOCK dedup_co_flush(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    BDRVDedupStoreState *st = s->store->bs->opaque;
+    size_t nb_blocks = DIV_ROUND_UP(s->nb_clusters, DEDUP_MAP_BLOCK_ENTRIES);
+    size_t map_bytes = (size_t)s->nb_clusters * sizeof(uint32_t);
+    g_autoptr(GArray) unref = NULL;
+    g_autofree unsigned long *dirty = NULL;
+    g_autofree uint32_t *blocks = NULL;
+    size_t nb_dirty, i, j;
+    int ret;
+
+    QEMU_LOCK_GUARD(&s->flush_lock);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        dirty = s->dirty_blocks;
+        s->dirty_blocks = bitmap_new(nb_blocks);
+        unref = s->pending_unref;
+        s->pending_unref = g_array_new(false, false, sizeof(uint32_t));
+
+        nb_dirty = bitmap_count_one(dirty, nb_blocks);
+        blocks = g_new0(uint32_t, nb_dirty * DEDUP_MAP_BLOCK_ENTRIES);
+        j = 0;
+        for (i = find_first_bit(dirty, nb_blocks); i < nb_blocks;
+             i = find_next_bit(dirty, nb_blocks, i + 1), j++) {
+            uint32_t *block = &blocks[j * DEDUP_MAP_BLOCK_ENTRIES];
+            size_t first = i * DEDUP_MAP_BLOCK_ENTRIES;
+            size_t k;
+
+            for (k = 0; k < DEDUP_MAP_BLOCK_ENTRIES &&
+                        first + k < s->nb_clusters; k++) {
+                block[k] = cpu_to_le32(s->map[first + k]);
+            }
+        }
+    }
+
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_co_flush(s->store->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    j = 0;
+    for (i = find_first_bit(dirty, nb_blocks); i < nb_blocks;
+         i = find_next_bit(dirty, nb_blocks, i + 1), j++) {
+        uint64_t pos = (uint64_t)i * DEDUP_MAP_BLOCK_SIZE;
+
+        ret = bdrv_co_pwrite(s->map_child, DEDUP_MAP_HEADER_SIZE + pos,
+                             MIN(DEDUP_MAP_BLOCK_SIZE, map_bytes - pos),
+                             &blocks[j * DEDUP_MAP_BLOCK_ENTRIES], 0);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+    ret = bdrv_co_flush(s->map_child->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < unref->len; i++) {
+        dedup_store_unref_index(st, g_array_index(unref, uint32_t, i));
+    }
+    return 0;
+
+fail:
+    /* Try again with the next flush */
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        bitmap_or(s->dirty_blocks, s->dirty_blocks, dirty, nb_blocks);
+        g_array_append_vals(s->pending_unref, unref->data, unref->len);
+    }
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bdi->cluster_size = s->cluster_size;
+    return 0;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+dedup_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void dedup_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bs->bl.pdiscard_alignment = s->cluster_size;
+}
+
+static void dedup_child_perm(BlockDriverState *bs, BdrvChild *c,
+                             BdrvChildRole role,
+                             BlockReopenQueue *reopen_queue,
+                             uint64_t perm, uint64_t shared,
+                             uint64_t *nperm, uint64_t *nshared)
+{
+    if (role != BDRV_CHILD_DATA) {
+        bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                           nperm, nshared);
+        return;
+    }
+
+    /*
+     * The store is shared with the dedup nodes of other guests.  The store
+     * node itself keeps other processes away from its file.
+     */
+    *nperm = BLK_PERM_CONSISTENT_READ | (perm & BLK_PERM_WRITE);
+    *nshared = BLK_PERM_ALL;
+}
+
+static int coroutine_mixed_fn GRAPH_RDLOCK
+dedup_load_map(BlockDriverState *bs, Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    BDRVDedupStoreState *st = s->store->bs->opaque;
+    DedupMapHeader header;
+    int64_t len;
+    uint32_t i;
+    int ret;
+
+    memset(s->map, 0, (size_t)s->nb_clusters * sizeof(uint32_t));
+    bitmap_zero(s->dirty_blocks,
+                DIV_ROUND_UP(s->nb_clusters, DEDUP_MAP_BLOCK_ENTRIES));
+    g_array_set_size(s->pending_unref, 0);
+
+    len = bdrv_getlength(s->map_child->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the map size");
+        return len;
+    }
+    /* An empty map gets its header with the first write to the store */
+    s->map_empty = len == 0;
+    if (s->map_empty) {
+        return 0;
+    }
+
+    ret = bdrv_pread(s->map_child, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the map header");
+        return ret;
+    }
+    if (le32_to_cpu(header.magic) != DEDUP_MAP_MAGIC ||
+        le32_to_cpu(header.version) != DEDUP_VERSION) {
+        error_setg(errp, "Node '%s' is not a dedup map",
+                   bdrv_get_node_name(s->map_child->bs));
+        return -EINVAL;
+    }
+    if (memcmp(header.store_id, st->header.id, sizeof(header.store_id)) ||
+        le32_to_cpu(header.cluster_bits) != ctz32(s->cluster_size)) {
+        error_setg(errp, "The map was created for a different store");
+        return -EINVAL;
+    }
+    if (le64_to_cpu(header.nb_clusters) != s->nb_clusters) {
+        error_setg(errp, "The map does not match the size of the image");
+        return -EINVAL;
+    }
+
+    ret = bdrv_pread(s->map_child, DEDUP_MAP_HEADER_SIZE,
+                     (int64_t)s->nb_clusters * sizeof(uint32_t), s->map, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the map");
+        return ret;
+    }
+
+    QEMU_LOCK_GUARD(&st->lock);
+    for (i = 0; i < s->nb_clusters; i++) {
+        s->map[i] = le32_to_cpu(s->map[i]);
+        if (s->map[i] && (s->map[i] > st->nb_slots ||
+                          !dedup_store_slot(st, s->map[i] - 1)->refcount)) {
+            error_setg(errp, "Cluster %" PRIu32 " references store slot "
+                       "%" PRIu32 ", which is not in use", i, s->map[i] - 1);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static void dedup_free(BDRVDedupState *s)
+{
+    g_free(s->map);
+    g_free(s->dirty_blocks);
+    if (s->pending_unref) {
+        g_array_unref(s->pending_unref);
+    }
+}
+
+static int dedup_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    BDRVDedupStoreState *st;
+    int64_t len;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->store = bdrv_open_child(NULL, options, "store", bs, &child_of_bds,
+                               BDRV_CHILD_DATA, false, errp);
+    if (!s->store) {
+        return -EINVAL;
+    }
+
+    s->map_child = bdrv_open_child(NULL, options, "map", bs, &child_of_bds,
+                                   BDRV_CHILD_METADATA, false, errp);
+    if (!s->map_child) {
+        return -EINVAL;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    if (s->store->bs->drv != &bdrv_dedup_store) {
+        error_setg(errp, "'store' must be a dedup-store node");
+        return -EINVAL;
+    }
+    st = s->store->bs->opaque;
+    s->cluster_size = st->cluster_size;
+
+    len = bdrv_getlength(bs->file->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the image size");
+        return len;
+    }
+    if (len / s->cluster_size > UINT32_MAX) {
+        error_setg(errp, "Image is too large for the cluster size of the "
+                   "store");
+        return -EINVAL;
+    }
+    s->nb_clusters = len / s->cluster_size;
+
+    s->map = g_try_new(uint32_t, s->nb_clusters);
+    if (s->nb_clusters && !s->map) {
+        error_setg(errp, "Could not allocate the cluster map");
+        return -ENOMEM;
+    }
+    s->dirty_blocks = bitmap_new(DIV_ROUND_UP(s->nb_clusters,
+                                              DEDUP_MAP_BLOCK_ENTRIES));
+    s->pending_unref = g_array_new(false, false, sizeof(uint32_t));
+    qemu_co_mutex_init(&s->lock);
+    qemu_co_mutex_init(&s->flush_lock);
+
+    ret = dedup_load_map(bs, errp);
+    if (ret < 0) {
+        dedup_free(s);
+        return ret;
+    }
+
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
+    return 0;
+}
+
+static int dedup_reopen_prepare(BDRVReopenState *state,
+                                BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void dedup_close(BlockDriverState *bs)
+{
+    /* Slots that are still pending here leak, which is safe */
+    dedup_free(bs->opaque);
+}
+
+static int GRAPH_RDLOCK dedup_inactivate(BlockDriverState *bs)
+{
+    return bdrv_flush(bs);
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+dedup_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    dedup_load_map(bs, errp);
+}
+
+static const char *const dedup_strong_runtime_opts[] = {
+    "store",
+    "map",
+
+    NULL
+};
+
+static BlockDriver bdrv_dedup = {
+    .format_name                = "dedup",
+    .instance_size              = sizeof(BDRVDedupState),
+
+    .bdrv_open                  = dedup_open,
+    .bdrv_close                 = dedup_close,
+    .bdrv_reopen_prepare        = dedup_reopen_prepare,
+    .bdrv_child_perm            = dedup_child_perm,
+    .bdrv_refresh_limits        = dedup_refresh_limits,
+    .bdrv_inactivate            = dedup_inactivate,
+    .bdrv_co_invalidate_cache   = dedup_co_invalidate_cache,
+    .bdrv_co_getlength          = dedup_co_getlength,
+    .bdrv_co_block_status       = dedup_co_block_status,
+    .bdrv_co_get_info           = dedup_co_get_info,
+
+    .bdrv_co_preadv_part        = dedup_co_preadv_part,
+    .bdrv_co_pwritev_part       = dedup_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes      = dedup_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = dedup_co_pdiscard,
+    .bdrv_co_flush              = dedup_co_flush,
+
+    .strong_runtime_opts        = dedup_strong_runtime_opts,
+};
+
+static BlockDriver bdrv_dedup_store = {
+    .format_name                = "dedup-store",
+    .instance_size              = sizeof(BDRVDedupStoreState),
+    .create_opts                = &dedup_store_create_opts,
+    .is_format                  = true,
+
+    .bdrv_probe                 = dedup_store_probe,
+    .bdrv_open                  = dedup_store_open,
+    .bdrv_close                 = dedup_store_close,
+    .bdrv_reopen_prepare        = dedup_store_reopen_prepare,
+    .bdrv_child_perm            = dedup_store_child_perm,
+    .bdrv_inactivate            = dedup_store_inactivate,
+    .bdrv_co_invalidate_cache   = dedup_store_co_invalidate_cache,
+    .bdrv_co_create             = dedup_store_co_create,
+    .bdrv_co_create_opts        = dedup_store_co_create_opts,
+    .bdrv_co_get_info           = dedup_store_co_get_info,
+    .bdrv_co_flush              = dedup_store_co_flush,
+    .bdrv_co_check              = dedup_store_co_check,
+};
+
+static void bdrv_dedup_init(void)
+{
+    bdrv_register(&bdrv_dedup);
+    bdrv_register(&bdrv_dedup_store);
+}
+
+block_init(bdrv_dedup_init);
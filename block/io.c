@@ -1286,6 +1286,7 @@ bdrv_co_do_copy_on_readv(BdrvChild *child, int64_t offset, int64_t bytes,
                                           &local_qiov, 0,
                                           BDRV_REQ_WRITE_UNCHANGED);
             }
+            bdrv_amc_invalidate_range(bs, align_offset, pnum);
 
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
@@ -2056,6 +2057,13 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, int64_t bytes,
             break;
         }
     }
+
+    /* Allocation in this node changes the status of the nodes above it */
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        bdrv_amc_invalidate(bs);
+    } else {
+        bdrv_amc_invalidate_range(bs, offset, bytes);
+    }
 }
 
 /*
@@ -2636,9 +2644,12 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
                                   BlockDriverState **file,
                                   int *depth)
 {
-    int ret;
+    int ret = 0;
     BlockDriverState *p;
     int64_t eof = 0;
+    int64_t amc_bytes, fill_bytes = 0;
+    unsigned int amc_gen;
+    int skip, fill_depth = 0;
     int dummy;
     IO_CODE();
 
@@ -2655,28 +2666,65 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
         return 0;
     }
 
-    ret = bdrv_co_do_block_status(bs, mode, offset, bytes, pnum,
-                                  map, file);
-    ++*depth;
-    if (ret < 0 || *pnum == 0 || ret & BDRV_BLOCK_ALLOCATED || bs == base) {
-        return ret;
+    /*
+     * If an earlier query found the first nodes of the chain unallocated
+     * here, start right below them.  The nodes that are skipped must all be
+     * above @base, as the answer could be @base otherwise.
+     */
+    skip = bdrv_amc_lookup(bs, offset, &amc_bytes, &amc_gen);
+    p = bs;
+    for (int i = 0; p && i < skip; i++) {
+        if (p == base) {
+            p = NULL;
+            break;
+        }
+        p = bdrv_filter_or_cow_bs(p);
     }
+    if (skip && bytes && p && (include_base || p != base)) {
+        /* The skipped top node still determines the length of the image */
+        int64_t total = bdrv_co_getlength(bs);
 
-    if (ret & BDRV_BLOCK_EOF) {
-        eof = offset + *pnum;
+        if (total < 0) {
+            ret = total;
+            goto out;
+        }
+        if (offset >= total) {
+            skip = 0;
+        } else {
+            bytes = MIN(bytes, MIN(amc_bytes, total - offset));
+            if (offset + bytes == total) {
+                eof = total;
+            }
+            *depth = skip;
+        }
+    } else {
+        skip = 0;
     }
 
-    assert(*pnum <= bytes);
-    bytes = *pnum;
+    if (!skip) {
+        ret = bdrv_co_do_block_status(bs, mode, offset, bytes, pnum,
+                                      map, file);
+        ++*depth;
+        if (ret < 0 || *pnum == 0 || ret & BDRV_BLOCK_ALLOCATED ||
+            bs == base) {
+            goto out;
+        }
 
-    for (p = bdrv_filter_or_cow_bs(bs); include_base || p != base;
-         p = bdrv_filter_or_cow_bs(p))
-    {
+        if (ret & BDRV_BLOCK_EOF) {
+            eof = offset + *pnum;
+        }
+
+        assert(*pnum <= bytes);
+        bytes = *pnum;
+        p = bdrv_filter_or_cow_bs(bs);
+    }
+
+    for (; include_base || p != base; p = bdrv_filter_or_cow_bs(p)) {
         ret = bdrv_co_do_block_status(p, mode, offset, bytes, pnum,
                                       map, file);
         ++*depth;
         if (ret < 0) {
-            return ret;
+            goto out;
         }
         if (*pnum == 0) {
             /*
@@ -2725,6 +2773,17 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
         ret |= BDRV_BLOCK_EOF;
     }
 
+    /*
+     * All nodes above the last one that was queried are unallocated in
+     * [offset, offset + *pnum).  Allocation does not depend on @mode.
+     */
+    if (*depth > 1) {
+        fill_bytes = *pnum;
+        fill_depth = *depth - 1;
+    }
+
+out:
+    bdrv_amc_fill(bs, offset, fill_bytes, fill_depth, amc_gen);
     return ret;
 }
 
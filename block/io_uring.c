@@ -12,6 +12,9 @@
 #include <liburing.h>
 #include "block/aio.h"
 #include "qemu/queue.h"
+#include "qemu/bitmap.h"
+#include "qemu/lockable.h"
+#include "qemu/units.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
@@ -26,6 +29,14 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Registered file and buffer slots, the same in every ring */
+#define MAX_FIXED_FILES 64
+#define MAX_FIXED_BUF_RANGES 32
+#define MAX_FIXED_BUFS 1024
+
+/* The kernel limits each registered buffer to 1 GiB */
+#define FIXED_BUF_SIZE (1 * GiB)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -34,6 +45,9 @@ typedef struct LuringAIOCB {
     bool is_read;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
+    /* Completion when submitted on the AioContext's ring */
+    CqeHandler cqe_handler;
+
     /*
      * Buffered reads may require resubmission, see
      * luring_resubmit_short_read().
@@ -58,16 +72,310 @@ struct LuringState {
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /* Whether the ring has sparse tables for registered files and buffers */
+    bool has_fixed;
+    QLIST_ENTRY(LuringState) next;
 };
 
+typedef struct LuringBufRange {
+    void *host;
+    size_t size;
+    unsigned int first_slot;
+    unsigned int refcnt;
+} LuringBufRange;
+
+/*
+ * Files and buffers registered with every ring that supports it.  A slot
+ * means the same in all rings, so the submission path looks it up without
+ * taking the lock: entries are published only after all rings know about
+ * them, and withdrawn before the rings forget them.  Updates are
+ * serialized by @lock, which also protects @rings.
+ */
+static struct {
+    QemuMutex lock;
+    QLIST_HEAD(, LuringState) rings;
+    int files[MAX_FIXED_FILES];
+    LuringBufRange bufs[MAX_FIXED_BUF_RANGES];
+    DECLARE_BITMAP(buf_slots, MAX_FIXED_BUFS);
+} luring_fixed;
+
+static void __attribute__((constructor)) luring_fixed_init(void)
+{
+    qemu_mutex_init(&luring_fixed.lock);
+    QLIST_INIT(&luring_fixed.rings);
+    memset(luring_fixed.files, -1, sizeof(luring_fixed.files));
+}
+
+static int luring_update_file(LuringState *s, unsigned int slot, int fd)
+{
+    int ret = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Register (or with @add false, clear) the slots of a buffer in one ring */
+static int luring_update_bufs(LuringState *s, unsigned int first_slot,
+                              void *host, size_t size, bool add)
+{
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    unsigned int n = DIV_ROUND_UP(size, FIXED_BUF_SIZE);
+    g_autofree struct iovec *iov = g_new0(struct iovec, n);
+    unsigned int i;
+    int ret;
+
+    for (i = 0; add && i < n; i++) {
+        size_t off = (size_t)i * FIXED_BUF_SIZE;
+
+        iov[i].iov_base = (uint8_t *)host + off;
+        iov[i].iov_len = MIN(FIXED_BUF_SIZE, size - off);
+    }
+
+    ret = io_uring_register_buffers_update_tag(&s->ring, first_slot,
+                                               iov, NULL, n);
+    return ret < 0 ? ret : 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+/* Called with luring_fixed.lock held, returns 0 or -errno */
+static int luring_add_fixed(LuringState *s)
+{
+    int i, ret;
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (luring_fixed.files[i] >= 0) {
+            ret = luring_update_file(s, i, luring_fixed.files[i]);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    for (i = 0; i < MAX_FIXED_BUF_RANGES; i++) {
+        LuringBufRange *r = &luring_fixed.bufs[i];
+
+        if (r->size) {
+            ret = luring_update_bufs(s, r->first_slot, r->host, r->size, true);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+#endif
+
+/**
+ * luring_register_file:
+ * @fd: file descriptor
+ *
+ * Make @fd a registered file in all rings, so that requests on it skip the
+ * file table lookup and reference counting.  The caller must call
+ * luring_unregister_file() before closing @fd.  This is best effort, @fd
+ * keeps working as a normal file if it cannot be registered.
+ */
+void luring_register_file(int fd)
+{
+    LuringState *s;
+    int i;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (luring_fixed.files[i] < 0) {
+            break;
+        }
+    }
+    if (i == MAX_FIXED_FILES) {
+        return;
+    }
+
+    QLIST_FOREACH(s, &luring_fixed.rings, next) {
+        if (luring_update_file(s, i, fd) < 0) {
+            QLIST_FOREACH(s, &luring_fixed.rings, next) {
+                luring_update_file(s, i, -1);
+            }
+            return;
+        }
+    }
+    qatomic_set(&luring_fixed.files[i], fd);
+    trace_luring_register_file(fd, i);
+}
+
+void luring_unregister_file(int fd)
+{
+    LuringState *s;
+    int i;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (luring_fixed.files[i] == fd) {
+            qatomic_set(&luring_fixed.files[i], -1);
+            QLIST_FOREACH(s, &luring_fixed.rings, next) {
+                luring_update_file(s, i, -1);
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * luring_register_buf:
+ * @host: start of the buffer
+ * @size: size of the buffer
+ *
+ * Register a buffer, usually guest RAM, with all rings so that reads and
+ * writes entirely inside it use IORING_OP_READ_FIXED/WRITE_FIXED and the
+ * kernel does not have to pin and unpin its pages for every request.  The
+ * buffer stays pinned until luring_unregister_buf() is called as many times
+ * as it was registered.  This is best effort: if registration fails, for
+ * example because of RLIMIT_MEMLOCK, requests use the vectored operations.
+ */
+void luring_register_buf(void *host, size_t size)
+{
+    LuringBufRange *r = NULL;
+    LuringState *s;
+    unsigned long slot;
+    unsigned int n = DIV_ROUND_UP(size, FIXED_BUF_SIZE);
+    int i;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (i = 0; i < MAX_FIXED_BUF_RANGES; i++) {
+        LuringBufRange *cur = &luring_fixed.bufs[i];
+
+        if (cur->size && cur->host == host && cur->size == size) {
+            cur->refcnt++;
+            return;
+        }
+        if (!cur->size && !r) {
+            r = cur;
+        }
+    }
+
+    slot = bitmap_find_next_zero_area(luring_fixed.buf_slots, MAX_FIXED_BUFS,
+                                      0, n, 0);
+    if (!r || !size || slot >= MAX_FIXED_BUFS) {
+        return;
+    }
+
+    QLIST_FOREACH(s, &luring_fixed.rings, next) {
+        if (luring_update_bufs(s, slot, host, size, true) < 0) {
+            QLIST_FOREACH(s, &luring_fixed.rings, next) {
+                luring_update_bufs(s, slot, host, size, false);
+            }
+            return;
+        }
+    }
+
+    bitmap_set(luring_fixed.buf_slots, slot, n);
+    r->host = host;
+    r->first_slot = slot;
+    r->refcnt = 1;
+    trace_luring_register_buf(host, size, slot);
+
+    /* Publish the range, sizes are read locklessly on submission */
+    qatomic_store_release(&r->size, size);
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+    LuringState *s;
+    int i;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (i = 0; i < MAX_FIXED_BUF_RANGES; i++) {
+        LuringBufRange *r = &luring_fixed.bufs[i];
+
+        if (r->size != size || r->host != host) {
+            continue;
+        }
+        if (--r->refcnt) {
+            return;
+        }
+        qatomic_set(&r->size, 0);
+        QLIST_FOREACH(s, &luring_fixed.rings, next) {
+            luring_update_bufs(s, r->first_slot, host, size, false);
+        }
+        bitmap_clear(luring_fixed.buf_slots, r->first_slot,
+                     DIV_ROUND_UP(size, FIXED_BUF_SIZE));
+        return;
+    }
+}
+
+/* Returns the registered file slot for @fd, or -1 */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s || !s->has_fixed) {
+        return -1;
+    }
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (qatomic_read(&luring_fixed.files[i]) == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Returns the registered buffer that contains all of @qiov, or -1 */
+static int luring_fixed_buf(LuringState *s, QEMUIOVector *qiov)
+{
+    uintptr_t base;
+    size_t len;
+    int i;
+
+    if (!s || !s->has_fixed || qiov->niov != 1) {
+        return -1;
+    }
+
+    base = (uintptr_t)qiov->iov[0].iov_base;
+    len = qiov->iov[0].iov_len;
+    for (i = 0; i < MAX_FIXED_BUF_RANGES; i++) {
+        LuringBufRange *r = &luring_fixed.bufs[i];
+        size_t size = qatomic_load_acquire(&r->size);
+        uintptr_t off = base - (uintptr_t)r->host;
+
+        if (!size || base < (uintptr_t)r->host || off + len > size) {
+            continue;
+        }
+        if (off / FIXED_BUF_SIZE != (off + len - 1) / FIXED_BUF_SIZE) {
+            return -1;
+        }
+        return r->first_slot + off / FIXED_BUF_SIZE;
+    }
+    return -1;
+}
+
+static void luring_copy_sqe(struct io_uring_sqe *sqe, void *opaque)
+{
+    LuringAIOCB *luringcb = opaque;
+
+    *sqe = luringcb->sqeq;
+}
+
 /**
  * luring_resubmit:
  *
  * Resubmit a request by appending it to submit_queue.  The caller must ensure
  * that ioq_submit() is called later so that submit_queue requests are started.
+ *
+ * Without @s the request goes back to the AioContext's ring, which submits it
+ * in the next event loop iteration.
  */
 static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
 {
+    if (!s) {
+        aio_add_sqe(qemu_get_current_aio_context(), luring_copy_sqe, luringcb,
+                    &luringcb->cqe_handler);
+        return;
+    }
+
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
 }
@@ -90,6 +398,15 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* The buffer is contiguous, just move into it */
+        luringcb->sqeq.off += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -108,6 +425,84 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luring_resubmit(s, luringcb);
 }
 
+/**
+ * luring_complete:
+ * @s: AIO state, or NULL if the request was submitted with aio_add_sqe()
+ * @luringcb: the request
+ * @ret: the cqe result
+ *
+ * Resubmits the request or wakes up its coroutine with the final result.
+ */
+static void luring_complete(LuringState *s, LuringAIOCB *luringcb, int ret)
+{
+    /* total_read is non-zero only for resubmitted read requests */
+    int total_bytes = ret + luringcb->total_read;
+
+    if (ret < 0) {
+        /*
+         * Only writev/readv/fsync requests on regular files or host block
+         * devices are submitted. Therefore -EAGAIN is not expected but it's
+         * known to happen sometimes with Linux SCSI. Submit again and hope
+         * the request completes successfully.
+         *
+         * For more information, see:
+         * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
+         *
+         * If the code is changed to submit other types of requests in the
+         * future, then this workaround may need to be extended to deal with
+         * genuine -EAGAIN results that should not be resubmitted
+         * immediately.
+         */
+        if (ret == -EINTR || ret == -EAGAIN) {
+            luring_resubmit(s, luringcb);
+            return;
+        }
+    } else if (!luringcb->qiov) {
+        goto end;
+    } else if (total_bytes == luringcb->qiov->size) {
+        ret = 0;
+    /* Only read/write */
+    } else {
+        /* Short Read/Write */
+        if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                return;
+            } else {
+                /* Pad with zeroes */
+                qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                                  luringcb->qiov->size - total_bytes);
+                ret = 0;
+            }
+        } else {
+            ret = -ENOSPC;
+        }
+    }
+end:
+    luringcb->ret = ret;
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+    /*
+     * If the coroutine is already entered it must be in ioq_submit()
+     * and will notice luringcb->ret has been filled in when it
+     * eventually runs later. Coroutines cannot be entered recursively
+     * so avoid doing that!
+     */
+    assert(!s || luringcb->co->ctx == s->aio_context);
+    if (!qemu_coroutine_entered(luringcb->co)) {
+        aio_co_wake(luringcb->co);
+    }
+}
+
+static void luring_cqe_handler(CqeHandler *cqe_handler)
+{
+    LuringAIOCB *luringcb = container_of(cqe_handler, LuringAIOCB,
+                                         cqe_handler);
+
+    trace_luring_process_completion(NULL, luringcb, cqe_handler->cqe.res);
+    luring_complete(NULL, luringcb, cqe_handler->cqe.res);
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -124,7 +519,6 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
 static void luring_process_completions(LuringState *s)
 {
     struct io_uring_cqe *cqes;
-    int total_bytes;
 
     defer_call_begin();
 
@@ -162,63 +556,7 @@ static void luring_process_completions(LuringState *s)
         s->io_q.in_flight--;
         trace_luring_process_completion(s, luringcb, ret);
 
-        /* total_read is non-zero only for resubmitted read requests */
-        total_bytes = ret + luringcb->total_read;
-
-        if (ret < 0) {
-            /*
-             * Only writev/readv/fsync requests on regular files or host block
-             * devices are submitted. Therefore -EAGAIN is not expected but it's
-             * known to happen sometimes with Linux SCSI. Submit again and hope
-             * the request completes successfully.
-             *
-             * For more information, see:
-             * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
-             *
-             * If the code is changed to submit other types of requests in the
-             * future, then this workaround may need to be extended to deal with
-             * genuine -EAGAIN results that should not be resubmitted
-             * immediately.
-             */
-            if (ret == -EINTR || ret == -EAGAIN) {
-                luring_resubmit(s, luringcb);
-                continue;
-            }
-        } else if (!luringcb->qiov) {
-            goto end;
-        } else if (total_bytes == luringcb->qiov->size) {
-            ret = 0;
-        /* Only read/write */
-        } else {
-            /* Short Read/Write */
-            if (luringcb->is_read) {
-                if (ret > 0) {
-                    luring_resubmit_short_read(s, luringcb, ret);
-                    continue;
-                } else {
-                    /* Pad with zeroes */
-                    qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
-                                      luringcb->qiov->size - total_bytes);
-                    ret = 0;
-                }
-            } else {
-                ret = -ENOSPC;
-            }
-        }
-end:
-        luringcb->ret = ret;
-        qemu_iovec_destroy(&luringcb->resubmit_qiov);
-
-        /*
-         * If the coroutine is already entered it must be in ioq_submit()
-         * and will notice luringcb->ret has been filled in when it
-         * eventually runs later. Coroutines cannot be entered recursively
-         * so avoid doing that!
-         */
-        assert(luringcb->co->ctx == s->aio_context);
-        if (!qemu_coroutine_entered(luringcb->co)) {
-            aio_co_wake(luringcb->co);
-        }
+        luring_complete(s, luringcb, ret);
     }
 
     qemu_bh_cancel(s->completion_bh);
@@ -324,24 +662,35 @@ static void luring_deferred_fn(void *opaque)
 }
 
 /**
- * luring_do_submit:
+ * luring_prep_sqe:
  * @fd: file descriptor for I/O
  * @luringcb: AIO control block
- * @s: AIO state
+ * @s: AIO state, or NULL for the AioContext's ring
  * @offset: offset for request
  * @type: type of request
  *
- * Fetches sqes from ring, adds to pending queue and preps them
- *
+ * Preps luringcb->sqeq.  Registered files and buffers are only used with @s.
  */
-static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
+static void luring_prep_sqe(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type, BdrvRequestFlags flags)
 {
-    int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int file_slot = luring_fixed_file(s, fd);
+    int buf_slot = -1;
+
+    if ((flags & BDRV_REQ_REGISTERED_BUF) &&
+        (type == QEMU_AIO_READ || type == QEMU_AIO_WRITE)) {
+        buf_slot = luring_fixed_buf(s, luringcb->qiov);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
+        if (buf_slot >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                      luringcb->qiov->size, offset, buf_slot);
+            sqes->rw_flags = (flags & BDRV_REQ_FUA) ? RWF_DSYNC : 0;
+            break;
+        }
 #ifdef HAVE_IO_URING_PREP_WRITEV2
     {
         int luring_flags = (flags & BDRV_REQ_FUA) ? RWF_DSYNC : 0;
@@ -349,7 +698,7 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                               luringcb->qiov->niov, offset, luring_flags);
     }
 #else
-        assert(flags == 0);
+        assert(!(flags & BDRV_REQ_FUA));
         io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
                              luringcb->qiov->niov, offset);
 #endif
@@ -359,6 +708,11 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                              luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_READ:
+        if (buf_slot >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                     luringcb->qiov->size, offset, buf_slot);
+            break;
+        }
         io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
                             luringcb->qiov->niov, offset);
         break;
@@ -370,7 +724,30 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
-    io_uring_sqe_set_data(sqes, luringcb);
+    if (file_slot >= 0) {
+        sqes->fd = file_slot;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+/**
+ * luring_do_submit:
+ * @fd: file descriptor for I/O
+ * @luringcb: AIO control block
+ * @s: AIO state
+ * @offset: offset for request
+ * @type: type of request
+ *
+ * Fetches sqes from ring, adds to pending queue and preps them
+ *
+ */
+static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
+                            uint64_t offset, int type, BdrvRequestFlags flags)
+{
+    int ret;
+
+    luring_prep_sqe(fd, luringcb, s, offset, type, flags);
+    io_uring_sqe_set_data(&luringcb->sqeq, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
@@ -401,6 +778,22 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
         .qiov       = qiov,
         .is_read    = (type == QEMU_AIO_READ),
     };
+
+    /*
+     * Share the ring of the event loop so that submission and waiting take a
+     * single io_uring_enter(2).  Registered files and buffers only exist in
+     * the dedicated rings, so requests for them keep using those.
+     */
+    if (aio_has_io_uring(ctx) && luring_fixed_file(s, fd) < 0) {
+        trace_luring_co_submit(bs, NULL, &luringcb, fd, offset,
+                               qiov ? qiov->size : 0, type);
+        luring_prep_sqe(fd, &luringcb, NULL, offset, type, flags);
+        luringcb.cqe_handler.cb = luring_cqe_handler;
+        aio_add_sqe(ctx, luring_copy_sqe, &luringcb, &luringcb.cqe_handler);
+        qemu_coroutine_yield();
+        return luringcb.ret;
+    }
+
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
     ret = luring_do_submit(fd, &luringcb, s, offset, type, flags);
@@ -448,12 +841,34 @@ LuringState *luring_init(Error **errp)
     }
 
     ioq_init(&s->io_q);
-    return s;
 
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    /*
+     * Sparse tables need Linux 5.19.  Without them the ring still works,
+     * only without registered files and buffers.
+     */
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+    if (io_uring_register_files_sparse(ring, MAX_FIXED_FILES) == 0) {
+        if (io_uring_register_buffers_sparse(ring, MAX_FIXED_BUFS) == 0) {
+            if (luring_add_fixed(s) == 0) {
+                s->has_fixed = true;
+                QLIST_INSERT_HEAD(&luring_fixed.rings, s, next);
+                return s;
+            }
+            io_uring_unregister_buffers(ring);
+        }
+        io_uring_unregister_files(ring);
+    }
+#endif
+    return s;
 }
 
 void luring_cleanup(LuringState *s)
 {
+    if (s->has_fixed) {
+        QEMU_LOCK_GUARD(&luring_fixed.lock);
+        QLIST_REMOVE(s, next);
+    }
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
@@ -0,0 +1,408 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Cache of decompressed qcow2 clusters
+ *
+ * Guest reads are usually smaller than a compressed cluster, but each of
+ * them has to read and decompress the whole cluster.  A few recently
+ * decompressed clusters are kept here, keyed by the host offset of their
+ * compressed data, so that consecutive reads of the same cluster only
+ * decompress it once.  When reads are sequential, the next compressed
+ * clusters are decompressed ahead of time in a background coroutine,
+ * several of them in parallel on the thread pool.
+ *
+ * The host offset of compressed data can only be reused by another
+ * compressed write, which invalidates the cache when it completes.  Reads
+ * that were in progress at that time may still finish, but their entries
+ * are not found by lookups anymore.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "block/aio_task.h"
+#include "block/block-io.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/* Memory for the decompressed clusters, within the bounds on entries */
+#define QCOW2_COMPRESSED_CACHE_SIZE (4 * MiB)
+#define QCOW2_COMPRESSED_CACHE_MIN_ENTRIES 4
+#define QCOW2_COMPRESSED_CACHE_MAX_ENTRIES 16
+
+typedef struct Qcow2DecompressedCluster {
+    /* Host offset of the compressed data, 0 if the entry is unused */
+    uint64_t coffset;
+    /* Allocated on first use, so that uncompressed images pay nothing */
+    uint8_t *buf;
+    /* -EINPROGRESS while the cluster is being decompressed */
+    int ret;
+    /* Number of readers copying from @buf, the entry is pinned while > 0 */
+    unsigned refcnt;
+    uint64_t lru_counter;
+    CoQueue waiters;
+} Qcow2DecompressedCluster;
+
+struct Qcow2CompressedCache {
+    QemuMutex lock;
+    Qcow2DecompressedCluster *entries;
+    int nb_entries;
+    /* Number of clusters to decompress ahead of sequential reads */
+    int readahead;
+    uint64_t lru_counter;
+    /* Guest offset where a sequential read continues */
+    uint64_t next_offset;
+    /* End of the guest range for which readahead was started */
+    uint64_t readahead_end;
+};
+
+typedef struct Qcow2Readahead {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t end;
+} Qcow2Readahead;
+
+typedef struct Qcow2ReadaheadTask {
+    AioTask task;
+    BlockDriverState *bs;
+    uint64_t l2_entry;
+} Qcow2ReadaheadTask;
+
+Qcow2CompressedCache *qcow2_compressed_cache_new(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = g_new0(Qcow2CompressedCache, 1);
+    int i;
+
+    qemu_mutex_init(&c->lock);
+    c->nb_entries = QCOW2_COMPRESSED_CACHE_SIZE / s->cluster_size;
+    c->nb_entries = MAX(c->nb_entries, QCOW2_COMPRESSED_CACHE_MIN_ENTRIES);
+    c->nb_entries = MIN(c->nb_entries, QCOW2_COMPRESSED_CACHE_MAX_ENTRIES);
+    c->readahead = c->nb_entries / 4;
+    c->entries = g_new0(Qcow2DecompressedCluster, c->nb_entries);
+    for (i = 0; i < c->nb_entries; i++) {
+        qemu_co_queue_init(&c->entries[i].waiters);
+    }
+    return c;
+}
+
+void qcow2_compressed_cache_free(Qcow2CompressedCache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+    for (i = 0; i < c->nb_entries; i++) {
+        assert(c->entries[i].refcnt == 0);
+        qemu_vfree(c->entries[i].buf);
+    }
+    g_free(c->entries);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&c->lock);
+    for (i = 0; i < c->nb_entries; i++) {
+        c->entries[i].coffset = 0;
+    }
+    c->readahead_end = 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_read_decompress(BlockDriverState *bs, uint64_t coffset, int csize,
+                         uint8_t *out_buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *buf;
+    int ret;
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+
+fail:
+    g_free(buf);
+    return ret;
+}
+
+/* Called with c->lock held */
+static Qcow2DecompressedCluster *
+qcow2_compressed_cache_lookup(Qcow2CompressedCache *c, uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        if (c->entries[i].coffset == coffset) {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the least recently used unpinned entry, or NULL.  Called with
+ * c->lock held.
+ */
+static Qcow2DecompressedCluster *
+qcow2_compressed_cache_victim(Qcow2CompressedCache *c)
+{
+    Qcow2DecompressedCluster *victim = NULL;
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        Qcow2DecompressedCluster *e = &c->entries[i];
+
+        if (e->refcnt) {
+            continue;
+        }
+        if (!victim || e->lru_counter < victim->lru_counter) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+/*
+ * Returns a pinned entry that holds the decompressed cluster for
+ * @l2_entry, decompressing it first if necessary.  Returns NULL and sets
+ * @ret if decompression failed, and returns NULL with @ret set to 0 if all
+ * entries are pinned.
+ */
+static Qcow2DecompressedCluster * coroutine_fn GRAPH_RDLOCK
+qcow2_compressed_cache_get(BlockDriverState *bs, uint64_t l2_entry, int *ret)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2DecompressedCluster *e;
+    uint64_t coffset;
+    int csize;
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+    *ret = 0;
+
+    qemu_mutex_lock(&c->lock);
+    while ((e = qcow2_compressed_cache_lookup(c, coffset))) {
+        if (e->ret != -EINPROGRESS) {
+            e->refcnt++;
+            e->lru_counter = ++c->lru_counter;
+            qemu_mutex_unlock(&c->lock);
+            trace_qcow2_compressed_cache_hit(bs, coffset);
+            return e;
+        }
+        /* The entry may have been invalidated or failed, look it up again */
+        qemu_co_queue_wait(&e->waiters, &c->lock);
+    }
+
+    e = qcow2_compressed_cache_victim(c);
+    if (!e) {
+        qemu_mutex_unlock(&c->lock);
+        return NULL;
+    }
+    e->coffset = coffset;
+    e->ret = -EINPROGRESS;
+    e->refcnt = 1;
+    e->lru_counter = ++c->lru_counter;
+    qemu_mutex_unlock(&c->lock);
+
+    trace_qcow2_compressed_cache_miss(bs, coffset);
+    if (!e->buf) {
+        e->buf = qemu_try_blockalign(bs, s->cluster_size);
+    }
+    *ret = e->buf ? qcow2_co_read_decompress(bs, coffset, csize, e->buf)
+                  : -ENOMEM;
+
+    qemu_mutex_lock(&c->lock);
+    e->ret = *ret;
+    qemu_co_queue_restart_all(&e->waiters);
+    if (*ret < 0) {
+        if (e->coffset == coffset) {
+            e->coffset = 0;
+        }
+        e->refcnt--;
+        e = NULL;
+    }
+    qemu_mutex_unlock(&c->lock);
+    return e;
+}
+
+static void qcow2_compressed_cache_put(Qcow2CompressedCache *c,
+                                       Qcow2DecompressedCluster *e)
+{
+    QEMU_LOCK_GUARD(&c->lock);
+    assert(e->refcnt > 0);
+    e->refcnt--;
+}
+
+/*
+ * This function can count as GRAPH_RDLOCK because qcow2_readahead_entry()
+ * holds the graph lock and keeps it until this coroutine has terminated.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_readahead_task_entry(AioTask *task)
+{
+    Qcow2ReadaheadTask *t = container_of(task, Qcow2ReadaheadTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    Qcow2DecompressedCluster *e;
+    int ret;
+
+    /* Errors are left for the guest read to report */
+    e = qcow2_compressed_cache_get(t->bs, t->l2_entry, &ret);
+    if (e) {
+        qcow2_compressed_cache_put(s->compressed_cache, e);
+    }
+    return 0;
+}
+
+static void coroutine_fn qcow2_readahead_entry(void *opaque)
+{
+    Qcow2Readahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    AioTaskPool *aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    uint64_t offset;
+
+    bdrv_graph_co_rdlock();
+
+    trace_qcow2_compressed_cache_readahead(bs, ra->offset, ra->end);
+    for (offset = ra->offset; offset < ra->end; offset += s->cluster_size) {
+        unsigned int bytes = s->cluster_size;
+        QCow2SubclusterType type;
+        Qcow2ReadaheadTask *t;
+        uint64_t l2_entry;
+        int ret;
+
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &l2_entry, &type);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            break;
+        }
+        if (type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            continue;
+        }
+
+        t = g_new(Qcow2ReadaheadTask, 1);
+        *t = (Qcow2ReadaheadTask) {
+            .task.func = qcow2_readahead_task_entry,
+            .bs = bs,
+            .l2_entry = l2_entry,
+        };
+        aio_task_pool_start_task(aio, &t->task);
+    }
+
+    aio_task_pool_wait_all(aio);
+    g_free(aio);
+
+    bdrv_graph_co_rdunlock();
+    bdrv_dec_in_flight(bs);
+    g_free(ra);
+}
+
+/*
+ * Start decompressing the clusters that follow @offset if reads are
+ * sequential and they were not already requested.
+ */
+static void coroutine_fn
+qcow2_compressed_cache_readahead(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t cluster = start_of_cluster(s, offset);
+    uint64_t disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    Qcow2Readahead *ra;
+    uint64_t start, end;
+
+    WITH_QEMU_LOCK_GUARD(&c->lock) {
+        if (cluster + s->cluster_size == c->next_offset) {
+            /* Still in the same cluster */
+            return;
+        }
+        if (cluster != c->next_offset) {
+            /* Random access, wait for the next sequential one */
+            c->next_offset = cluster + s->cluster_size;
+            c->readahead_end = 0;
+            return;
+        }
+
+        c->next_offset = cluster + s->cluster_size;
+        start = MAX(c->next_offset, c->readahead_end);
+        end = MIN(c->next_offset + c->readahead * s->cluster_size, disk_size);
+        if (start >= end) {
+            return;
+        }
+        c->readahead_end = end;
+    }
+
+    ra = g_new(Qcow2Readahead, 1);
+    *ra = (Qcow2Readahead) {
+        .bs = bs,
+        .offset = start,
+        .end = end,
+    };
+
+    /* Runs once the caller yields, after it claimed an entry for @offset */
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(qemu_get_current_aio_context(),
+                 qemu_coroutine_create(qcow2_readahead_entry, ra));
+}
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t l2_entry,
+                           uint64_t offset,
+                           uint64_t bytes,
+                           QEMUIOVector *qiov,
+                           size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressedCluster *e;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+    uint64_t coffset;
+    uint8_t *out_buf;
+    int ret, csize;
+
+    /* Decompress the following clusters while this one is being read */
+    qcow2_compressed_cache_readahead(bs, offset);
+
+    e = qcow2_compressed_cache_get(bs, l2_entry, &ret);
+    if (e) {
+        qemu_iovec_from_buf(qiov, qiov_offset, e->buf + offset_in_cluster,
+                            bytes);
+        qcow2_compressed_cache_put(s->compressed_cache, e);
+        return 0;
+    } else if (ret < 0) {
+        return ret;
+    }
+
+    /* All entries are in use, decompress into a temporary buffer */
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+
+    out_buf = qemu_blockalign(bs, s->cluster_size);
+    ret = qcow2_co_read_decompress(bs, coffset, csize, out_buf);
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                            bytes);
+    }
+    qemu_vfree(out_buf);
+
+    return ret;
+}
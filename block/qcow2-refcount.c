@@ -1065,6 +1065,96 @@ int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offs
     return i;
 }
 
+/*
+ * Allocate up to *nb_clusters data clusters from the chunk of host clusters
+ * reserved for the current AioContext.  Chunks are allocated (and their
+ * refcounts updated) as a whole, so that the allocating writes of each
+ * iothread get contiguous host ranges and only touch the refcount blocks
+ * once per chunk.
+ *
+ * If @offset is not INV_OFFSET, the allocation must start there; this
+ * falls back to qcow2_alloc_clusters_at() if the chunk does not continue
+ * at @offset.
+ *
+ * Returns the offset of the first allocated cluster, with *nb_clusters
+ * updated to the number of allocated clusters (possibly 0 if @offset was
+ * given), or -errno.
+ */
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_clusters_chunk(BlockDriverState *bs, uint64_t offset,
+                           uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    Qcow2AllocChunk *chunk;
+    uint64_t n;
+
+    assert(s->alloc_chunk_clusters);
+
+    QLIST_FOREACH(chunk, &s->alloc_chunks, next) {
+        if (chunk->ctx == ctx) {
+            break;
+        }
+    }
+    if (!chunk) {
+        chunk = g_new0(Qcow2AllocChunk, 1);
+        chunk->ctx = ctx;
+        QLIST_INSERT_HEAD(&s->alloc_chunks, chunk, next);
+    }
+
+    if (offset != INV_OFFSET &&
+        (!chunk->nb_clusters || chunk->offset != offset)) {
+        int64_t ret = qcow2_alloc_clusters_at(bs, offset, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+        return offset;
+    }
+
+    if (!chunk->nb_clusters) {
+        int64_t new_chunk;
+
+        /* Whatever is left of a chunk is always handed out first */
+        n = MAX(s->alloc_chunk_clusters, *nb_clusters);
+        new_chunk = qcow2_alloc_clusters(bs, n << s->cluster_bits);
+        if (new_chunk < 0) {
+            return new_chunk;
+        }
+        chunk->offset = new_chunk;
+        chunk->nb_clusters = n;
+    }
+
+    n = MIN(*nb_clusters, chunk->nb_clusters);
+    offset = chunk->offset;
+    chunk->offset += n << s->cluster_bits;
+    chunk->nb_clusters -= n;
+    *nb_clusters = n;
+
+    return offset;
+}
+
+/*
+ * Give back the clusters reserved in allocation chunks that were not used
+ * yet.  Must be called before anything that expects every allocated
+ * cluster to be referenced, e.g. checking or shrinking the image.
+ */
+void GRAPH_RDLOCK qcow2_release_alloc_chunks(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2AllocChunk *chunk, *next_chunk;
+
+    QLIST_FOREACH_SAFE(chunk, &s->alloc_chunks, next, next_chunk) {
+        if (chunk->nb_clusters) {
+            qcow2_free_clusters(bs, chunk->offset,
+                                chunk->nb_clusters << s->cluster_bits,
+                                QCOW2_DISCARD_NEVER);
+        }
+        QLIST_REMOVE(chunk, next);
+        g_free(chunk);
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -74,14 +74,6 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
 
-static int coroutine_fn
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t l2_entry,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset);
-
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     const QCowHeader *cow_header = (const void *)buf;
@@ -651,6 +643,7 @@ qcow2_co_check(BlockDriverState *bs, BdrvCheckResult *result,
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
+    qcow2_release_alloc_chunks(bs);
     ret = qcow2_co_check_locked(bs, result, fix);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
@@ -701,6 +694,8 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_ALLOC_CHUNK_SIZE,
+    QCOW2_OPT_MAX_THREADS,
     NULL
 };
 
@@ -817,6 +812,18 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_CHUNK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Host space reserved at once for the allocating writes "
+                    "of each iothread (0 to disable)",
+        },
+        {
+            .name = QCOW2_OPT_MAX_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of threads compressing, decompressing "
+                    "or encrypting data at the same time",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -979,6 +986,8 @@ typedef struct Qcow2ReopenState {
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
     uint64_t cache_clean_interval;
+    uint64_t alloc_chunk_clusters;
+    int max_threads;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -991,6 +1000,7 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t max_threads;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1079,6 +1089,26 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->alloc_chunk_clusters =
+        size_to_clusters(s, qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_CHUNK_SIZE,
+                                              0));
+    if (r->alloc_chunk_clusters > QCOW2_MAX_ALLOC_CHUNK >> s->cluster_bits) {
+        error_setg(errp, QCOW2_OPT_ALLOC_CHUNK_SIZE " must not exceed %"
+                   PRId64 " MiB", QCOW2_MAX_ALLOC_CHUNK / MiB);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    max_threads = qemu_opt_get_number(opts, QCOW2_OPT_MAX_THREADS,
+                                      QCOW2_DEFAULT_THREADS);
+    if (max_threads < 1 || max_threads > QCOW2_MAX_THREADS) {
+        error_setg(errp, QCOW2_OPT_MAX_THREADS " must be between 1 and %d",
+                   QCOW2_MAX_THREADS);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->max_threads = max_threads;
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1214,8 +1244,8 @@ fail:
     return ret;
 }
 
-static void qcow2_update_options_commit(BlockDriverState *bs,
-                                        Qcow2ReopenState *r)
+static void GRAPH_RDLOCK
+qcow2_update_options_commit(BlockDriverState *bs, Qcow2ReopenState *r)
 {
     BDRVQcow2State *s = bs->opaque;
     int i;
@@ -1239,6 +1269,17 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->discard_no_unref = r->discard_no_unref;
 
+    /*
+     * Chunks reserved for the old size are not handed out any more.  This
+     * must come after the cache switch, the old refcount cache was only
+     * flushed in prepare.
+     */
+    if (s->alloc_chunk_clusters != r->alloc_chunk_clusters) {
+        qcow2_release_alloc_chunks(bs);
+        s->alloc_chunk_clusters = r->alloc_chunk_clusters;
+    }
+    s->max_threads = r->max_threads;
+
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
         s->cache_clean_interval = r->cache_clean_interval;
@@ -1888,6 +1929,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    s->compressed_cache = qcow2_compressed_cache_new(bs);
 
     return ret;
 
@@ -2013,6 +2055,9 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
             goto fail;
         }
 
+        /* The freed clusters must reach the image before it is read-only */
+        qcow2_release_alloc_chunks(state->bs);
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2772,6 +2817,10 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_release_alloc_chunks(bs);
+    /* Other processes may write compressed clusters from now on */
+    qcow2_compressed_cache_invalidate(s->compressed_cache);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2808,6 +2857,8 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_compressed_cache_free(s->compressed_cache);
+    s->compressed_cache = NULL;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4324,6 +4375,7 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
     }
 
     qemu_co_mutex_lock(&s->lock);
+    qcow2_release_alloc_chunks(bs);
 
     /*
      * Even though we store snapshot size for all images, it was not
@@ -4728,6 +4780,8 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     BLKDBG_CO_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
     ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
+    /* The host range may have held other compressed data before */
+    qcow2_compressed_cache_invalidate(s->compressed_cache);
     if (ret < 0) {
         goto fail;
     }
@@ -4822,49 +4876,6 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
-static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t l2_entry,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset)
-{
-    BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize;
-    uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
-
-    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
-
-    buf = g_try_malloc(csize);
-    if (!buf) {
-        return -ENOMEM;
-    }
-
-    out_buf = qemu_blockalign(bs, s->cluster_size);
-
-    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
-    if (ret < 0) {
-        goto fail;
-    }
-
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
-        ret = -EIO;
-        goto fail;
-    }
-
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
-fail:
-    qemu_vfree(out_buf);
-    g_free(buf);
-
-    return ret;
-}
-
 static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -4897,6 +4908,8 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
 
     BLKDBG_EVENT(bs->file, BLKDBG_L1_UPDATE);
 
+    qcow2_release_alloc_chunks(bs);
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
     l1_size2 = (uint64_t)s->l1_size * L1E_SIZE;
 
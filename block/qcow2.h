@@ -57,6 +57,9 @@
  * (128 GB for 512 byte clusters, 2 EB for 2 MB clusters) */
 #define QCOW_MAX_L1_SIZE (32 * MiB)
 
+/* Maximal size of the host space reserved at once for allocating writes */
+#define QCOW2_MAX_ALLOC_CHUNK (1 * GiB)
+
 /* Allow for an average of 1k per snapshot table entry, should be plenty of
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
@@ -150,6 +153,8 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_ALLOC_CHUNK_SIZE "alloc-chunk-size"
+#define QCOW2_OPT_MAX_THREADS "max-threads"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -230,6 +235,7 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -310,6 +316,14 @@ typedef struct Qcow2DiscardRegion {
     QTAILQ_ENTRY(Qcow2DiscardRegion) next;
 } Qcow2DiscardRegion;
 
+/* Host clusters reserved for the allocating writes of one AioContext */
+typedef struct Qcow2AllocChunk {
+    AioContext *ctx;
+    uint64_t offset;        /* first cluster that is still free */
+    uint64_t nb_clusters;   /* number of free clusters from @offset */
+    QLIST_ENTRY(Qcow2AllocChunk) next;
+} Qcow2AllocChunk;
+
 typedef uint64_t Qcow2GetRefcountFunc(const void *refcount_array,
                                       uint64_t index);
 typedef void Qcow2SetRefcountFunc(void *refcount_array,
@@ -322,7 +336,9 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
-#define QCOW2_MAX_THREADS 4
+/* Threads that compress, decompress or encrypt data for one image */
+#define QCOW2_DEFAULT_THREADS 4
+#define QCOW2_MAX_THREADS 64
 
 typedef struct BDRVQcow2State {
     int cluster_bits;
@@ -345,6 +361,7 @@ typedef struct BDRVQcow2State {
 
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    Qcow2CompressedCache *compressed_cache;
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
@@ -357,6 +374,9 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    uint64_t alloc_chunk_clusters; /* 0 if allocation chunks are disabled */
+    QLIST_HEAD(, Qcow2AllocChunk) alloc_chunks;
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -410,6 +430,7 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads;
 
     BdrvChild *data_file;
 
@@ -874,6 +895,10 @@ qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                         int64_t nb_clusters);
 
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_clusters_chunk(BlockDriverState *bs, uint64_t offset,
+                           uint64_t *nb_clusters);
+void GRAPH_RDLOCK qcow2_release_alloc_chunks(BlockDriverState *bs);
 void GRAPH_RDLOCK qcow2_free_clusters(BlockDriverState *bs,
                                       int64_t offset, int64_t size,
                                       enum qcow2_discard_type type);
@@ -1058,6 +1083,16 @@ bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
 
+/* qcow2-compressed-cache.c functions */
+Qcow2CompressedCache *qcow2_compressed_cache_new(BlockDriverState *bs);
+void qcow2_compressed_cache_free(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_preadv_compressed(BlockDriverState *bs, uint64_t l2_entry,
+                           uint64_t offset, uint64_t bytes,
+                           QEMUIOVector *qiov, size_t qiov_offset);
+
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size);
@@ -258,6 +258,11 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Failed to load snapshot");
         }
+
+        /* The allocation of the whole image may have changed */
+        bdrv_graph_rdlock_main_loop();
+        bdrv_amc_invalidate(bs);
+        bdrv_graph_rdunlock_main_loop();
         return ret;
     }
 
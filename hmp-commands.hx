@@ -380,6 +380,49 @@ SRST
   only *tag* as parameter.
 ERST
 
+    {
+        .name       = "savevm-mem",
+        .args_type  = "",
+        .params     = "",
+        .help       = "save an in-memory VM snapshot, replacing any previous one",
+        .cmd        = hmp_savevm_mem,
+    },
+
+SRST
+``savevm-mem``
+  Keep a snapshot of guest RAM and device state in host memory.  Dirty
+  logging stays enabled afterwards, so that ``loadvm-mem`` only copies
+  back the pages written since.  Block devices are not included, and
+  migration is blocked until the snapshot is deleted.
+ERST
+
+    {
+        .name       = "loadvm-mem",
+        .args_type  = "",
+        .params     = "",
+        .help       = "restore the in-memory VM snapshot",
+        .cmd        = hmp_loadvm_mem,
+    },
+
+SRST
+``loadvm-mem``
+  Revert the virtual machine to the snapshot taken by ``savevm-mem``.
+  The snapshot is kept and can be restored again.
+ERST
+
+    {
+        .name       = "delvm-mem",
+        .args_type  = "",
+        .params     = "",
+        .help       = "delete the in-memory VM snapshot",
+        .cmd        = hmp_delvm_mem,
+    },
+
+SRST
+``delvm-mem``
+  Delete the snapshot taken by ``savevm-mem`` and free its memory.
+ERST
+
     {
         .name       = "one-insn-per-tb",
         .args_type  = "option:s?",
@@ -15,6 +15,7 @@
 #include "migration/cpr.h"
 #include "qapi/error.h"
 #include "qapi/qapi-types-block.h"
+#include "qemu/timer.h"
 
 /*
  * Read the non-zeroes parts of @blk into @buf
@@ -248,6 +249,8 @@ bool blkconf_apply_backend_options(BlockConf *conf, bool readonly,
 
     blk_set_enable_write_cache(blk, wce);
     blk_set_on_error(blk, rerror, werror);
+    blk_set_request_merging(blk, conf->merge_requests,
+                            conf->merge_window_us * SCALE_US);
 
     block_acct_setup(blk_get_stats(blk), conf->account_invalid,
                      conf->account_failed);
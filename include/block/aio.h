@@ -61,6 +61,21 @@ typedef struct LuringState LuringState;
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Completion of a request submitted with aio_add_sqe().  The cqe is copied
+ * into @cqe and @cb is invoked from aio_poll() in the AioContext's thread.
+ */
+typedef struct CqeHandler CqeHandler;
+struct CqeHandler {
+    void (*cb)(CqeHandler *handler);
+    struct io_uring_cqe cqe;
+    QSIMPLEQ_ENTRY(CqeHandler) next;
+};
+
+typedef QSIMPLEQ_HEAD(, CqeHandler) CqeHandlerSimpleQ;
+#endif
+
 /* Callbacks for file descriptor monitoring implementations */
 typedef struct {
     /*
@@ -222,6 +237,10 @@ struct AioContext {
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+
+    /* Requests added with aio_add_sqe() */
+    CqeHandlerSimpleQ cqe_handler_ready_list;
+    unsigned cqe_handler_inflight;
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -517,6 +536,35 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+#ifdef CONFIG_LINUX_IO_URING
+/**
+ * aio_has_io_uring:
+ * @ctx: the AioContext
+ *
+ * Returns: true if @ctx monitors file descriptors with io_uring, in which
+ * case other requests can be added to the same ring with aio_add_sqe().
+ */
+bool aio_has_io_uring(AioContext *ctx);
+
+/**
+ * aio_add_sqe:
+ * @ctx: the AioContext, must use io_uring (see aio_has_io_uring())
+ * @prep_sqe: fills in the sqe
+ * @opaque: argument for @prep_sqe
+ * @cqe_handler: completion handler, @cqe_handler->cb must be set
+ *
+ * Add a request to the AioContext's io_uring.  The request is submitted
+ * together with the file descriptor monitoring changes in the next
+ * aio_poll() iteration, so that both only take a single io_uring_enter(2).
+ * @prep_sqe must not call io_uring_sqe_set_data().
+ *
+ * Must be called from the AioContext's thread.
+ */
+void aio_add_sqe(AioContext *ctx,
+                 void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
+                 void *opaque, CqeHandler *cqe_handler);
+#endif
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -28,6 +28,7 @@
 #include "block/block-common.h"
 #include "block/block-global-state.h"
 #include "block/snapshot.h"
+#include "qemu/interval-tree.h"
 #include "qemu/iov.h"
 #include "qemu/rcu.h"
 #include "qemu/stats64.h"
@@ -1089,6 +1090,31 @@ typedef struct BdrvBlockStatusCache {
     int64_t data_end;
 } BdrvBlockStatusCache;
 
+/*
+ * Allows bdrv_co_common_block_status_above() to skip the top layers of a
+ * backing chain.
+ *
+ * Each entry covers a range that the first @depth nodes of the chain
+ * below the owning node (the node itself and its filtered and COW
+ * children, in order) are known not to allocate.  Adjacent entries with
+ * the same depth are merged.
+ *
+ * @lock: Protects @tree
+ * @nr_entries: Number of entries in @tree (read atomically outside @lock)
+ * @nr_queries: Number of bdrv_amc_lookup() calls whose bdrv_amc_fill()
+ *              is still to come
+ * @gen: Incremented on invalidations unless the cache is empty and no
+ *       query is in flight, so that a fill racing with a write to the
+ *       chain is dropped
+ */
+typedef struct BdrvAllocMapCache {
+    QemuMutex lock;
+    IntervalTreeRoot tree;
+    unsigned int nr_entries;
+    unsigned int nr_queries;
+    unsigned int gen;
+} BdrvAllocMapCache;
+
 struct BlockDriverState {
     /*
      * Protected by big QEMU lock or read-only after opening.  No special
@@ -1275,6 +1301,9 @@ struct BlockDriverState {
     /* Always non-NULL, but must only be dereferenced under an RCU read guard */
     BdrvBlockStatusCache *block_status_cache;
 
+    /* Allocation status of the backing chain below this node */
+    BdrvAllocMapCache alloc_map_cache;
+
     /* array of write pointers' location of each zone in the zoned device. */
     BlockZoneWps *wps;
 };
@@ -191,4 +191,39 @@ void bdrv_bsc_invalidate_range(BlockDriverState *bs,
  */
 void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes);
 
+/**
+ * Return how many nodes of the chain starting at @bs are known not to
+ * allocate @offset, or 0 if nothing is known.  In the former case,
+ * *pnum is set to the number of bytes from @offset for which this holds.
+ *
+ * *gen is always set, and must be passed to the bdrv_amc_fill() call
+ * that has to follow every lookup.
+ */
+int bdrv_amc_lookup(BlockDriverState *bs, int64_t offset, int64_t *pnum,
+                    unsigned int *gen);
+
+/**
+ * Record that the first @depth nodes of the chain starting at @bs do not
+ * allocate [offset, offset + bytes).  Nothing is recorded if @depth or
+ * @bytes is 0, or if the cache was invalidated since the bdrv_amc_lookup()
+ * call that returned @gen.
+ */
+void bdrv_amc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                   int depth, unsigned int gen);
+
+/**
+ * Forget what is known about [offset, offset + bytes) in the allocation
+ * map cache of @bs and of all nodes that have @bs in their backing chain.
+ *
+ * (To be used by I/O paths that may allocate data in @bs.)
+ */
+void GRAPH_RDLOCK
+bdrv_amc_invalidate_range(BlockDriverState *bs, int64_t offset, int64_t bytes);
+
+/**
+ * Empty the allocation map cache of @bs and of all nodes that have @bs in
+ * their backing chain.
+ */
+void GRAPH_RDLOCK bdrv_amc_invalidate(BlockDriverState *bs);
+
 #endif /* BLOCK_INT_IO_H */
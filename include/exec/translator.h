@@ -169,6 +169,21 @@ bool translator_use_goto_tb(DisasContextBase *db, vaddr dest);
  */
 bool translator_io_start(DisasContextBase *db);
 
+/**
+ * translator_icount_charge
+ * @db: Disassembly context
+ * @exhausted: label to branch to if the budget is used up
+ *
+ * For an instruction that repeats within the TB without returning to
+ * the main loop, such as an x86 REP string instruction, account one
+ * more executed instruction against the icount budget.  If the budget
+ * is used up or an exit was requested, branch to @exhausted without
+ * charging; the target must then return to the main loop so that the
+ * instruction is re-executed from a new TB.
+ * Does nothing if icount is not in use.
+ */
+void translator_icount_charge(DisasContextBase *db, TCGLabel *exhausted);
+
 /*
  * Translator Load Functions
  *
@@ -32,6 +32,8 @@ typedef struct BlockConf {
     OnOffAuto wce;
     bool share_rw;
     OnOffAuto account_invalid, account_failed;
+    bool merge_requests;
+    uint32_t merge_window_us;
     BlockdevOnError rerror;
     BlockdevOnError werror;
 } BlockConf;
@@ -66,7 +68,11 @@ static inline unsigned int get_physical_block_exp(BlockConf *conf)
     DEFINE_PROP_ON_OFF_AUTO("account-invalid", _state,                  \
                             _conf.account_invalid, ON_OFF_AUTO_AUTO),   \
     DEFINE_PROP_ON_OFF_AUTO("account-failed", _state,                   \
-                            _conf.account_failed, ON_OFF_AUTO_AUTO)
+                            _conf.account_failed, ON_OFF_AUTO_AUTO),    \
+    DEFINE_PROP_BOOL("merge-requests", _state, _conf.merge_requests,    \
+                     false),                                            \
+    DEFINE_PROP_UINT32("merge-window-us", _state,                       \
+                       _conf.merge_window_us, 0)
 
 #define DEFINE_BLOCK_PROPERTIES(_state, _conf)                          \
     DEFINE_PROP_DRIVE("drive", _state, _conf.blk),                      \
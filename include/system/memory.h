@@ -72,7 +72,10 @@ static inline void fuzz_dma_read_cb(size_t addr,
 /* Dirty tracking enabled because dirty limit */
 #define GLOBAL_DIRTY_LIMIT      (1U << 2)
 
-#define GLOBAL_DIRTY_MASK  (0x7)
+/* Dirty tracking enabled because an in-memory snapshot is active */
+#define GLOBAL_DIRTY_SNAPSHOT   (1U << 3)
+
+#define GLOBAL_DIRTY_MASK  (0xf)
 
 extern unsigned int global_dirty_tracking;
 
@@ -807,6 +810,8 @@ struct MemoryRegion {
 
     /* For devices designed to perform re-entrant IO into their own IO MRs */
     bool disable_reentrancy_guard;
+    /* Accessors run without the BQL, see memory_region_enable_lockless_io() */
+    bool lockless_io;
 };
 
 struct IOMMUMemoryRegion {
@@ -2252,6 +2257,24 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_enable_lockless_io: Dispatch accesses without the BQL.
+ *
+ * By default every MMIO or PIO access to a region initialized with
+ * memory_region_init_io() is performed with the Big QEMU Lock held.  After
+ * this call, accesses coming from vCPU threads invoke the region's callbacks
+ * without taking the BQL, so that frequently polled registers (timers,
+ * doorbells) do not serialize all vCPUs on one lock.
+ *
+ * The device must protect any state touched by the callbacks with its own
+ * locking.  Since the reentrancy guard is per-device state that is not safe
+ * to update concurrently, it is disabled for the region as well.  Regions
+ * that require coalesced MMIO flushing keep taking the BQL.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_enable_lockless_io(MemoryRegion *mr);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
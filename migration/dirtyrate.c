@@ -728,6 +728,16 @@ static void calculate_dirtyrate(struct DirtyRateConfig config)
     trace_dirtyrate_calculate(DirtyStat.dirty_rate);
 }
 
+/*
+ * Whether a measurement in dirty-bitmap mode is in progress.  It consumes
+ * the DIRTY_MEMORY_MIGRATION bitmap, like in-memory snapshots do.
+ */
+bool dirtyrate_uses_dirty_bitmap(void)
+{
+    return dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP &&
+           qatomic_read(&CalculatingState) != DIRTY_RATE_STATUS_MEASURED;
+}
+
 void *get_dirtyrate_thread(void *arg)
 {
     struct DirtyRateConfig config = *(struct DirtyRateConfig *)arg;
@@ -819,6 +829,14 @@ void qmp_calc_dirty_rate(int64_t calc_time,
          return;
     }
 
+    /* Both would clear dirty bits that the other one needs */
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP &&
+        (global_dirty_tracking & GLOBAL_DIRTY_SNAPSHOT)) {
+        error_setg(errp, "mode %s is not available while an in-memory VM "
+                   "snapshot is active", DirtyRateMeasureMode_str(mode));
+        return;
+    }
+
     /*
      * Init calculation state as unstarted.
      */
@@ -84,4 +84,5 @@ struct DirtyRateStat {
 };
 
 void *get_dirtyrate_thread(void *arg);
+bool dirtyrate_uses_dirty_bitmap(void);
 #endif
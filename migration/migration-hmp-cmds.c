@@ -158,6 +158,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, ", zerocopy_fallbacks=%" PRIu64,
                            info->ram->dirty_sync_missed_zero_copy);
         }
+        if (info->ram->dedup_bytes) {
+            monitor_printf(mon, ", dedup (KiB)=%" PRIu64,
+                           info->ram->dedup_bytes >> 10);
+        }
         monitor_printf(mon, "\n");
     }
 
@@ -184,6 +188,17 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->multifd_compression) {
+        monitor_printf(mon, "Multifd compression: level=%" PRId64
+                       ", busy_rate=%0.2f"
+                       ", ratio=%0.2f"
+                       ", adjustments=%" PRIu64 "\n",
+                       info->multifd_compression->level,
+                       info->multifd_compression->busy_rate,
+                       info->multifd_compression->compression_ratio,
+                       info->multifd_compression->adjustments);
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "CPU Throttle (%%): %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -366,6 +381,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
                                MIGRATION_PARAMETER_DIRECT_IO),
                            params->direct_io ? "on" : "off");
         }
+
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_DEPTH),
+            params->x_postcopy_prefetch_depth);
     }
 
     qapi_free_MigrationParameters(params);
@@ -405,6 +424,30 @@ void hmp_delvm(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, err);
 }
 
+void hmp_savevm_mem(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_x_snapshot_mem_save(&err);
+    hmp_handle_error(mon, err);
+}
+
+void hmp_loadvm_mem(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_x_snapshot_mem_load(&err);
+    hmp_handle_error(mon, err);
+}
+
+void hmp_delvm_mem(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_x_snapshot_mem_delete(&err);
+    hmp_handle_error(mon, err);
+}
+
 void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
 {
     qmp_migrate_cancel(NULL);
@@ -647,6 +690,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_direct_io = true;
         visit_type_bool(v, param, &p->direct_io, &err);
         break;
+    case MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_DEPTH:
+        p->has_x_postcopy_prefetch_depth = true;
+        visit_type_uint32(v, param, &p->x_postcopy_prefetch_depth, &err);
+        break;
     default:
         g_assert_not_reached();
     }
@@ -34,6 +34,11 @@
  * one thread).
  */
 typedef struct {
+    /*
+     * Number of bytes of non-zero pages that were replaced by a
+     * reference to an earlier copy by multifd deduplication.
+     */
+    Stat64 dedup_bytes;
     /*
      * Number of bytes that were dirty last time that we synced with
      * the guest memory.  We use that to calculate the downtime.  As
@@ -0,0 +1,237 @@
+/*
+ * Multifd duplicate page detection
+ *
+ * Each channel keeps a ring with copies of the last pages it sent (or
+ * received).  Both sides fill the ring in the same order, one slot per
+ * normal page, so the source can replace a page whose contents are
+ * still in the ring by the index of that slot.  The destination copies
+ * from its own ring, which keeps references independent of the guest
+ * memory and of the ordering between channels.
+ *
+ * The source sends normal pages out of the ring rather than from guest
+ * memory, so that what the destination stores is exactly what the
+ * source compares against.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qemu/host-utils.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "system/ramblock.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "multifd.h"
+#include "trace.h"
+
+/* Amount of recently transferred data each channel remembers */
+#define MULTIFD_DEDUP_RING_SIZE (16 * MiB)
+
+#define MULTIFD_DEDUP_PRIME1 0x9E3779B185EBCA87ULL
+#define MULTIFD_DEDUP_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+typedef struct {
+    uint64_t hash;
+    uint32_t slot;
+} MultiFDDedupEntry;
+
+struct MultiFDDedup {
+    /* copies of the last nr_slots normal pages */
+    uint8_t *ring;
+    uint32_t nr_slots;
+    /* slot for the next normal page, both sides advance it in lockstep */
+    uint32_t next;
+    /* source only: content hash -> slot, only a hint */
+    MultiFDDedupEntry *table;
+    uint32_t table_mask;
+    /* source only: offsets of the duplicate pages of the current packet */
+    ram_addr_t *dup;
+};
+
+uint32_t multifd_dedup_slots(void)
+{
+    return MULTIFD_DEDUP_RING_SIZE / multifd_ram_page_size();
+}
+
+MultiFDDedup *multifd_dedup_new(void)
+{
+    MultiFDDedup *d = g_new0(MultiFDDedup, 1);
+
+    /* One packet must never wrap around the ring */
+    QEMU_BUILD_BUG_ON(MULTIFD_DEDUP_RING_SIZE < 2 * MULTIFD_PACKET_SIZE);
+
+    d->nr_slots = multifd_dedup_slots();
+    d->ring = g_malloc0((size_t)d->nr_slots * multifd_ram_page_size());
+    d->table_mask = pow2ceil(d->nr_slots * 2) - 1;
+    d->table = g_new0(MultiFDDedupEntry, d->table_mask + 1);
+    d->dup = g_new0(ram_addr_t, multifd_ram_page_count());
+    return d;
+}
+
+void multifd_dedup_free(MultiFDDedup *d)
+{
+    if (!d) {
+        return;
+    }
+    g_free(d->ring);
+    g_free(d->table);
+    g_free(d->dup);
+    g_free(d);
+}
+
+static inline uint8_t *multifd_dedup_slot(MultiFDDedup *d, uint32_t slot)
+{
+    return d->ring + (size_t)slot * multifd_ram_page_size();
+}
+
+/*
+ * A fast non-cryptographic hash of a page, in the style of xxh64 with
+ * four independent lanes.  Collisions are harmless: every match is
+ * confirmed with memcmp() before it is used.
+ */
+static uint64_t multifd_dedup_hash(const void *buf, size_t len)
+{
+    const uint64_t *p = buf;
+    uint64_t v[4] = {
+        MULTIFD_DEDUP_PRIME1 + MULTIFD_DEDUP_PRIME2,
+        MULTIFD_DEDUP_PRIME2,
+        0,
+        -MULTIFD_DEDUP_PRIME1,
+    };
+    uint64_t h;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(uint64_t); i += 4) {
+        for (int j = 0; j < 4; j++) {
+            v[j] = rol64(v[j] + p[i + j] * MULTIFD_DEDUP_PRIME2, 31) *
+                   MULTIFD_DEDUP_PRIME1;
+        }
+    }
+
+    h = rol64(v[0], 1) + rol64(v[1], 7) + rol64(v[2], 12) + rol64(v[3], 18);
+    h ^= h >> 33;
+    h *= MULTIFD_DEDUP_PRIME2;
+    h ^= h >> 29;
+    return h;
+}
+
+/*
+ * A slot can be referenced only if none of the normal pages still to
+ * be scanned in this packet may overwrite it, because the destination
+ * fills the ring with all normal pages before it resolves duplicates.
+ */
+static bool multifd_dedup_slot_stable(MultiFDDedup *d, uint32_t slot,
+                                      uint32_t pending)
+{
+    return (slot + d->nr_slots - d->next) % d->nr_slots >= pending;
+}
+
+/**
+ * multifd_send_dedup_prepare_iovs: Find duplicates and prepare the IOVs
+ *
+ * Must be called after zero page detection.  Normal pages whose
+ * contents are still in the ring become duplicate pages, the others are
+ * copied into the ring and sent from there.  On return p->data->u.ram
+ * is laid out as normal pages, zero pages, duplicate pages.
+ *
+ * @p: the send params
+ */
+void multifd_send_dedup_prepare_iovs(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    MultiFDDedup *d = p->dedup;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t zero_num = pages->num - pages->normal_num;
+    uint32_t normal_num = 0;
+    uint32_t i;
+
+    pages->dup_num = 0;
+
+    for (i = 0; i < pages->normal_num; i++) {
+        ram_addr_t offset = pages->offset[i];
+        void *host = pages->block->host + offset;
+        uint64_t hash = multifd_dedup_hash(host, page_size);
+        MultiFDDedupEntry *e = &d->table[hash & d->table_mask];
+        uint32_t pending = pages->normal_num - i - 1;
+        uint8_t *slot;
+
+        if (e->hash == hash && multifd_dedup_slot_stable(d, e->slot, pending) &&
+            !memcmp(multifd_dedup_slot(d, e->slot), host, page_size)) {
+            d->dup[pages->dup_num] = offset;
+            pages->dup_slot[pages->dup_num] = e->slot;
+            pages->dup_num++;
+            continue;
+        }
+
+        slot = multifd_dedup_slot(d, d->next);
+        memcpy(slot, host, page_size);
+        e->hash = hash;
+        e->slot = d->next;
+        d->next = (d->next + 1) % d->nr_slots;
+
+        pages->offset[normal_num++] = offset;
+        p->iov[p->iovs_num].iov_base = slot;
+        p->iov[p->iovs_num].iov_len = page_size;
+        p->iovs_num++;
+    }
+
+    /* Zero pages move down to make room for the duplicates after them */
+    memmove(&pages->offset[normal_num], &pages->offset[pages->normal_num],
+            zero_num * sizeof(pages->offset[0]));
+    memcpy(&pages->offset[normal_num + zero_num], d->dup,
+           pages->dup_num * sizeof(pages->offset[0]));
+    pages->normal_num = normal_num;
+
+    p->next_packet_size = normal_num * page_size;
+    stat64_add(&mig_stats.dedup_bytes, (uint64_t)pages->dup_num * page_size);
+    trace_multifd_send_dedup(p->id, normal_num, pages->dup_num);
+}
+
+/**
+ * multifd_recv_dedup_pages: Receive normal pages through the ring and
+ * copy the duplicate pages out of it.
+ *
+ * Returns 0 on success, -1 on error.  Slots were validated when the
+ * packet was unfilled.
+ *
+ * @p: the receive params
+ * @errp: pointer to an error
+ */
+int multifd_recv_dedup_pages(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDDedup *d = p->dedup;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t next = d->next;
+    int ret;
+
+    for (int i = 0; i < p->normal_num; i++) {
+        p->iov[i].iov_base = multifd_dedup_slot(d, next);
+        p->iov[i].iov_len = page_size;
+        next = (next + 1) % d->nr_slots;
+    }
+
+    if (p->normal_num) {
+        ret = qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    for (int i = 0; i < p->normal_num; i++) {
+        memcpy(p->host + p->normal[i], multifd_dedup_slot(d, d->next),
+               page_size);
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        d->next = (d->next + 1) % d->nr_slots;
+    }
+
+    for (int i = 0; i < p->dup_num; i++) {
+        memcpy(p->host + p->dup[i], multifd_dedup_slot(d, p->dup_slot[i]),
+               page_size);
+        ramblock_recv_bitmap_set_offset(p->block, p->dup[i]);
+    }
+
+    return 0;
+}
@@ -29,11 +29,13 @@ static MultiFDSendData *multifd_ram_send;
 void multifd_ram_payload_alloc(MultiFDPages_t *pages)
 {
     pages->offset = g_new0(ram_addr_t, multifd_ram_page_count());
+    pages->dup_slot = g_new0(uint32_t, multifd_ram_page_count());
 }
 
 void multifd_ram_payload_free(MultiFDPages_t *pages)
 {
     g_clear_pointer(&pages->offset, g_free);
+    g_clear_pointer(&pages->dup_slot, g_free);
 }
 
 void multifd_ram_save_setup(void)
@@ -76,11 +78,16 @@ static int multifd_nocomp_send_setup(MultiFDSendParams *p, Error **errp)
         p->iov = g_new0(struct iovec, page_count);
     }
 
+    if (migrate_multifd_dedup()) {
+        p->dedup = multifd_dedup_new();
+    }
+
     return 0;
 }
 
 static void multifd_nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
 {
+    g_clear_pointer(&p->dedup, multifd_dedup_free);
     g_free(p->iov);
     p->iov = NULL;
 }
@@ -128,7 +135,11 @@ static int multifd_nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
         multifd_ram_prepare_header(p);
     }
 
-    multifd_send_prepare_iovs(p);
+    if (p->dedup) {
+        multifd_send_dedup_prepare_iovs(p);
+    } else {
+        multifd_send_prepare_iovs(p);
+    }
     p->flags |= MULTIFD_FLAG_NOCOMP;
 
     multifd_send_fill_packet(p);
@@ -150,11 +161,16 @@ static int multifd_nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
 static int multifd_nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
 {
     p->iov = g_new0(struct iovec, multifd_ram_page_count());
+
+    if (migrate_multifd_dedup()) {
+        p->dedup = multifd_dedup_new();
+    }
     return 0;
 }
 
 static void multifd_nocomp_recv_cleanup(MultiFDRecvParams *p)
 {
+    g_clear_pointer(&p->dedup, multifd_dedup_free);
     g_free(p->iov);
     p->iov = NULL;
 }
@@ -177,6 +193,10 @@ static int multifd_nocomp_recv(MultiFDRecvParams *p, Error **errp)
 
     multifd_recv_zero_page_process(p);
 
+    if (p->dedup) {
+        return multifd_recv_dedup_pages(p, errp);
+    }
+
     if (!p->normal_num) {
         return 0;
     }
@@ -197,6 +217,7 @@ static void multifd_pages_reset(MultiFDPages_t *pages)
      */
     pages->num = 0;
     pages->normal_num = 0;
+    pages->dup_num = 0;
     pages->block = NULL;
 }
 
@@ -204,11 +225,12 @@ void multifd_ram_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
     MultiFDPages_t *pages = &p->data->u.ram;
-    uint32_t zero_num = pages->num - pages->normal_num;
+    uint32_t zero_num = pages->num - pages->normal_num - pages->dup_num;
 
     packet->pages_alloc = cpu_to_be32(multifd_ram_page_count());
     packet->normal_pages = cpu_to_be32(pages->normal_num);
     packet->zero_pages = cpu_to_be32(zero_num);
+    packet->dup_pages = cpu_to_be32(pages->dup_num);
 
     if (pages->block) {
         pstrcpy(packet->ramblock, sizeof(packet->ramblock),
@@ -222,6 +244,10 @@ void multifd_ram_fill_packet(MultiFDSendParams *p)
         packet->offset[i] = cpu_to_be64(temp);
     }
 
+    for (int i = 0; i < pages->dup_num; i++) {
+        packet->offset[pages->num + i] = cpu_to_be64(pages->dup_slot[i]);
+    }
+
     trace_multifd_send_ram_fill(p->id, pages->normal_num,
                                 zero_num);
 }
@@ -256,7 +282,20 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
-    if (p->normal_num == 0 && p->zero_num == 0) {
+    p->dup_num = be32_to_cpu(packet->dup_pages);
+    if (p->dup_num > pages_per_packet - p->normal_num - p->zero_num) {
+        error_setg(errp, "multifd: received packet with %u duplicate pages, "
+                   "expected maximum %u",
+                   p->dup_num, pages_per_packet - p->normal_num - p->zero_num);
+        return -1;
+    }
+    if (p->dup_num && !migrate_multifd_dedup()) {
+        error_setg(errp, "multifd: received duplicate pages but "
+                   "x-multifd-dedup is not enabled");
+        return -1;
+    }
+
+    if (p->normal_num == 0 && p->zero_num == 0 && p->dup_num == 0) {
         return 0;
     }
 
@@ -294,6 +333,25 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->zero[i] = offset;
     }
 
+    for (i = 0; i < p->dup_num; i++) {
+        uint32_t n = p->normal_num + p->zero_num + i;
+        uint64_t offset = be64_to_cpu(packet->offset[n]);
+        uint64_t slot = be64_to_cpu(packet->offset[n + p->dup_num]);
+
+        if (offset > (p->block->used_length - page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, p->block->used_length);
+            return -1;
+        }
+        if (slot >= multifd_dedup_slots()) {
+            error_setg(errp, "multifd: dedup slot too large %" PRIu64, slot);
+            return -1;
+        }
+        p->dup[i] = offset;
+        p->dup_slot[i] = slot;
+    }
+
     return 0;
 }
 
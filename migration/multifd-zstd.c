@@ -33,6 +33,8 @@ struct zstd_data {
     uint8_t *zbuff;
     /* size of compressed buffer */
     uint32_t zbuff_len;
+    /* compression level of the current frame */
+    int level;
 };
 
 /* Multifd zstd compression */
@@ -49,7 +51,8 @@ static int multifd_zstd_send_setup(MultiFDSendParams *p, Error **errp)
         return -1;
     }
 
-    res = ZSTD_initCStream(z->zcs, migrate_multifd_zstd_level());
+    z->level = multifd_send_compress_level();
+    res = ZSTD_initCStream(z->zcs, z->level);
     if (ZSTD_isError(res)) {
         ZSTD_freeCStream(z->zcs);
         g_free(z);
@@ -92,6 +95,8 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
 {
     MultiFDPages_t *pages = &p->data->u.ram;
     struct zstd_data *z = p->compress_data;
+    int level = multifd_send_compress_level();
+    ZSTD_EndDirective last_flush = ZSTD_e_flush;
     int ret;
     uint32_t i;
 
@@ -99,6 +104,15 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
         goto out;
     }
 
+    /*
+     * The level can only be changed between frames, so close the current
+     * frame with this packet if a new one was requested.  The receiver
+     * decodes concatenated frames transparently.
+     */
+    if (level != z->level) {
+        last_flush = ZSTD_e_end;
+    }
+
     z->out.dst = z->zbuff;
     z->out.size = z->zbuff_len;
     z->out.pos = 0;
@@ -107,7 +121,7 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
         ZSTD_EndDirective flush = ZSTD_e_continue;
 
         if (i == pages->normal_num - 1) {
-            flush = ZSTD_e_flush;
+            flush = last_flush;
         }
         z->in.src = pages->block->host + pages->offset[i];
         z->in.size = multifd_ram_page_size();
@@ -136,6 +150,16 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
             return -1;
         }
     }
+
+    if (last_flush == ZSTD_e_end) {
+        ret = ZSTD_CCtx_setParameter(z->zcs, ZSTD_c_compressionLevel, level);
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %u: setting level %d failed with %s",
+                       p->id, level, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        z->level = level;
+    }
     p->iov[p->iovs_num].iov_base = z->zbuff;
     p->iov[p->iovs_num].iov_len = z->out.pos;
     p->iovs_num++;
@@ -262,6 +286,32 @@ static int multifd_zstd_recv(MultiFDRecvParams *p, Error **errp)
                    p->id, out_size, expected_size);
         return -1;
     }
+
+    /*
+     * When the source changes the compression level, it ends the frame
+     * with the packet, and the end of the frame can be left in the input
+     * after the last page.  Consume it, so that the next packet starts
+     * with the new frame; the last page has no room for more data.
+     */
+    if (z->in.pos < z->in.size) {
+        size_t pos;
+
+        do {
+            pos = z->in.pos;
+            ret = ZSTD_decompressStream(z->zds, &z->out, &z->in);
+            if (ZSTD_isError(ret)) {
+                error_setg(errp, "multifd %u: decompressStream returned %s",
+                           p->id, ZSTD_getErrorName(ret));
+                return -1;
+            }
+        } while (ret > 0 && z->in.pos > pos && z->in.pos < z->in.size);
+
+        if (ret > 0 || z->in.pos != z->in.size) {
+            error_setg(errp, "multifd %u: packet has data past its last page",
+                       p->id);
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -14,6 +14,7 @@
 #include "qemu/cutils.h"
 #include "qemu/iov.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "system/system.h"
 #include "system/ramblock.h"
@@ -145,6 +146,17 @@ static bool multifd_use_packets(void)
     return !migrate_mapped_ram();
 }
 
+static uint32_t multifd_packet_len(void)
+{
+    uint32_t entries = multifd_ram_page_count();
+
+    /* Duplicate pages also carry the dedup slot they are copied from */
+    if (migrate_multifd_dedup()) {
+        entries *= 2;
+    }
+    return sizeof(MultiFDPacket_t) + sizeof(uint64_t) * entries;
+}
+
 void multifd_send_channel_created(void)
 {
     qemu_sem_post(&multifd_send_state->channels_created);
@@ -159,6 +171,136 @@ void multifd_register_ops(int method, const MultiFDMethods *ops)
     multifd_ops[method] = ops;
 }
 
+/*
+ * Adaptive compression level
+ *
+ * The send threads account the time spent in send_prepare() and the
+ * bytes going in and out of the compressor.  Once per period the
+ * migration thread turns this into the fraction of time the channels
+ * were busy compressing.  Saturated channels mean that compression is
+ * the bottleneck, so the level is lowered, twice as fast if the guest
+ * dirties memory quicker than the channels can compress it.  Mostly idle
+ * channels mean that the link is the bottleneck, so the level is raised
+ * to put fewer bytes on the wire.
+ */
+#define MULTIFD_ADAPTIVE_PERIOD_MS  1000
+#define MULTIFD_ADAPTIVE_BUSY_HIGH  0.9
+#define MULTIFD_ADAPTIVE_BUSY_LOW   0.5
+#define MULTIFD_ADAPTIVE_LEVEL_MIN  1
+#define MULTIFD_ADAPTIVE_LEVEL_MAX  19
+
+static struct {
+    /* Updated by the send threads */
+    Stat64 busy_ns;
+    Stat64 in_bytes;
+    Stat64 out_bytes;
+    /* Read by the send threads, written by the migration thread */
+    int level;
+    /* Only used by the migration thread */
+    int64_t last_time;
+    uint64_t last_busy_ns;
+    uint64_t last_in_bytes;
+    uint64_t last_out_bytes;
+    double busy_rate;
+    double ratio;
+    uint64_t adjustments;
+} multifd_adaptive;
+
+bool multifd_send_adaptive_enabled(void)
+{
+    return migrate_multifd_adaptive_compression() &&
+           migrate_multifd_compression() == MULTIFD_COMPRESSION_ZSTD;
+}
+
+static void multifd_adaptive_reset(void)
+{
+    int level = migrate_multifd_zstd_level();
+
+    if (multifd_send_adaptive_enabled()) {
+        level = MAX(level, MULTIFD_ADAPTIVE_LEVEL_MIN);
+    }
+    stat64_set(&multifd_adaptive.busy_ns, 0);
+    stat64_set(&multifd_adaptive.in_bytes, 0);
+    stat64_set(&multifd_adaptive.out_bytes, 0);
+    qatomic_set(&multifd_adaptive.level, level);
+    multifd_adaptive.last_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    multifd_adaptive.last_busy_ns = 0;
+    multifd_adaptive.last_in_bytes = 0;
+    multifd_adaptive.last_out_bytes = 0;
+    multifd_adaptive.busy_rate = 0;
+    multifd_adaptive.ratio = 0;
+    multifd_adaptive.adjustments = 0;
+}
+
+int multifd_send_compress_level(void)
+{
+    return qatomic_read(&multifd_adaptive.level);
+}
+
+void multifd_send_adaptive_update(int64_t current_time)
+{
+    int64_t elapsed = current_time - multifd_adaptive.last_time;
+    uint64_t busy_ns, in_bytes, out_bytes, in_rate, dirty_rate;
+    int old_level, level;
+
+    if (!multifd_send_adaptive_enabled() ||
+        elapsed < MULTIFD_ADAPTIVE_PERIOD_MS) {
+        return;
+    }
+
+    busy_ns = stat64_get(&multifd_adaptive.busy_ns) -
+              multifd_adaptive.last_busy_ns;
+    in_bytes = stat64_get(&multifd_adaptive.in_bytes) -
+               multifd_adaptive.last_in_bytes;
+    out_bytes = stat64_get(&multifd_adaptive.out_bytes) -
+                multifd_adaptive.last_out_bytes;
+
+    multifd_adaptive.last_time = current_time;
+    multifd_adaptive.last_busy_ns += busy_ns;
+    multifd_adaptive.last_in_bytes += in_bytes;
+    multifd_adaptive.last_out_bytes += out_bytes;
+
+    multifd_adaptive.busy_rate = (double)busy_ns /
+        (elapsed * SCALE_MS * migrate_multifd_channels());
+    if (out_bytes) {
+        multifd_adaptive.ratio = (double)in_bytes / out_bytes;
+    }
+    in_rate = in_bytes * 1000 / elapsed;
+    dirty_rate = stat64_get(&mig_stats.dirty_pages_rate) *
+                 qemu_target_page_size();
+
+    /* Nothing was compressed, e.g. everything left is zero pages */
+    if (!in_rate) {
+        return;
+    }
+
+    old_level = level = multifd_adaptive.level;
+    if (multifd_adaptive.busy_rate > MULTIFD_ADAPTIVE_BUSY_HIGH) {
+        level -= in_rate < dirty_rate ? 2 : 1;
+    } else if (multifd_adaptive.busy_rate < MULTIFD_ADAPTIVE_BUSY_LOW) {
+        level++;
+    }
+    level = MAX(level, MULTIFD_ADAPTIVE_LEVEL_MIN);
+    level = MIN(level, MAX(old_level, MULTIFD_ADAPTIVE_LEVEL_MAX));
+
+    if (level != old_level) {
+        qatomic_set(&multifd_adaptive.level, level);
+        multifd_adaptive.adjustments++;
+        trace_multifd_adaptive_level(old_level, level,
+                                     multifd_adaptive.busy_rate,
+                                     multifd_adaptive.ratio,
+                                     in_rate, dirty_rate);
+    }
+}
+
+void multifd_send_adaptive_stats(MultiFDCompressionStats *stats)
+{
+    stats->level = multifd_send_compress_level();
+    stats->busy_rate = multifd_adaptive.busy_rate;
+    stats->compression_ratio = multifd_adaptive.ratio;
+    stats->adjustments = multifd_adaptive.adjustments;
+}
+
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
     MultiFDInit_t msg = {};
@@ -702,10 +844,22 @@ static void *multifd_send_thread(void *opaque)
                 /* Device state packets cannot be sent via zerocopy */
                 write_flags_masked |= QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
             } else {
+                int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
                 ret = multifd_send_state->ops->send_prepare(p, &local_err);
                 if (ret != 0) {
                     break;
                 }
+
+                if (multifd_send_adaptive_enabled()) {
+                    stat64_add(&multifd_adaptive.busy_ns,
+                               qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+                    stat64_add(&multifd_adaptive.in_bytes,
+                               (uint64_t)p->data->u.ram.normal_num *
+                               multifd_ram_page_size());
+                    stat64_add(&multifd_adaptive.out_bytes,
+                               p->next_packet_size);
+                }
             }
 
             /*
@@ -922,7 +1076,6 @@ bool multifd_send_setup(void)
 {
     MigrationState *s = migrate_get_current();
     int thread_count, ret = 0;
-    uint32_t page_count = multifd_ram_page_count();
     bool use_packets = multifd_use_packets();
     uint8_t i;
 
@@ -930,6 +1083,8 @@ bool multifd_send_setup(void)
         return true;
     }
 
+    multifd_adaptive_reset();
+
     thread_count = migrate_multifd_channels();
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
@@ -949,8 +1104,7 @@ bool multifd_send_setup(void)
         p->data = multifd_send_data_alloc();
 
         if (use_packets) {
-            p->packet_len = sizeof(MultiFDPacket_t)
-                          + sizeof(uint64_t) * page_count;
+            p->packet_len = multifd_packet_len();
             p->packet = g_malloc0(p->packet_len);
             p->packet_device_state = g_malloc0(sizeof(*p->packet_device_state));
             p->packet_device_state->hdr.magic = cpu_to_be32(MULTIFD_MAGIC);
@@ -1136,6 +1290,8 @@ static void multifd_recv_cleanup_channel(MultiFDRecvParams *p)
     p->normal = NULL;
     g_free(p->zero);
     p->zero = NULL;
+    g_clear_pointer(&p->dup, g_free);
+    g_clear_pointer(&p->dup_slot, g_free);
     multifd_recv_state->ops->recv_cleanup(p);
 }
 
@@ -1353,7 +1509,7 @@ static void *multifd_recv_thread(void *opaque)
                  * because older QEMUs (<9.0) still send data along with
                  * the SYNC packet.
                  */
-                has_data = p->normal_num || p->zero_num;
+                has_data = p->normal_num || p->zero_num || p->dup_num;
             }
 
             qemu_mutex_unlock(&p->mutex);
@@ -1479,14 +1635,15 @@ int multifd_recv_setup(Error **errp)
         p->data->size = 0;
 
         if (use_packets) {
-            p->packet_len = sizeof(MultiFDPacket_t)
-                + sizeof(uint64_t) * page_count;
+            p->packet_len = multifd_packet_len();
             p->packet = g_malloc0(p->packet_len);
             p->packet_dev_state = g_malloc0(sizeof(*p->packet_dev_state));
         }
         p->name = g_strdup_printf(MIGRATION_THREAD_DST_MULTIFD, i);
         p->normal = g_new0(ram_addr_t, page_count);
         p->zero = g_new0(ram_addr_t, page_count);
+        p->dup = g_new0(ram_addr_t, page_count);
+        p->dup_slot = g_new0(uint32_t, page_count);
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -18,6 +18,7 @@
 
 typedef struct MultiFDRecvData MultiFDRecvData;
 typedef struct MultiFDSendData MultiFDSendData;
+typedef struct MultiFDDedup MultiFDDedup;
 
 typedef enum {
     /* No sync request */
@@ -47,6 +48,10 @@ void multifd_recv_sync_main(void);
 int multifd_send_sync_main(MultiFDSyncReq req);
 bool multifd_queue_page(RAMBlock *block, ram_addr_t offset);
 bool multifd_recv(void);
+bool multifd_send_adaptive_enabled(void);
+int multifd_send_compress_level(void);
+void multifd_send_adaptive_update(int64_t current_time);
+void multifd_send_adaptive_stats(MultiFDCompressionStats *stats);
 MultiFDRecvData *multifd_get_recv_data(void);
 
 /* Multiple fd's */
@@ -94,13 +99,17 @@ typedef struct {
     uint64_t packet_num;
     /* zero pages */
     uint32_t zero_pages;
-    uint32_t unused32[1];    /* Reserved for future use */
+    /* pages copied from an earlier page, only with x-multifd-dedup */
+    uint32_t dup_pages;
     uint64_t unused64[3];    /* Reserved for future use */
     char ramblock[256];
     /*
      * This array contains the pointers to:
      *  - normal pages (initial normal_pages entries)
      *  - zero pages (following zero_pages entries)
+     *  - duplicate pages (following dup_pages entries)
+     *  - the dedup slot of each duplicate page (following dup_pages
+     *    entries)
      */
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
@@ -120,6 +129,10 @@ typedef struct {
     uint32_t num;
     /* number of normal pages */
     uint32_t normal_num;
+    /* number of duplicate pages, they follow the zero pages */
+    uint32_t dup_num;
+    /* dedup slot each duplicate page is copied from */
+    uint32_t *dup_slot;
     /*
      * Pointer to the ramblock.  NOTE: it's caller's responsibility to make
      * sure the pointer is always valid!
@@ -234,6 +247,8 @@ typedef struct {
     uint32_t iovs_num;
     /* used for compression methods */
     void *compress_data;
+    /* used for deduplication, NULL if disabled */
+    MultiFDDedup *dedup;
 }  MultiFDSendParams;
 
 typedef struct {
@@ -291,6 +306,14 @@ typedef struct {
     ram_addr_t *zero;
     /* num of zero pages */
     uint32_t zero_num;
+    /* Pages that are copies of a recently received page */
+    ram_addr_t *dup;
+    /* dedup slot each duplicate page is copied from */
+    uint32_t *dup_slot;
+    /* num of duplicate pages */
+    uint32_t dup_num;
+    /* used for deduplication, NULL if disabled */
+    MultiFDDedup *dedup;
     /* used for de-compression methods */
     void *compress_data;
     /* Flags for the QIOChannel */
@@ -381,6 +404,11 @@ void multifd_send_fill_packet(MultiFDSendParams *p);
 bool multifd_send_prepare_common(MultiFDSendParams *p);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
+MultiFDDedup *multifd_dedup_new(void);
+void multifd_dedup_free(MultiFDDedup *d);
+uint32_t multifd_dedup_slots(void);
+void multifd_send_dedup_prepare_iovs(MultiFDSendParams *p);
+int multifd_recv_dedup_pages(MultiFDRecvParams *p, Error **errp);
 
 void multifd_channel_connect(MultiFDSendParams *p, QIOChannel *ioc);
 bool multifd_send(MultiFDSendData **send_data);
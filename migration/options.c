@@ -86,6 +86,10 @@
 #define DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT_PERIOD     1000    /* milliseconds */
 #define DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT            1       /* MB/s */
 
+/* Host pages requested ahead of a postcopy fault, 0 disables prefetch */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_DEPTH     0
+#define MAX_MIGRATE_POSTCOPY_PREFETCH_DEPTH         256
+
 const Property migration_properties[] = {
     DEFINE_PROP_BOOL("store-global-state", MigrationState,
                      store_global_state, true),
@@ -177,6 +181,9 @@ const Property migration_properties[] = {
     DEFINE_PROP_ZERO_PAGE_DETECTION("zero-page-detection", MigrationState,
                        parameters.zero_page_detection,
                        ZERO_PAGE_DETECTION_MULTIFD),
+    DEFINE_PROP_UINT32("x-postcopy-prefetch-depth", MigrationState,
+                       parameters.x_postcopy_prefetch_depth,
+                       DEFAULT_MIGRATE_POSTCOPY_PREFETCH_DEPTH),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -201,6 +208,10 @@ const Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-multifd-adaptive-compression",
+                        MIGRATION_CAPABILITY_X_MULTIFD_ADAPTIVE_COMPRESSION),
+    DEFINE_PROP_MIG_CAP("x-multifd-dedup",
+                        MIGRATION_CAPABILITY_X_MULTIFD_DEDUP),
 };
 const size_t migration_properties_count = ARRAY_SIZE(migration_properties);
 
@@ -281,6 +292,20 @@ bool migrate_multifd(void)
     return s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_adaptive_compression(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_X_MULTIFD_ADAPTIVE_COMPRESSION];
+}
+
+bool migrate_multifd_dedup(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_X_MULTIFD_DEDUP];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s = migrate_get_current();
@@ -610,6 +635,30 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_X_MULTIFD_ADAPTIVE_COMPRESSION] &&
+        !new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Capability 'x-multifd-adaptive-compression' "
+                   "requires capability 'multifd'");
+        return false;
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_X_MULTIFD_DEDUP]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MULTIFD] ||
+            migrate_multifd_compression()) {
+            error_setg(errp, "Multifd deduplication requires non-compressed "
+                       "multifd migration");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            new_caps[MIGRATION_CAPABILITY_MAPPED_RAM] ||
+            new_caps[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+            error_setg(errp, "Multifd deduplication is not compatible with "
+                       "postcopy-ram, mapped-ram or zero-copy-send");
+            return false;
+        }
+    }
+
     if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
         if (new_caps[MIGRATION_CAPABILITY_XBZRLE]) {
             error_setg(errp,
@@ -775,6 +824,13 @@ uint64_t migrate_max_postcopy_bandwidth(void)
     return s->parameters.max_postcopy_bandwidth;
 }
 
+uint32_t migrate_postcopy_prefetch_depth(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_postcopy_prefetch_depth;
+}
+
 MigMode migrate_mode(void)
 {
     MigMode mode = cpr_get_incoming_mode();
@@ -957,6 +1013,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->zero_page_detection = s->parameters.zero_page_detection;
     params->has_direct_io = true;
     params->direct_io = s->parameters.direct_io;
+    params->has_x_postcopy_prefetch_depth = true;
+    params->x_postcopy_prefetch_depth = s->parameters.x_postcopy_prefetch_depth;
 
     return params;
 }
@@ -991,6 +1049,7 @@ void migrate_params_init(MigrationParameters *params)
     params->has_mode = true;
     params->has_zero_page_detection = true;
     params->has_direct_io = true;
+    params->has_x_postcopy_prefetch_depth = true;
 }
 
 /*
@@ -1149,6 +1208,13 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
     }
 #endif
 
+    if (migrate_multifd_dedup() &&
+        params->has_multifd_compression && params->multifd_compression) {
+        error_setg(errp,
+                   "Multifd deduplication requires non-compressed multifd migration");
+        return false;
+    }
+
     if (migrate_mapped_ram() &&
         (migrate_multifd_compression() || migrate_tls())) {
         error_setg(errp,
@@ -1177,6 +1243,16 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_x_postcopy_prefetch_depth &&
+        params->x_postcopy_prefetch_depth >
+        MAX_MIGRATE_POSTCOPY_PREFETCH_DEPTH) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x-postcopy-prefetch-depth",
+                   "an integer in the range of 0 to "
+                   stringify(MAX_MIGRATE_POSTCOPY_PREFETCH_DEPTH));
+        return false;
+    }
+
     return true;
 }
 
@@ -1295,6 +1371,10 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_direct_io) {
         dest->direct_io = params->direct_io;
     }
+
+    if (params->has_x_postcopy_prefetch_depth) {
+        dest->x_postcopy_prefetch_depth = params->x_postcopy_prefetch_depth;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1427,6 +1507,11 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_direct_io) {
         s->parameters.direct_io = params->direct_io;
     }
+
+    if (params->has_x_postcopy_prefetch_depth) {
+        s->parameters.x_postcopy_prefetch_depth =
+            params->x_postcopy_prefetch_depth;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -775,6 +775,112 @@ static int postcopy_request_page(MigrationIncomingState *mis, RAMBlock *rb,
     return migrate_send_rp_req_pages(mis, rb, start, haddr);
 }
 
+/*
+ * Fault thread state used to guess which pages the guest touches next.
+ * Pages [start, ahead] along @stride have already been asked for.
+ */
+typedef struct PostcopyPrefetch {
+    RAMBlock *rb;
+    ram_addr_t last;
+    int64_t delta;
+    int64_t stride;
+    ram_addr_t start;
+    ram_addr_t ahead;
+} PostcopyPrefetch;
+
+static void postcopy_prefetch_flush(MigrationIncomingState *mis, RAMBlock *rb,
+                                    int64_t stride, ram_addr_t start,
+                                    size_t len)
+{
+    if (!len) {
+        return;
+    }
+    trace_postcopy_prefetch(qemu_ram_get_idstr(rb), start, len, stride);
+    /*
+     * Best effort only: a broken return path is noticed, and recovered
+     * from, by the next demand fault.
+     */
+    migrate_send_rp_message_req_pages(mis, rb, start, len);
+}
+
+/*
+ * After a demand fault on @offset, ask the source for the next pages the
+ * guest is likely to touch.  Two faults in a row with the same distance
+ * make that distance the stride, otherwise the following host pages are
+ * requested.  Adjacent pages are merged into a single request, and the
+ * prefetched pages are not recorded as requested so that a later fault
+ * on one of them still asks for it with priority.
+ *
+ * With postcopy preempt the source sends every requested page on the
+ * urgent channel, where prefetched pages would queue up in front of the
+ * next demand fault, so no prefetching is done then.
+ */
+static void postcopy_prefetch(MigrationIncomingState *mis,
+                              PostcopyPrefetch *pf, RAMBlock *rb,
+                              ram_addr_t offset)
+{
+    uint32_t depth = migrate_postcopy_prefetch_depth();
+    int64_t ps = qemu_ram_pagesize(rb);
+    int64_t delta = 0, stride;
+    ram_addr_t lo, hi, run_start = 0;
+    size_t run_len = 0;
+    uint32_t i;
+
+    if (!depth || migrate_postcopy_preempt()) {
+        return;
+    }
+
+    if (rb == pf->rb) {
+        delta = (int64_t)offset - (int64_t)pf->last;
+    } else {
+        pf->rb = rb;
+        pf->stride = 0;
+    }
+    stride = (delta && delta == pf->delta) ? delta : ps;
+    pf->delta = delta;
+    pf->last = offset;
+
+    lo = MIN(pf->start, pf->ahead);
+    hi = MAX(pf->start, pf->ahead);
+    if (stride != pf->stride || offset < lo || offset > hi) {
+        pf->stride = stride;
+        pf->start = pf->ahead = offset;
+    }
+
+    for (i = 1; i <= depth; i++) {
+        int64_t cand = (int64_t)offset + (int64_t)i * stride;
+
+        if (cand < 0 || cand >= rb->used_length) {
+            break;
+        }
+        if (stride > 0 ? cand <= pf->ahead : cand >= pf->ahead) {
+            continue;
+        }
+        pf->ahead = cand;
+
+        if (ramblock_recv_bitmap_test_byte_offset(rb, cand) ||
+            ramblock_page_is_discarded(rb, cand)) {
+            continue;
+        }
+
+        if (run_len && run_len + ps <= UINT32_MAX) {
+            if (cand == run_start + run_len) {
+                run_len += ps;
+                continue;
+            }
+            if (cand + ps == run_start) {
+                run_start = cand;
+                run_len += ps;
+                continue;
+            }
+        }
+        postcopy_prefetch_flush(mis, rb, stride, run_start, run_len);
+        run_start = cand;
+        run_len = ps;
+    }
+    postcopy_prefetch_flush(mis, rb, stride, run_start, run_len);
+}
+
 /*
  * Callback from shared fault handlers to ask for a page,
  * the page must be specified by a RAMBlock and an offset in that rb
@@ -960,6 +1066,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
     int ret;
     size_t index;
     RAMBlock *rb = NULL;
+    PostcopyPrefetch prefetch = { };
 
     trace_postcopy_ram_fault_thread_entry();
     rcu_register_thread();
@@ -1084,6 +1191,7 @@ retry:
                 postcopy_pause_fault_thread(mis);
                 goto retry;
             }
+            postcopy_prefetch(mis, &prefetch, rb, rb_offset);
         }
 
         /* Now handle any requests from external processes on shared memory */
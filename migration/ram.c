@@ -89,6 +89,12 @@
  */
 #define MAPPED_RAM_LOAD_BUF_SIZE 0x100000
 
+/*
+ * When doing mapped-ram migration without multifd, contiguous pages are
+ * gathered and written to the file up to this amount at a time.
+ */
+#define MAPPED_RAM_SAVE_BUF_SIZE 0x100000
+
 XBZRLECacheStats xbzrle_counters;
 
 /*
@@ -138,6 +144,10 @@ struct PageSearchStatus {
     /* The start/end of current host page.  Invalid if host_page_sending==false */
     unsigned long host_page_start;
     unsigned long host_page_end;
+    /* mapped-ram: contiguous pages of run_block not yet written out */
+    RAMBlock *run_block;
+    ram_addr_t run_start;
+    ram_addr_t run_len;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -1180,6 +1190,52 @@ static int save_zero_page(RAMState *rs, PageSearchStatus *pss,
     return len;
 }
 
+/*
+ * Write out the pages gathered by mapped_ram_save_page() with one
+ * positional write.
+ */
+static void mapped_ram_flush_run(PageSearchStatus *pss)
+{
+    RAMBlock *block = pss->run_block;
+
+    if (!block) {
+        return;
+    }
+
+    qemu_put_buffer_at(pss->pss_channel, block->host + pss->run_start,
+                       pss->run_len, block->pages_offset + pss->run_start);
+    pss->run_block = NULL;
+    pss->run_len = 0;
+}
+
+/*
+ * Pages are written at fixed offsets, so consecutive guest pages are
+ * consecutive in the file too; gather them instead of issuing one
+ * write per target page.
+ */
+static void mapped_ram_save_page(PageSearchStatus *pss, RAMBlock *block,
+                                 ram_addr_t offset, uint8_t *buf)
+{
+    if (pss->run_block &&
+        (pss->run_block != block ||
+         pss->run_start + pss->run_len != offset ||
+         pss->run_len >= MAPPED_RAM_SAVE_BUF_SIZE)) {
+        mapped_ram_flush_run(pss);
+    }
+
+    if (buf != block->host + offset) {
+        qemu_put_buffer_at(pss->pss_channel, buf, TARGET_PAGE_SIZE,
+                           block->pages_offset + offset);
+    } else if (pss->run_block) {
+        pss->run_len += TARGET_PAGE_SIZE;
+    } else {
+        pss->run_block = block;
+        pss->run_start = offset;
+        pss->run_len = TARGET_PAGE_SIZE;
+    }
+    set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+}
+
 /*
  * directly send the page to the stream
  *
@@ -1197,9 +1253,7 @@ static int save_normal_page(PageSearchStatus *pss, RAMBlock *block,
     QEMUFile *file = pss->pss_channel;
 
     if (migrate_mapped_ram()) {
-        qemu_put_buffer_at(file, buf, TARGET_PAGE_SIZE,
-                           block->pages_offset + offset);
-        set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        mapped_ram_save_page(pss, block, offset, buf);
     } else {
         ram_transferred_add(save_page_header(pss, pss->pss_channel, block,
                                              offset | RAM_SAVE_FLAG_PAGE));
@@ -3231,6 +3285,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
                 }
                 i++;
             }
+            mapped_ram_flush_run(&rs->pss[RAM_CHANNEL_PRECOPY]);
         }
     }
 
@@ -3309,6 +3364,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
                 return pages;
             }
         }
+        mapped_ram_flush_run(&rs->pss[RAM_CHANNEL_PRECOPY]);
         qemu_mutex_unlock(&rs->bitmap_mutex);
 
         ret = rdma_registration_stop(f, RAM_CONTROL_FINISH);
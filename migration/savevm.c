@@ -1783,6 +1783,11 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
         return -EINVAL;
     }
 
+    if (migrate_multifd()) {
+        error_setg(errp, "multifd is not supported by internal snapshots");
+        return -EINVAL;
+    }
+
     ret = migrate_init(ms, errp);
     if (ret) {
         return ret;
@@ -2298,7 +2303,8 @@ static gboolean postcopy_sync_page_req(gpointer key, gpointer value,
         return FALSE;
     }
 
-    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset);
+    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset,
+                                            qemu_ram_pagesize(rb));
     if (ret) {
         /* Please refer to above comment. */
         error_report("%s: send rp message failed for addr %p",
@@ -3446,6 +3452,10 @@ bool load_snapshot(const char *name, const char *vmstate,
     int ret;
     MigrationIncomingState *mis = migration_incoming_get_current();
 
+    if (migrate_multifd()) {
+        error_setg(errp, "multifd is not supported by internal snapshots");
+        return false;
+    }
     if (!bdrv_all_can_snapshot(has_devices, devices, errp)) {
         return false;
     }
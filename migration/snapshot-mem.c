@@ -0,0 +1,353 @@
+/*
+ * In-memory VM snapshots
+ *
+ * The snapshot keeps a private copy of every migratable RAMBlock plus the
+ * serialized device state.  Dirty logging stays enabled while the snapshot
+ * exists, so that reverting to it only has to copy back the pages that the
+ * guest (or DMA) wrote since it was taken or last restored.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
+#include "qemu/yank.h"
+#include "io/channel-buffer.h"
+#include "block/block.h"
+#include "exec/target_page.h"
+#include "migration/blocker.h"
+#include "migration/global_state.h"
+#include "migration/misc.h"
+#include "migration/snapshot.h"
+#include "system/memory.h"
+#include "system/ram_addr.h"
+#include "system/ramblock.h"
+#include "system/replay.h"
+#include "system/runstate.h"
+#include "migration.h"
+#include "qemu-file.h"
+#include "savevm.h"
+#include "ram.h"
+#include "dirtyrate.h"
+#include "trace.h"
+
+#define SNAPSHOT_MEM_DEVSTATE_SIZE (64 * 1024)
+#define SNAPSHOT_MEM_BLOCKER "An in-memory VM snapshot is active"
+
+typedef struct SnapshotMemBlock {
+    char *idstr;
+    ram_addr_t length;
+    uint8_t *copy;
+} SnapshotMemBlock;
+
+typedef struct SnapshotMem {
+    SnapshotMemBlock *blocks;
+    unsigned int nr_blocks;
+    uint8_t *devstate;
+    size_t devstate_len;
+    Error *blocker;
+    /* The dirty log no longer covers everything since the last restore */
+    bool restore_all;
+} SnapshotMem;
+
+static SnapshotMem *snapshot_mem;
+
+static void snapshot_mem_free(SnapshotMem *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        qemu_anon_ram_free(s->blocks[i].copy, s->blocks[i].length);
+        g_free(s->blocks[i].idstr);
+    }
+    g_free(s->blocks);
+    g_free(s->devstate);
+    migrate_del_blocker(&s->blocker);
+    g_free(s);
+}
+
+/*
+ * Like migration_is_blocked(), except that the blocker of the snapshot
+ * that is about to be replaced does not count.
+ */
+static bool snapshot_mem_is_blocked(Error **errp)
+{
+    bool blocked;
+
+    if (!snapshot_mem) {
+        return migration_is_blocked(errp);
+    }
+
+    migrate_del_blocker(&snapshot_mem->blocker);
+    blocked = migration_is_blocked(errp);
+    error_setg(&snapshot_mem->blocker, SNAPSHOT_MEM_BLOCKER);
+    /* Only fails while migrating, which was checked by the caller */
+    migrate_add_blocker_internal(&snapshot_mem->blocker, &error_abort);
+    return blocked;
+}
+
+/*
+ * Called with the VM stopped and dirty logging enabled: throw away
+ * whatever was logged so far and take a copy of every migratable block.
+ */
+static bool snapshot_mem_save_ram(SnapshotMem *s, Error **errp)
+{
+    RAMBlock *rb;
+    unsigned int n = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_MIGRATABLE(rb) {
+        n++;
+    }
+    s->blocks = g_new0(SnapshotMemBlock, n);
+
+    RAMBLOCK_FOREACH_MIGRATABLE(rb) {
+        SnapshotMemBlock *sb = &s->blocks[s->nr_blocks];
+        uint64_t align = qemu_ram_pagesize(rb);
+
+        sb->length = rb->used_length;
+        sb->copy = qemu_anon_ram_alloc(sb->length, &align, false, false);
+        if (!sb->copy) {
+            error_setg(errp, "Could not allocate %" PRIu64 " bytes for '%s'",
+                       (uint64_t)sb->length, rb->idstr);
+            return false;
+        }
+        sb->idstr = g_strdup(rb->idstr);
+        s->nr_blocks++;
+
+        g_free(memory_region_snapshot_and_clear_dirty(rb->mr, 0, sb->length,
+                                                      DIRTY_MEMORY_MIGRATION));
+        memcpy(sb->copy, rb->host, sb->length);
+    }
+    return true;
+}
+
+static bool snapshot_mem_save_devices(SnapshotMem *s, Error **errp)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+
+    bioc = qio_channel_buffer_new(SNAPSHOT_MEM_DEVSTATE_SIZE);
+    f = qemu_file_new_output(QIO_CHANNEL(bioc));
+
+    ret = qemu_save_device_state(f);
+    if (ret == 0) {
+        ret = qemu_fflush(f);
+    }
+    if (ret == 0) {
+        s->devstate_len = bioc->usage;
+        s->devstate = g_steal_pointer(&bioc->data);
+    }
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Error while saving device state");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Copy back the pages dirtied since the last save or restore, or all of
+ * them if the dirty log is incomplete.  The copy bypasses dirty tracking;
+ * TBs translated from restored pages are flushed when the CPU state is
+ * loaded, and displays are told to redraw them.
+ */
+static bool snapshot_mem_restore_ram(SnapshotMem *s, uint64_t *pages,
+                                     Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    unsigned int i;
+
+    RCU_READ_LOCK_GUARD();
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        SnapshotMemBlock *sb = &s->blocks[i];
+        RAMBlock *rb = qemu_ram_block_by_name(sb->idstr);
+        g_autofree DirtyBitmapSnapshot *snap = NULL;
+        ram_addr_t offset;
+
+        if (!rb || rb->used_length != sb->length) {
+            error_setg(errp, "RAM block '%s' changed since the snapshot "
+                       "was taken", sb->idstr);
+            return false;
+        }
+
+        snap = memory_region_snapshot_and_clear_dirty(rb->mr, 0, sb->length,
+                                                      DIRTY_MEMORY_MIGRATION);
+        for (offset = 0; offset < sb->length; offset += page_size) {
+            if (!s->restore_all &&
+                !memory_region_snapshot_get_dirty(rb->mr, snap,
+                                                  offset, page_size)) {
+                continue;
+            }
+            memcpy(rb->host + offset, sb->copy + offset, page_size);
+            cpu_physical_memory_set_dirty_range(rb->offset + offset, page_size,
+                                                1 << DIRTY_MEMORY_VGA);
+            (*pages)++;
+        }
+    }
+    s->restore_all = false;
+    return true;
+}
+
+static bool snapshot_mem_load_devices(SnapshotMem *s, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+
+    bioc = qio_channel_buffer_new(0);
+    bioc->data = g_memdup2(s->devstate, s->devstate_len);
+    bioc->capacity = bioc->usage = s->devstate_len;
+    f = qemu_file_new_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    if (qemu_get_be32(f) != QEMU_VM_FILE_MAGIC ||
+        qemu_get_be32(f) != QEMU_VM_FILE_VERSION) {
+        qemu_fclose(f);
+        error_setg(errp, "Corrupted in-memory snapshot");
+        return false;
+    }
+
+    mis->from_src_file = f;
+    if (!yank_register_instance(MIGRATION_YANK_INSTANCE, errp)) {
+        migration_incoming_state_destroy();
+        return false;
+    }
+    ret = qemu_load_device_state(f);
+    migration_incoming_state_destroy();
+
+    if (ret < 0) {
+        error_setg(errp, "Error %d while loading device state", ret);
+        return false;
+    }
+    return true;
+}
+
+void qmp_x_snapshot_mem_save(Error **errp)
+{
+    RunState saved_state = runstate_get();
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    SnapshotMem *s;
+    bool ok;
+
+    GLOBAL_STATE_CODE();
+
+    /* A previous snapshot is only replaced once the new one is complete */
+    if (migration_is_running()) {
+        error_setg(errp, "Cannot take an in-memory snapshot during migration");
+        return;
+    }
+    if (dirtyrate_uses_dirty_bitmap()) {
+        error_setg(errp, "Cannot take an in-memory snapshot while the dirty "
+                   "rate is measured in dirty-bitmap mode");
+        return;
+    }
+    if (snapshot_mem_is_blocked(errp)) {
+        return;
+    }
+    if (!replay_can_snapshot()) {
+        error_setg(errp, "Record/replay does not allow making snapshot "
+                   "right now. Try once more later.");
+        return;
+    }
+
+    s = g_new0(SnapshotMem, 1);
+    error_setg(&s->blocker, SNAPSHOT_MEM_BLOCKER);
+    if (migrate_add_blocker(&s->blocker, errp) < 0) {
+        g_free(s);
+        return;
+    }
+
+    global_state_store();
+    vm_stop(RUN_STATE_SAVE_VM);
+    bdrv_drain_all_begin();
+
+    ok = memory_global_dirty_log_start(GLOBAL_DIRTY_SNAPSHOT, errp);
+    if (ok) {
+        ok = snapshot_mem_save_ram(s, errp) &&
+             snapshot_mem_save_devices(s, errp);
+        if (!ok) {
+            snapshot_mem_free(s);
+            if (snapshot_mem) {
+                /* Saving RAM cleared dirty bits that it still needs */
+                snapshot_mem->restore_all = true;
+            } else {
+                memory_global_dirty_log_stop(GLOBAL_DIRTY_SNAPSHOT);
+            }
+        }
+    } else {
+        migrate_del_blocker(&s->blocker);
+        g_free(s);
+    }
+
+    bdrv_drain_all_end();
+    vm_resume(saved_state);
+
+    if (ok) {
+        if (snapshot_mem) {
+            snapshot_mem_free(snapshot_mem);
+        }
+        snapshot_mem = s;
+        trace_snapshot_mem_save(s->nr_blocks, s->devstate_len,
+                                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+}
+
+void qmp_x_snapshot_mem_load(Error **errp)
+{
+    RunState saved_state = runstate_get();
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t pages = 0;
+    bool ok;
+
+    GLOBAL_STATE_CODE();
+
+    if (!snapshot_mem) {
+        error_setg(errp, "No in-memory snapshot has been taken");
+        return;
+    }
+
+    vm_stop(RUN_STATE_RESTORE_VM);
+    replay_flush_events();
+    bdrv_drain_all_begin();
+
+    /*
+     * Reset first: it may rewrite RAM (e.g. ROM blobs), and those writes
+     * are logged and therefore undone by the RAM restore below.
+     */
+    qemu_system_reset(SHUTDOWN_CAUSE_SNAPSHOT_LOAD);
+    ok = snapshot_mem_restore_ram(snapshot_mem, &pages, errp) &&
+         snapshot_mem_load_devices(snapshot_mem, errp);
+
+    bdrv_drain_all_end();
+
+    if (ok) {
+        trace_snapshot_mem_load(pages,
+                                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+        load_snapshot_resume(saved_state);
+    }
+}
+
+void qmp_x_snapshot_mem_delete(Error **errp)
+{
+    GLOBAL_STATE_CODE();
+
+    if (!snapshot_mem) {
+        error_setg(errp, "No in-memory snapshot has been taken");
+        return;
+    }
+    snapshot_mem_free(g_steal_pointer(&snapshot_mem));
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_SNAPSHOT);
+}
@@ -15,10 +15,131 @@
 #include "qemu/host-utils.h"
 #include "xbzrle.h"
 
-#if defined(CONFIG_AVX512BW_OPT)
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
 #include <immintrin.h>
 #include "host/cpuinfo.h"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+typedef int (*xbzrle_encode_fn)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen);
+
+/*
+  page = zrun nzrun
+       | zrun nzrun page
+
+  zrun = length
+
+  nzrun = length byte...
+
+  length = uleb128 encoded integer
+ */
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
+{
+    uint32_t zrun_len = 0, nzrun_len = 0;
+    int d = 0, i = 0;
+    long res;
+    uint8_t *nzrun_start = NULL;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        /* not aligned to sizeof(long) */
+        res = (slen - i) % sizeof(long);
+        while (res && old_buf[i] == new_buf[i]) {
+            zrun_len++;
+            i++;
+            res--;
+        }
+
+        /* word at a time for speed */
+        if (!res) {
+            while (i < slen &&
+                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+                i += sizeof(long);
+                zrun_len += sizeof(long);
+            }
+
+            /* go over the rest */
+            while (i < slen && old_buf[i] == new_buf[i]) {
+                zrun_len++;
+                i++;
+            }
+        }
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
 
+        zrun_len = 0;
+        nzrun_start = new_buf + i;
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        /* not aligned to sizeof(long) */
+        res = (slen - i) % sizeof(long);
+        while (res && old_buf[i] != new_buf[i]) {
+            i++;
+            nzrun_len++;
+            res--;
+        }
+
+        /* word at a time for speed, use of 32-bit long okay */
+        if (!res) {
+            /* truncation to 32-bit long okay */
+            unsigned long mask = (unsigned long)0x0101010101010101ULL;
+            while (i < slen) {
+                unsigned long xor;
+                xor = *(unsigned long *)(old_buf + i)
+                    ^ *(unsigned long *)(new_buf + i);
+                if ((xor - mask) & ~xor & (mask << 7)) {
+                    /* found the end of an nzrun within the current long */
+                    while (old_buf[i] != new_buf[i]) {
+                        nzrun_len++;
+                        i++;
+                    }
+                    break;
+                } else {
+                    i += sizeof(long);
+                    nzrun_len += sizeof(long);
+                }
+            }
+        }
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, nzrun_start, nzrun_len);
+        d += nzrun_len;
+        nzrun_len = 0;
+    }
+
+    return d;
+}
+
+#if defined(CONFIG_AVX512BW_OPT)
 static int __attribute__((target("avx512bw")))
 xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
                             uint8_t *dst, int dlen)
@@ -136,51 +257,53 @@ xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
     }
     return d;
 }
+#endif
 
-static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
-                                    int slen, uint8_t *dst, int dlen);
-
-static int (*accel_func)(uint8_t *, uint8_t *, int, uint8_t *, int);
-
-static void __attribute__((constructor)) init_accel(void)
+#if defined(CONFIG_AVX2_OPT)
+/* Return the end of the run of equal bytes starting at @i.  */
+static inline int __attribute__((target("avx2")))
+zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf, int i, int slen)
 {
-    unsigned info = cpuinfo_init();
-    if (info & CPUINFO_AVX512BW) {
-        accel_func = xbzrle_encode_buffer_avx512;
-    } else {
-        accel_func = xbzrle_encode_buffer_int;
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq != UINT32_MAX) {
+            return i + ctz32(~eq);
+        }
     }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
 }
 
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+/* Return the end of the run of differing bytes starting at @i.  */
+static inline int __attribute__((target("avx2")))
+nzrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf, int i, int slen)
 {
-    return accel_func(old_buf, new_buf, slen, dst, dlen);
-}
-
-#define xbzrle_encode_buffer xbzrle_encode_buffer_int
-#endif
-
-/*
-  page = zrun nzrun
-       | zrun nzrun page
-
-  zrun = length
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
 
-  nzrun = length byte...
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
 
-  length = uleb128 encoded integer
- */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+/* Produces exactly the same stream as xbzrle_encode_buffer_int.  */
+static int __attribute__((target("avx2")))
+xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
-
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
+    int d = 0, i = 0, end;
 
     while (i < slen) {
         /* overflow */
@@ -188,90 +311,131 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = zrun_end_avx2(old_buf, new_buf, i, slen);
 
         /* buffer unchanged */
-        if (zrun_len == slen) {
+        if (end - i == slen) {
             return 0;
         }
 
         /* skip last zero run */
-        if (i == slen) {
+        if (end == slen) {
             return d;
         }
 
-        d += uleb128_encode_small(dst + d, zrun_len);
-
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
+        d += uleb128_encode_small(dst + d, end - i);
+        i = end;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
 
-        d += uleb128_encode_small(dst + d, nzrun_len);
+        end = nzrun_end_avx2(old_buf, new_buf, i, slen);
+        d += uleb128_encode_small(dst + d, end - i);
         /* overflow */
-        if (d + nzrun_len > dlen) {
+        if (d + (end - i) > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
-        d += nzrun_len;
-        nzrun_len = 0;
+        memcpy(dst + d, new_buf + i, end - i);
+        d += end - i;
+        i = end;
     }
 
     return d;
 }
+#endif
+
+static const xbzrle_encode_fn encode_accel_table[] = {
+    xbzrle_encode_buffer_int,
+#if defined(CONFIG_AVX2_OPT)
+    xbzrle_encode_buffer_avx2,
+#endif
+#if defined(CONFIG_AVX512BW_OPT)
+    xbzrle_encode_buffer_avx512,
+#endif
+};
+
+static xbzrle_encode_fn encode_accel;
+static unsigned encode_accel_index;
+
+static unsigned best_encode_accel(void)
+{
+    unsigned i = ARRAY_SIZE(encode_accel_table) - 1;
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+    unsigned info = cpuinfo_init();
+
+#if defined(CONFIG_AVX512BW_OPT)
+    if (info & CPUINFO_AVX512BW) {
+        return i;
+    }
+    i--;
+#endif
+#if defined(CONFIG_AVX2_OPT)
+    if (info & CPUINFO_AVX2) {
+        return i;
+    }
+    i--;
+#endif
+#endif
+    return i;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    encode_accel_index = best_encode_accel();
+    encode_accel = encode_accel_table[encode_accel_index];
+}
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    if (encode_accel_index != 0) {
+        encode_accel = encode_accel_table[--encode_accel_index];
+        return true;
+    }
+    return false;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
+/*
+ * Most runs in a delta are only a few bytes long, and calling memcpy for
+ * them costs more than the copy itself.  When 16 bytes can be accessed on
+ * both sides, merge the run into the page with one vector load and store;
+ * the bytes past @count are written back unchanged.
+ */
+static inline void xbzrle_copy_run(uint8_t *dst, const uint8_t *src,
+                                   uint32_t count, int dspace, int sspace)
+{
+#if defined(__SSE2__)
+    if (count < 16 && dspace >= 16 && sspace >= 16) {
+        __m128i lane = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                     8, 9, 10, 11, 12, 13, 14, 15);
+        __m128i sel = _mm_cmpgt_epi8(_mm_set1_epi8(count), lane);
+        __m128i s = _mm_loadu_si128((const __m128i *)src);
+        __m128i d = _mm_loadu_si128((const __m128i *)dst);
+
+        d = _mm_or_si128(_mm_and_si128(sel, s), _mm_andnot_si128(sel, d));
+        _mm_storeu_si128((__m128i *)dst, d);
+        return;
+    }
+#elif defined(__ARM_NEON)
+    if (count < 16 && dspace >= 16 && sspace >= 16) {
+        static const uint8_t lanes[16] = {
+            0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+        };
+        uint8x16_t sel = vcltq_u8(vld1q_u8(lanes), vdupq_n_u8(count));
+
+        vst1q_u8(dst, vbslq_u8(sel, vld1q_u8(src), vld1q_u8(dst)));
+        return;
+    }
+#endif
+    memcpy(dst, src, count);
+}
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
@@ -314,7 +478,7 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
             return -1;
         }
 
-        memcpy(dst + d, src + i, count);
+        xbzrle_copy_run(dst + d, src + i, count, dlen - d, slen - i);
         d += count;
         i += count;
     }
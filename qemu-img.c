@@ -86,6 +86,7 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_THREADS = 278,
 };
 
 typedef enum OutputFormat {
@@ -207,6 +208,7 @@ void help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--threads' sets how many clusters are compressed in parallel\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1665,8 +1667,20 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+#define MAX_CONVERT_THREADS 32
+/* With --threads, two coroutines per thread keep the threads busy */
+#define MAX_CONVERT_COROUTINES \
+    MAX_CONST(MAX_COROUTINES, 2 * MAX_CONVERT_THREADS)
+/* Upper bound for the block status cache, 24 MB */
+#define MAX_CONVERT_EXTENTS (1024 * 1024)
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+typedef struct ImgConvertExtent {
+    int64_t start;
+    int64_t end;
+    enum ImgConvertBlockStatus status;
+} ImgConvertExtent;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1694,11 +1708,28 @@ typedef struct ImgConvertState {
     size_t cluster_sectors;
     size_t buf_sectors;
     long num_coroutines;
+    long num_threads;
     int running_coroutines;
-    Coroutine *co[MAX_COROUTINES];
-    int64_t wait_sector_num[MAX_COROUTINES];
+    Coroutine *co[MAX_CONVERT_COROUTINES];
+    int64_t wait_sector_num[MAX_CONVERT_COROUTINES];
+    bool wr_start_in_order;
     CoMutex lock;
     int ret;
+
+    /*
+     * Block status gathered while counting the allocated sectors, so that
+     * the copy does not have to query it again.  Only used with --threads.
+     */
+    GArray *extents;
+    bool extents_complete;
+    guint extent_idx;
+
+    /* Statistics printed with -p and --threads */
+    int64_t start_time;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t bytes_zeroed;
+    uint64_t bytes_skipped;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1713,6 +1744,43 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+/*
+ * Look up the block status of @sector_num in the extents recorded by the
+ * first pass.  Lookups are in increasing sector order, so the search
+ * resumes where the previous one stopped.
+ */
+static bool convert_lookup_extent(ImgConvertState *s, int64_t sector_num)
+{
+    ImgConvertExtent *e;
+
+    while (s->extent_idx < s->extents->len) {
+        e = &g_array_index(s->extents, ImgConvertExtent, s->extent_idx);
+        if (e->end > sector_num) {
+            if (e->start > sector_num) {
+                return false;
+            }
+            s->status = e->status;
+            s->sector_next_status = e->end;
+            return true;
+        }
+        s->extent_idx++;
+    }
+    return false;
+}
+
+static void convert_record_extent(ImgConvertState *s, int64_t sector_num)
+{
+    ImgConvertExtent e = {
+        .start = sector_num,
+        .end = s->sector_next_status,
+        .status = s->status,
+    };
+
+    if (s->extents->len < MAX_CONVERT_EXTENTS) {
+        g_array_append_val(s->extents, e);
+    }
+}
+
 static int coroutine_mixed_fn GRAPH_RDLOCK
 convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
@@ -1735,7 +1803,8 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
+    if (s->sector_next_status <= sector_num &&
+        !(s->extents_complete && convert_lookup_extent(s, sector_num))) {
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
         int tail;
@@ -1798,6 +1867,9 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         s->sector_next_status = sector_num + n;
+        if (s->extents && !s->extents_complete) {
+            convert_record_extent(s, sector_num);
+        }
     }
 
     n = MIN(n, s->sector_next_status - sector_num);
@@ -1890,6 +1962,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * unallocated in the source image, so that the backing file is
              * visible at the respective offset. */
             assert(s->target_has_backing);
+            s->bytes_skipped += n << BDRV_SECTOR_BITS;
             break;
 
         case BLK_DATA:
@@ -1911,6 +1984,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                 if (ret < 0) {
                     return ret;
                 }
+                s->bytes_written += n << BDRV_SECTOR_BITS;
                 break;
             }
             /* fall-through */
@@ -1918,6 +1992,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
         case BLK_ZERO:
             if (s->has_zero_init) {
                 assert(!s->target_has_backing);
+                s->bytes_skipped += n << BDRV_SECTOR_BITS;
                 break;
             }
             ret = blk_co_pwrite_zeroes(s->target,
@@ -1927,6 +2002,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
             if (ret < 0) {
                 return ret;
             }
+            s->bytes_zeroed += n << BDRV_SECTOR_BITS;
             break;
         }
 
@@ -1969,6 +2045,32 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Wake the coroutine whose write starts at s->wr_offs, if it is already
+ * waiting for its turn.
+ */
+static void coroutine_fn convert_co_wake_next(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            if (s->wr_start_in_order) {
+                /* Runs as soon as this coroutine yields in its write */
+                aio_co_wake(s->co[i]);
+            } else {
+                /*
+                 * A -> B -> A cannot occur because A has
+                 * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                 * B will never enter A during this time window.
+                 */
+                qemu_coroutine_enter(s->co[i]);
+            }
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -2031,6 +2133,8 @@ retry:
                 error_report("error while reading at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
                 s->ret = ret;
+            } else {
+                s->bytes_read += n << BDRV_SECTOR_BITS;
             }
         } else if (!s->min_sparse && status == BLK_ZERO) {
             status = BLK_DATA;
@@ -2044,6 +2148,16 @@ retry:
                 qemu_coroutine_yield();
             }
             s->wait_sector_num[index] = -1;
+
+            if (s->wr_start_in_order) {
+                /*
+                 * Only the start of the writes is ordered, so that the
+                 * target can compress the next cluster while this one is
+                 * still in flight.
+                 */
+                s->wr_offs = sector_num + n;
+                convert_co_wake_next(s);
+            }
         }
 
         if (s->ret == -EINPROGRESS) {
@@ -2065,21 +2179,11 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !s->wr_start_in_order) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
             s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_co_wake_next(s);
         }
     }
 
@@ -2115,6 +2219,18 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
+    if (s->num_threads) {
+        /*
+         * Compressed writes go one cluster at a time, so the target can
+         * only keep its threads busy if enough clusters are in flight.
+         */
+        if (s->compressed) {
+            s->num_coroutines = MAX(s->num_coroutines, 2 * s->num_threads);
+            s->wr_start_in_order = s->wr_in_order && !s->copy_range;
+        }
+        s->extents = g_array_new(false, false, sizeof(ImgConvertExtent));
+    }
+
     while (sector_num < s->total_sectors) {
         bdrv_graph_rdlock_main_loop();
         n = convert_iteration_sectors(s, sector_num);
@@ -2131,6 +2247,8 @@ static int convert_do_copy(ImgConvertState *s)
 
     /* Do the copy */
     s->sector_next_status = 0;
+    s->extents_complete = !!s->extents;
+    s->start_time = g_get_monotonic_time();
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
@@ -2155,6 +2273,22 @@ static int convert_do_copy(ImgConvertState *s)
     return s->ret;
 }
 
+static void convert_print_stats(ImgConvertState *s)
+{
+    double secs = MAX(g_get_monotonic_time() - s->start_time, 1) /
+                  (double)G_USEC_PER_SEC;
+    g_autofree char *read_size = size_to_str(s->bytes_read);
+    g_autofree char *write_size = size_to_str(s->bytes_written);
+    g_autofree char *zero_size = size_to_str(s->bytes_zeroed);
+    g_autofree char *skip_size = size_to_str(s->bytes_skipped);
+
+    printf("Read %s in %.2f s (%.2f MiB/s), %ld threads, %ld coroutines\n",
+           read_size, secs, s->bytes_read / secs / MiB, s->num_threads,
+           s->num_coroutines);
+    printf("Wrote %s, zeroed %s, skipped %s\n", write_size, zero_size,
+           skip_size);
+}
+
 /* Check that bitmaps can be copied, or output an error */
 static int convert_check_bitmaps(BlockDriverState *src, bool skip_broken)
 {
@@ -2275,6 +2409,7 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"threads", required_argument, 0, OPTION_THREADS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2409,6 +2544,15 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_THREADS:
+            if (qemu_strtol(optarg, NULL, 0, &s.num_threads) ||
+                s.num_threads < 1 || s.num_threads > MAX_CONVERT_THREADS) {
+                error_report("Invalid number of threads. Allowed number of"
+                             " threads is between 1 and %d",
+                             MAX_CONVERT_THREADS);
+                goto fail_getopt;
+            }
+            break;
         }
     }
 
@@ -2667,6 +2811,11 @@ static int img_convert(int argc, char **argv)
         open_opts = qdict_new();
         qemu_opt_foreach(opts, img_add_key_secrets, open_opts, &error_abort);
 
+        /* qcow2 compresses in a thread pool, let it use all threads */
+        if (s.num_threads && !strcmp(drv->format_name, "qcow2")) {
+            qdict_put_int(open_opts, "max-threads", s.num_threads);
+        }
+
         /* Create the new image */
         ret = bdrv_create(drv, out_filename, opts, &local_err);
         if (ret < 0) {
@@ -2795,6 +2944,12 @@ out:
         qemu_progress_print(100, 0);
     }
     qemu_progress_end();
+    if (!ret && progress && s.num_threads && s.start_time) {
+        convert_print_stats(&s);
+    }
+    if (s.extents) {
+        g_array_free(s.extents, true);
+    }
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
     qobject_unref(open_opts);
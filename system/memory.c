@@ -740,8 +740,29 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
-/* Render a memory topology into a list of disjoint absolute ranges. */
-static FlatView *generate_memory_topology(MemoryRegion *mr)
+static bool flatview_ranges_equal(const FlatView *a, const FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i]) ||
+            a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Render a memory topology into a list of disjoint absolute ranges.
+ * If @old_view, the previous rendering of @mr, is found to be identical,
+ * it is reused together with its dispatch tree.
+ */
+static FlatView *generate_memory_topology(MemoryRegion *mr,
+                                          FlatView *old_view)
 {
     int i;
     FlatView *view;
@@ -755,6 +776,14 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     }
     flatview_simplify(view);
 
+    if (old_view && flatview_ranges_equal(view, old_view)) {
+        /* Never published, so no need to wait for RCU.  */
+        flatview_destroy(view);
+        flatview_ref(old_view);
+        g_hash_table_replace(flat_views, mr, old_view);
+        return old_view;
+    }
+
     view->dispatch = address_space_dispatch_new(view);
     for (i = 0; i < view->nr; i++) {
         MemoryRegionSection mrs =
@@ -1044,7 +1073,7 @@ static void flatviews_init(void)
     flat_views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
                                        (GDestroyNotify) flatview_unref);
     if (!empty_view) {
-        empty_view = generate_memory_topology(NULL);
+        empty_view = generate_memory_topology(NULL, NULL);
         /* We keep it alive forever in the global variable.  */
         flatview_ref(empty_view);
     } else {
@@ -1053,26 +1082,34 @@ static void flatviews_init(void)
     }
 }
 
-static void flatviews_reset(void)
+/*
+ * Render unique FVs.  Returns true if any address space will
+ * see a different FlatView.
+ */
+static bool flatviews_reset(void)
 {
+    GHashTable *old_views = flat_views;
     AddressSpace *as;
+    bool changed = false;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *view = g_hash_table_lookup(flat_views, physmr);
 
-        if (g_hash_table_lookup(flat_views, physmr)) {
-            continue;
+        if (!view) {
+            view = generate_memory_topology(physmr, old_views ?
+                g_hash_table_lookup(old_views, physmr) : NULL);
         }
+        changed |= view != address_space_to_flatview(as);
+    }
 
-        generate_memory_topology(physmr);
+    if (old_views) {
+        g_hash_table_unref(old_views);
     }
+    return changed;
 }
 
 static void address_space_set_flatview(AddressSpace *as)
@@ -1084,6 +1121,13 @@ static void address_space_set_flatview(AddressSpace *as)
     assert(new_view);
 
     if (old_view == new_view) {
+        /*
+         * Nothing changed for this address space, but listeners still
+         * expect to see every range between begin and commit.
+         */
+        if (!QTAILQ_EMPTY(&as->listeners)) {
+            address_space_update_topology_pass(as, old_view, new_view, true);
+        }
         return;
     }
 
@@ -1126,7 +1170,7 @@ static void address_space_update_topology(AddressSpace *as)
 
     flatviews_init();
     if (!g_hash_table_lookup(flat_views, physmr)) {
-        generate_memory_topology(physmr);
+        generate_memory_topology(physmr, NULL);
     }
     address_space_set_flatview(as);
 }
@@ -1146,9 +1190,7 @@ void memory_region_transaction_commit(void)
 
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
-        if (memory_region_update_pending) {
-            flatviews_reset();
-
+        if (memory_region_update_pending && flatviews_reset()) {
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
@@ -1158,7 +1200,12 @@ void memory_region_transaction_commit(void)
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
-        } else if (ioeventfd_update_pending) {
+        } else if (memory_region_update_pending || ioeventfd_update_pending) {
+            /*
+             * Either only ioeventfds changed, or the topology was
+             * re-rendered into the very same FlatViews.
+             */
+            memory_region_update_pending = false;
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
             }
@@ -2540,6 +2587,16 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_enable_lockless_io(MemoryRegion *mr)
+{
+    mr->lockless_io = true;
+    /*
+     * The reentrancy guard is a plain flag in the owning device; concurrent
+     * lockless accesses would trip over each other's guard.
+     */
+    mr->disable_reentrancy_guard = true;
+}
+
 void memory_region_add_eventfd(MemoryRegion *mr,
                                hwaddr addr,
                                unsigned size,
@@ -136,8 +136,16 @@ typedef struct PhysPageMap {
     MemoryRegionSection *sections;
 } PhysPageMap;
 
+/*
+ * Number of recently used sections cached by each dispatch.  A vCPU
+ * typically alternates between RAM and one or two MMIO devices, which
+ * would keep evicting a single entry.
+ */
+#define DISPATCH_MRU_SIZE 4
+
 struct AddressSpaceDispatch {
-    MemoryRegionSection *mru_section;
+    MemoryRegionSection *mru_section[DISPATCH_MRU_SIZE];
+    unsigned mru_next;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -342,19 +350,56 @@ static MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr addr)
     }
 }
 
+static bool dispatch_is_mru(AddressSpaceDispatch *d,
+                            MemoryRegionSection *section)
+{
+    for (int i = 0; i < DISPATCH_MRU_SIZE; i++) {
+        if (qatomic_read(&d->mru_section[i]) == section) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Called from RCU critical section.  The MRU entries are updated without
+ * locking by several vCPUs; a lost update only costs a phys_page_find.
+ */
+static MemoryRegionSection *dispatch_mru_lookup(AddressSpaceDispatch *d,
+                                                hwaddr addr)
+{
+    MemoryRegionSection *section;
+    unsigned next;
+
+    for (int i = 0; i < DISPATCH_MRU_SIZE; i++) {
+        section = qatomic_read(&d->mru_section[i]);
+        if (section && section_covers_addr(section, addr)) {
+            return section;
+        }
+    }
+
+    /*
+     * The unassigned section covers every hole, so it would match far
+     * more than it should.  Don't let it take an entry either.
+     */
+    section = phys_page_find(d, addr);
+    if (section == &d->map.sections[PHYS_SECTION_UNASSIGNED]) {
+        return section;
+    }
+    next = qatomic_read(&d->mru_next);
+    qatomic_set(&d->mru_section[next], section);
+    qatomic_set(&d->mru_next, (next + 1) % DISPATCH_MRU_SIZE);
+    return section;
+}
+
 /* Called from RCU critical section */
 static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
 {
-    MemoryRegionSection *section = qatomic_read(&d->mru_section);
+    MemoryRegionSection *section = dispatch_mru_lookup(d, addr);
     subpage_t *subpage;
 
-    if (!section || section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
-        !section_covers_addr(section, addr)) {
-        section = phys_page_find(d, addr);
-        qatomic_set(&d->mru_section, section);
-    }
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
         section = &d->map.sections[subpage->sub_section[SUBPAGE_IDX(addr)]];
@@ -2773,6 +2818,15 @@ static void tcg_commit(MemoryListener *listener)
     cpuas = container_of(listener, CPUAddressSpace, tcg_as_listener);
     cpu = cpuas->cpu;
 
+    /*
+     * The memory API reuses the FlatView, and thus the dispatch, of an
+     * address space whose topology did not change; no flush is needed.
+     */
+    if (address_space_to_dispatch(cpuas->as) ==
+        qatomic_read(&cpuas->memory_dispatch)) {
+        return;
+    }
+
     /*
      * Defer changes to as->memory_dispatch until the cpu is quiescent.
      * Otherwise we race between (1) other cpu threads and (2) ongoing
@@ -2885,6 +2939,13 @@ bool prepare_mmio_access(MemoryRegion *mr)
 {
     bool release_lock = false;
 
+    /*
+     * Lockless regions run their callbacks without the BQL, unless coalesced
+     * MMIO has to be flushed first: that replays writes to arbitrary devices.
+     */
+    if (mr->lockless_io && !mr->flush_coalesced_mmio) {
+        return false;
+    }
     if (!bql_locked()) {
         bql_lock();
         release_lock = true;
@@ -3977,7 +4038,7 @@ void mtree_print_dispatch(AddressSpaceDispatch *d, MemoryRegion *root)
             s->mr->name ? s->mr->name : "(noname)",
             i < ARRAY_SIZE(names) ? names[i] : "",
             s->mr == root ? " [ROOT]" : "",
-            s == d->mru_section ? " [MRU]" : "",
+            dispatch_is_mru(d, s) ? " [MRU]" : "",
             s->mr->is_iommu ? " [iommu]" : "");
 
         if (s->mr->alias) {
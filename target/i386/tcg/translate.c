@@ -1358,6 +1358,7 @@ static void do_gen_rep(DisasContext *s, MemOp ot, TCGv dshift,
     TCGLabel *last = gen_new_label();
     TCGLabel *loop = gen_new_label();
     TCGLabel *done = gen_new_label();
+    TCGLabel *reenter = gen_new_label();
 
     target_ulong cx_mask = MAKE_64BIT_MASK(0, 8 << s->aflag);
     TCGv cx_next = tcg_temp_new();
@@ -1366,10 +1367,11 @@ static void do_gen_rep(DisasContext *s, MemOp ot, TCGv dshift,
      * Check if we must translate a single iteration only.  Normally, HF_RF_MASK
      * would also limit translation blocks to one instruction, so that gen_eob
      * can reset the flag; here however RF is set throughout the repetition, so
-     * we can plow through until CX/ECX/RCX is zero.
+     * we can plow through until CX/ECX/RCX is zero.  With icount, each further
+     * iteration is charged against the budget, see translator_icount_charge.
      */
     bool can_loop =
-        (!(tb_cflags(s->base.tb) & (CF_USE_ICOUNT | CF_SINGLE_STEP))
+        (!(tb_cflags(s->base.tb) & CF_SINGLE_STEP)
 	 && !(s->flags & (HF_TF_MASK | HF_INHIBIT_IRQ_MASK)));
     bool had_rf = s->flags & HF_RF_MASK;
 
@@ -1430,6 +1432,7 @@ static void do_gen_rep(DisasContext *s, MemOp ot, TCGv dshift,
     }
 
     if (can_loop) {
+        translator_icount_charge(&s->base, reenter);
         tcg_gen_subi_tl(cx_next, cx_next, 1);
         tcg_gen_brcondi_tl(TCG_COND_TSTNE, cx_next, REP_MAX, loop);
         tcg_gen_brcondi_tl(TCG_COND_TSTEQ, cx_next, cx_mask, last);
@@ -1440,6 +1443,7 @@ static void do_gen_rep(DisasContext *s, MemOp ot, TCGv dshift,
      * but the last.  Set it here before giving the main loop a chance to
      * execute.  (For faults, seg_helper.c sets the flag as usual).
      */
+    gen_set_label(reenter);
     if (!had_rf) {
         gen_set_eflags(s, RF_MASK);
     }
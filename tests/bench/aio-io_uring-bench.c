@@ -0,0 +1,280 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * AioContext io_uring disk I/O benchmark
+ *
+ * Issues random 4 KiB reads through luring_co_submit(), once with the
+ * requests sharing the io_uring that the AioContext uses for file
+ * descriptor monitoring and once with the dedicated per-AioContext ring
+ * that is used when the event loop does not run on io_uring.  For each
+ * queue depth it reports IOPS, latency percentiles, event loop iterations
+ * per I/O, the CPU time of the thread per I/O and, if the
+ * raw_syscalls:sys_enter tracepoint can be counted (perf_event_paranoid -1
+ * or CAP_PERFMON), system calls per I/O.
+ *
+ * The file is not registered with the rings in the first two runs, like
+ * the files that file-posix opens with aio=io_uring and without
+ * x-io-uring-fixed-buffers.  A third run registers the file and the read
+ * buffers, like x-io-uring-fixed-buffers does with guest RAM, so that the
+ * CPU cost of an I/O with and without registration can be compared.  The
+ * CPU time does not include io-wq kernel workers, which serve buffered
+ * reads that miss the page cache.
+ *
+ * The file is read from the page cache unless QEMU_BENCH_FILE names a file
+ * or block device to read from instead.
+ */
+#include "qemu/osdep.h"
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "block/aio.h"
+#include "block/raw-aio.h"
+
+#define BENCH_FILE_SIZE (64 * MiB)
+#define BENCH_BLOCK_SIZE (4 * KiB)
+#define BENCH_SECONDS 2
+
+static const unsigned bench_queue_depths[] = { 1, 8, 32 };
+
+typedef struct {
+    int fd;
+    uint8_t *bufs;
+    unsigned next_buf;
+    BdrvRequestFlags flags;
+    uint64_t nb_blocks;
+    unsigned running;
+    int64_t deadline;
+    GArray *latencies;
+} BenchState;
+
+static AioContext *ctx;
+static int bench_fd = -1;
+static uint64_t bench_size;
+
+static int syscall_counter_open(void)
+{
+    static const char *const paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_TRACEPOINT,
+        .size = sizeof(attr),
+        .disabled = 1,
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(paths); i++) {
+        g_autofree char *id = NULL;
+
+        if (g_file_get_contents(paths[i], &id, NULL, NULL)) {
+            attr.config = g_ascii_strtoull(id, NULL, 10);
+            /* Count the system calls of this thread only */
+            return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+    return -1;
+}
+
+static void coroutine_fn bench_co(void *opaque)
+{
+    BenchState *b = opaque;
+    void *buf = b->bufs + b->next_buf++ * BENCH_BLOCK_SIZE;
+    QEMUIOVector qiov;
+
+    qemu_iovec_init_buf(&qiov, buf, BENCH_BLOCK_SIZE);
+
+    while (get_clock() < b->deadline) {
+        uint64_t block = g_random_int_range(0, MIN(b->nb_blocks, INT32_MAX));
+        uint64_t offset = block * BENCH_BLOCK_SIZE;
+        int64_t start = get_clock();
+        int64_t latency;
+        int ret;
+
+        ret = luring_co_submit(NULL, b->fd, offset, &qiov, QEMU_AIO_READ,
+                               b->flags);
+        g_assert_cmpint(ret, ==, 0);
+
+        latency = get_clock() - start;
+        g_array_append_val(b->latencies, latency);
+    }
+
+    b->running--;
+}
+
+static int64_t percentile(GArray *latencies, double p)
+{
+    unsigned idx = MIN(latencies->len * p, latencies->len - 1);
+
+    return g_array_index(latencies, int64_t, idx);
+}
+
+static gint compare_int64(gconstpointer a, gconstpointer b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int64_t thread_cpu_time_us(void)
+{
+    struct rusage ru;
+
+    g_assert(getrusage(RUSAGE_THREAD, &ru) == 0);
+    return ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec +
+           ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+}
+
+static void bench_run(const char *mode, unsigned qd, BdrvRequestFlags flags)
+{
+    size_t bufs_size = qd * BENCH_BLOCK_SIZE;
+    BenchState b = {
+        .fd = bench_fd,
+        .bufs = qemu_memalign(qemu_real_host_page_size(), bufs_size),
+        .flags = flags,
+        .nb_blocks = bench_size / BENCH_BLOCK_SIZE,
+        .running = qd,
+        .deadline = get_clock() + BENCH_SECONDS * NANOSECONDS_PER_SECOND,
+        .latencies = g_array_new(false, false, sizeof(int64_t)),
+    };
+    int counter = syscall_counter_open();
+    uint64_t syscalls = 0;
+    uint64_t iterations = 0;
+    int64_t cpu_us;
+    double ios;
+
+    if (flags & BDRV_REQ_REGISTERED_BUF) {
+        luring_register_buf(b.bufs, bufs_size);
+    }
+
+    cpu_us = thread_cpu_time_us();
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    for (unsigned i = 0; i < qd; i++) {
+        aio_co_enter(ctx, qemu_coroutine_create(bench_co, &b));
+    }
+    while (b.running) {
+        aio_poll(ctx, true);
+        iterations++;
+    }
+
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &syscalls, sizeof(syscalls)) != sizeof(syscalls)) {
+            syscalls = 0;
+        }
+        close(counter);
+    }
+    cpu_us = thread_cpu_time_us() - cpu_us;
+
+    if (flags & BDRV_REQ_REGISTERED_BUF) {
+        luring_unregister_buf(b.bufs, bufs_size);
+    }
+    qemu_vfree(b.bufs);
+
+    g_assert_cmpuint(b.latencies->len, >, 0);
+    g_array_sort(b.latencies, compare_int64);
+    ios = b.latencies->len;
+
+    g_test_message("%s qd %2u: %8.0f IOPS, latency p50 %6" PRId64
+                   " p99 %6" PRId64 " p99.9 %6" PRId64 " ns, "
+                   "%.2f loop iterations/IO, %.2f us CPU/IO",
+                   mode, qd, ios / BENCH_SECONDS,
+                   percentile(b.latencies, 0.5),
+                   percentile(b.latencies, 0.99),
+                   percentile(b.latencies, 0.999),
+                   iterations / ios, cpu_us / ios);
+    if (syscalls) {
+        g_test_message("%s qd %2u: %.2f syscalls/IO", mode, qd,
+                       syscalls / ios);
+    }
+
+    g_array_free(b.latencies, true);
+}
+
+static void test_unified(void)
+{
+    if (!aio_has_io_uring(ctx)) {
+        g_test_skip("AioContext does not use io_uring");
+        return;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(bench_queue_depths); i++) {
+        bench_run("unified ", bench_queue_depths[i], 0);
+    }
+}
+
+static void test_separate(void)
+{
+    /* Switch the event loop to ppoll(2)/epoll(7), this cannot be undone */
+    aio_context_use_g_source(ctx);
+    g_assert(!aio_has_io_uring(ctx));
+
+    for (int i = 0; i < ARRAY_SIZE(bench_queue_depths); i++) {
+        bench_run("separate", bench_queue_depths[i], 0);
+    }
+}
+
+static void test_fixed(void)
+{
+    /* Registered files and buffers always use the dedicated ring */
+    luring_register_file(bench_fd);
+
+    for (int i = 0; i < ARRAY_SIZE(bench_queue_depths); i++) {
+        bench_run("fixed   ", bench_queue_depths[i], BDRV_REQ_REGISTERED_BUF);
+    }
+
+    luring_unregister_file(bench_fd);
+}
+
+static void bench_open(void)
+{
+    const char *path = g_getenv("QEMU_BENCH_FILE");
+    g_autofree char *tmp = NULL;
+    g_autofree void *buf = NULL;
+
+    if (path) {
+        bench_fd = qemu_open_old(path, O_RDONLY | O_DIRECT);
+        g_assert(bench_fd >= 0);
+        bench_size = lseek(bench_fd, 0, SEEK_END);
+        g_assert(bench_size >= BENCH_BLOCK_SIZE);
+        return;
+    }
+
+    bench_fd = g_file_open_tmp("aio-io_uring-bench-XXXXXX", &tmp, NULL);
+    g_assert(bench_fd >= 0);
+    unlink(tmp);
+
+    /* Real data rather than holes, so that reads copy pages */
+    buf = g_malloc(BENCH_FILE_SIZE);
+    memset(buf, 0xa5, BENCH_FILE_SIZE);
+    g_assert(pwrite(bench_fd, buf, BENCH_FILE_SIZE, 0) == BENCH_FILE_SIZE);
+    bench_size = BENCH_FILE_SIZE;
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    ctx = aio_context_new(&error_abort);
+    qemu_set_current_aio_context(ctx);
+    aio_setup_linux_io_uring(ctx, &error_abort);
+    bench_open();
+
+    g_test_add_func("/aio/io_uring/unified", test_unified);
+    g_test_add_func("/aio/io_uring/separate", test_separate);
+    g_test_add_func("/aio/io_uring/fixed", test_fixed);
+    ret = g_test_run();
+
+    close(bench_fd);
+    aio_context_unref(ctx);
+    return ret;
+}
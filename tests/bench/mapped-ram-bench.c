@@ -0,0 +1,129 @@
+/*
+ * mapped-ram page write speed benchmark
+ *
+ * Writes dirty pages to a file at their fixed mapped-ram offsets, once
+ * with one positional write per page and once gathering contiguous
+ * pages into runs of up to 1 MiB, as ram.c does without multifd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "io/channel-file.h"
+#include "../migration/qemu-file.h"
+
+#define PAGE_SIZE 4096
+#define RAM_SIZE (256 * MiB)
+#define NR_PAGES (RAM_SIZE / PAGE_SIZE)
+#define RUN_SIZE MiB
+
+typedef struct {
+    const char *name;
+    /* Length in pages of each dirty run and of the clean gap after it */
+    int dirty;
+    int clean;
+} DirtyPattern;
+
+static const DirtyPattern patterns[] = {
+    { "all pages", 1, 0 },
+    { "runs of 64 pages", 64, 64 },
+    { "runs of 4 pages", 4, 4 },
+    { "every other page", 1, 1 },
+};
+
+static uint8_t *ram;
+
+static bool page_dirty(const DirtyPattern *p, unsigned long page)
+{
+    return page % (p->dirty + p->clean) < p->dirty;
+}
+
+static void write_pages(QEMUFile *f, const DirtyPattern *p, bool coalesce)
+{
+    unsigned long page, run_start = 0, run_len = 0;
+
+    for (page = 0; page < NR_PAGES; page++) {
+        off_t offset = page * PAGE_SIZE;
+
+        if (!page_dirty(p, page)) {
+            continue;
+        }
+        if (!coalesce) {
+            qemu_put_buffer_at(f, ram + offset, PAGE_SIZE, offset);
+            continue;
+        }
+        if (run_len && (run_start + run_len != offset ||
+                        run_len >= RUN_SIZE)) {
+            qemu_put_buffer_at(f, ram + run_start, run_len, run_start);
+            run_len = 0;
+        }
+        if (!run_len) {
+            run_start = offset;
+        }
+        run_len += PAGE_SIZE;
+    }
+    if (run_len) {
+        qemu_put_buffer_at(f, ram + run_start, run_len, run_start);
+    }
+}
+
+static void test_write(const void *opaque)
+{
+    const DirtyPattern *p = opaque;
+    g_autofree char *path = g_build_filename(g_get_tmp_dir(),
+                                             "mapped-ram-bench.XXXXXX", NULL);
+    uint64_t bytes = 0;
+    unsigned long page;
+    int coalesce;
+    int fd;
+
+    fd = g_mkstemp(path);
+    g_assert(fd >= 0);
+    close(fd);
+
+    for (page = 0; page < NR_PAGES; page++) {
+        bytes += page_dirty(p, page) ? PAGE_SIZE : 0;
+    }
+
+    for (coalesce = 0; coalesce < 2; coalesce++) {
+        QIOChannelFile *ioc;
+        QEMUFile *f;
+
+        ioc = qio_channel_file_new_path(path, O_WRONLY | O_TRUNC, 0,
+                                        &error_abort);
+        f = qemu_file_new_output(QIO_CHANNEL(ioc));
+        object_unref(OBJECT(ioc));
+
+        g_test_timer_start();
+        write_pages(f, p, coalesce);
+        g_assert_cmpint(qemu_fclose(f), ==, 0);
+        g_test_timer_elapsed();
+
+        g_test_message("%-16s %-10s %6.2f GB/s", p->name,
+                       coalesce ? "coalesced" : "per page",
+                       bytes / g_test_timer_last() / GiB);
+    }
+
+    unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    ram = g_malloc(RAM_SIZE);
+    memset(ram, 0x5a, RAM_SIZE);
+
+    for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+        g_autofree char *path = g_strdup_printf("/mapped-ram/write/%d", i);
+
+        g_test_add_data_func(path, &patterns[i], test_write);
+    }
+
+    i = g_test_run();
+    g_free(ram);
+    return i;
+}
@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * qcow2 cluster allocation benchmark
+ *
+ * Issues allocating 4 KiB writes to a fresh qcow2 image from 1, 2, 4 and
+ * 8 iothreads sharing one BlockBackend.  Every write touches a cluster
+ * that was not allocated yet, so the cluster allocation and refcount
+ * updates dominate.  Each iothread writes to its own part of the image.
+ * The runs are repeated with alloc-chunk-size set, so that the IOPS
+ * of per-request allocation and of per-iothread chunks can be compared.
+ *
+ * The image is created in the temporary directory unless QEMU_BENCH_DIR
+ * names a directory to create it in.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qobject/qdict.h"
+#include "qemu/coroutine.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "block/aio-wait.h"
+#include "block/block.h"
+#include "system/block-backend.h"
+#include "../unit/iothread.h"
+
+#define BENCH_CLUSTER_SIZE (64 * KiB)
+#define BENCH_CLUSTERS 32768
+#define BENCH_WRITE_SIZE (4 * KiB)
+#define BENCH_QUEUE_DEPTH 16
+#define BENCH_MAX_IOTHREADS 8
+
+static const unsigned bench_iothreads[] = { 1, 2, 4, 8 };
+static const char *const bench_chunk_sizes[] = { "0", "16M" };
+
+typedef struct {
+    BlockBackend *blk;
+    uint64_t next;
+    uint64_t end;
+    unsigned running;
+    int ret;
+} BenchQueue;
+
+typedef struct {
+    const char *chunk_size;
+    unsigned nb_iothreads;
+} BenchParams;
+
+static unsigned bench_running;
+static void *bench_buf;
+
+static void coroutine_fn bench_co(void *opaque)
+{
+    BenchQueue *q = opaque;
+
+    while (q->next < q->end && !q->ret) {
+        int64_t offset = q->next * BENCH_CLUSTER_SIZE;
+        int ret;
+
+        q->next++;
+        ret = blk_co_pwrite(q->blk, offset, BENCH_WRITE_SIZE, bench_buf, 0);
+        if (ret < 0) {
+            q->ret = ret;
+        }
+    }
+
+    if (--q->running == 0) {
+        qatomic_dec(&bench_running);
+        aio_wait_kick();
+    }
+}
+
+static void bench_start_bh(void *opaque)
+{
+    BenchQueue *q = opaque;
+    int i;
+
+    q->running = BENCH_QUEUE_DEPTH;
+    for (i = 0; i < BENCH_QUEUE_DEPTH; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(bench_co, q));
+    }
+}
+
+static BlockBackend *bench_open(const char *filename, const char *chunk_size)
+{
+    QDict *options = qdict_new();
+    BlockBackend *blk;
+
+    qdict_put_str(options, "driver", "qcow2");
+    qdict_put_str(options, "file.filename", filename);
+    qdict_put_str(options, "alloc-chunk-size", chunk_size);
+
+    blk = blk_new_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+    blk_set_disable_request_queuing(blk, true);
+    return blk;
+}
+
+static void test_alloc(const void *opaque)
+{
+    const BenchParams *p = opaque;
+    g_autofree char *filename = NULL;
+    const char *dir = g_getenv("QEMU_BENCH_DIR");
+    IOThread *iothreads[BENCH_MAX_IOTHREADS];
+    BenchQueue queues[BENCH_MAX_IOTHREADS];
+    uint64_t per_queue = BENCH_CLUSTERS / p->nb_iothreads;
+    BlockBackend *blk;
+    int64_t start, ns;
+    unsigned i;
+    int fd;
+
+    g_assert(p->nb_iothreads <= BENCH_MAX_IOTHREADS);
+
+    filename = g_build_filename(dir ? dir : g_get_tmp_dir(),
+                                "qcow2-alloc-bench-XXXXXX", NULL);
+    fd = g_mkstemp(filename);
+    g_assert(fd >= 0);
+    close(fd);
+
+    bdrv_img_create(filename, "qcow2", NULL, NULL,
+                    (char *)"cluster_size=65536",
+                    (uint64_t)BENCH_CLUSTERS * BENCH_CLUSTER_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
+    blk = bench_open(filename, p->chunk_size);
+
+    for (i = 0; i < p->nb_iothreads; i++) {
+        iothreads[i] = iothread_new();
+        queues[i] = (BenchQueue) {
+            .blk = blk,
+            .next = i * per_queue,
+            .end = (i + 1) * per_queue,
+        };
+    }
+
+    bench_running = p->nb_iothreads;
+    start = get_clock();
+    for (i = 0; i < p->nb_iothreads; i++) {
+        aio_bh_schedule_oneshot(iothread_get_aio_context(iothreads[i]),
+                                bench_start_bh, &queues[i]);
+    }
+    AIO_WAIT_WHILE_UNLOCKED(NULL, qatomic_read(&bench_running));
+    ns = get_clock() - start;
+
+    for (i = 0; i < p->nb_iothreads; i++) {
+        g_assert_cmpint(queues[i].ret, ==, 0);
+        iothread_join(iothreads[i]);
+    }
+
+    g_test_message("alloc-chunk-size %-3s %u iothread(s): %8.0f IOPS",
+                   p->chunk_size, p->nb_iothreads,
+                   (double)per_queue * p->nb_iothreads *
+                   NANOSECONDS_PER_SECOND / ns);
+
+    blk_unref(blk);
+    unlink(filename);
+}
+
+int main(int argc, char **argv)
+{
+    BenchParams *params;
+    int i, j;
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+    g_test_init(&argc, &argv, NULL);
+
+    bench_buf = qemu_memalign(BENCH_WRITE_SIZE, BENCH_WRITE_SIZE);
+    memset(bench_buf, 0xa5, BENCH_WRITE_SIZE);
+
+    params = g_new(BenchParams, ARRAY_SIZE(bench_chunk_sizes) *
+                                ARRAY_SIZE(bench_iothreads));
+    for (i = 0; i < ARRAY_SIZE(bench_chunk_sizes); i++) {
+        for (j = 0; j < ARRAY_SIZE(bench_iothreads); j++) {
+            BenchParams *p = &params[i * ARRAY_SIZE(bench_iothreads) + j];
+            g_autofree char *path = NULL;
+
+            p->chunk_size = bench_chunk_sizes[i];
+            p->nb_iothreads = bench_iothreads[j];
+            path = g_strdup_printf("/qcow2/alloc/chunk-%s/iothreads-%u",
+                                   p->chunk_size, p->nb_iothreads);
+            g_test_add_data_func(path, p, test_alloc);
+        }
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,130 @@
+/*
+ * XBZRLE encode/decode speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define NR_PAGES 256
+
+/* Scatter runs of changed bytes over @pct percent of each page */
+static void make_pages(uint8_t *old_pages, uint8_t *new_pages, int pct)
+{
+    int i, j;
+
+    for (i = 0; i < NR_PAGES * PAGE_SIZE; i++) {
+        old_pages[i] = g_test_rand_int();
+    }
+    memcpy(new_pages, old_pages, NR_PAGES * PAGE_SIZE);
+
+    for (i = 0; i < NR_PAGES; i++) {
+        uint8_t *page = new_pages + i * PAGE_SIZE;
+
+        for (j = 0; j < PAGE_SIZE * pct / 100; j += 16) {
+            int off = g_test_rand_int_range(0, PAGE_SIZE - 16);
+            int len = g_test_rand_int_range(1, 16);
+
+            memset(page + off, ~page[off], len);
+        }
+    }
+}
+
+static const int pcts[] = { 1, 10, 50 };
+
+static void test_encode(const void *opaque)
+{
+    uint8_t *old_pages[ARRAY_SIZE(pcts)], *new_pages[ARRAY_SIZE(pcts)];
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    int accel_index = 0;
+    int p;
+
+    for (p = 0; p < ARRAY_SIZE(pcts); p++) {
+        old_pages[p] = g_malloc(NR_PAGES * PAGE_SIZE);
+        new_pages[p] = g_malloc(NR_PAGES * PAGE_SIZE);
+        make_pages(old_pages[p], new_pages[p], pcts[p]);
+    }
+
+    do {
+        if (accel_index != 0) {
+            g_test_message("%s", "");  /* gnu_printf Werror for simple "" */
+        }
+        for (p = 0; p < ARRAY_SIZE(pcts); p++) {
+            double total = 0.0;
+
+            g_test_timer_start();
+            do {
+                for (int i = 0; i < NR_PAGES; i++) {
+                    xbzrle_encode_buffer(old_pages[p] + i * PAGE_SIZE,
+                                         new_pages[p] + i * PAGE_SIZE,
+                                         PAGE_SIZE, dst, PAGE_SIZE);
+                }
+                total += NR_PAGES * PAGE_SIZE;
+            } while (g_test_timer_elapsed() < 0.5);
+
+            g_test_message("xbzrle_encode_buffer #%d: %2d%% changed "
+                           "%8.0f MB/sec", accel_index, pcts[p],
+                           total / MiB / g_test_timer_last());
+        }
+        accel_index++;
+    } while (test_xbzrle_encode_next_accel());
+
+    for (p = 0; p < ARRAY_SIZE(pcts); p++) {
+        g_free(old_pages[p]);
+        g_free(new_pages[p]);
+    }
+    g_free(dst);
+}
+
+static void test_decode(const void *opaque)
+{
+    int pct = GPOINTER_TO_INT(opaque);
+    uint8_t *old_pages = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *new_pages = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *enc = g_malloc(NR_PAGES * PAGE_SIZE);
+    int enc_len[NR_PAGES];
+    double total = 0.0;
+
+    make_pages(old_pages, new_pages, pct);
+    for (int i = 0; i < NR_PAGES; i++) {
+        enc_len[i] = xbzrle_encode_buffer(old_pages + i * PAGE_SIZE,
+                                          new_pages + i * PAGE_SIZE,
+                                          PAGE_SIZE, enc + i * PAGE_SIZE,
+                                          PAGE_SIZE);
+    }
+
+    g_test_timer_start();
+    do {
+        for (int i = 0; i < NR_PAGES; i++) {
+            if (enc_len[i] > 0) {
+                xbzrle_decode_buffer(enc + i * PAGE_SIZE, enc_len[i],
+                                     old_pages + i * PAGE_SIZE, PAGE_SIZE);
+            }
+        }
+        total += NR_PAGES * PAGE_SIZE;
+    } while (g_test_timer_elapsed() < 0.5);
+
+    g_test_message("xbzrle_decode_buffer: %2d%% changed %8.0f MB/sec",
+                   pct, total / MiB / g_test_timer_last());
+
+    g_free(old_pages);
+    g_free(new_pages);
+    g_free(enc);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    for (int i = 0; i < ARRAY_SIZE(pcts); i++) {
+        g_autofree char *path = g_strdup_printf("/xbzrle/decode/%d", pcts[i]);
+
+        g_test_add_data_func(path, GINT_TO_POINTER(pcts[i]), test_decode);
+    }
+    /* Last, as it steps through to the slowest implementation */
+    g_test_add_data_func("/xbzrle/encode", NULL, test_encode);
+    return g_test_run();
+}
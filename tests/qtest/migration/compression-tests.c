@@ -16,6 +16,7 @@
 #include "migration/migration-qmp.h"
 #include "migration/migration-util.h"
 #include "qemu/module.h"
+#include "qobject/qdict.h"
 
 
 static char *tmpfs;
@@ -56,6 +57,53 @@ static void test_multifd_postcopy_tcp_zstd(void)
 
     test_precopy_common(&args);
 }
+
+/*
+ * Start at the slowest level the controller allows, so that the busy
+ * compression threads make it lower the level while pages are sent.
+ */
+static void *
+migrate_hook_start_precopy_tcp_multifd_zstd_adaptive(QTestState *from,
+                                                     QTestState *to)
+{
+    migrate_set_parameter_int(from, "multifd-zstd-level", 19);
+    migrate_set_parameter_int(to, "multifd-zstd-level", 19);
+
+    return migrate_hook_start_precopy_tcp_multifd_common(from, to, "zstd");
+}
+
+static void
+migrate_hook_end_precopy_tcp_multifd_zstd_adaptive(QTestState *from,
+                                                   QTestState *to,
+                                                   void *opaque)
+{
+    QDict *rsp = migrate_query(from);
+    QDict *stats = qdict_get_qdict(rsp, "multifd-compression");
+    int64_t level;
+
+    g_assert(stats);
+    level = qdict_get_int(stats, "level");
+    g_assert_cmpint(level, >=, 1);
+    g_assert_cmpint(level, <=, 19);
+    g_test_message("adaptive zstd: level %" PRId64 ", %" PRId64
+                   " adjustments", level,
+                   qdict_get_int(stats, "adjustments"));
+    qobject_unref(rsp);
+}
+
+static void test_multifd_tcp_zstd_adaptive(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+            .caps[MIGRATION_CAPABILITY_X_MULTIFD_ADAPTIVE_COMPRESSION] = true,
+        },
+        .start_hook = migrate_hook_start_precopy_tcp_multifd_zstd_adaptive,
+        .end_hook = migrate_hook_end_precopy_tcp_multifd_zstd_adaptive,
+    };
+    test_precopy_common(&args);
+}
 #endif /* CONFIG_ZSTD */
 
 #ifdef CONFIG_QATZIP
@@ -198,6 +246,8 @@ void migration_test_add_compression(MigrationTestEnv *env)
 #ifdef CONFIG_ZSTD
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
+    migration_test_add("/migration/multifd/tcp/plain/zstd/adaptive",
+                       test_multifd_tcp_zstd_adaptive);
     if (env->has_uffd) {
         migration_test_add("/migration/multifd+postcopy/tcp/plain/zstd",
                            test_multifd_postcopy_tcp_zstd);
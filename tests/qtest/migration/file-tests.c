@@ -137,6 +137,83 @@ static void test_precopy_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
+/*
+ * Without multifd, mapped-ram gathers contiguous dirty pages into runs
+ * of up to 1 MiB.  Lay out RAM so that runs cross that limit, are broken
+ * by zero pages and end at the end of the RAM block, then check every
+ * page on the destination.
+ */
+#define RUNS_RAM_SIZE   (8 * 1024 * 1024)
+#define RUNS_PAGE_SIZE  4096
+
+static const struct {
+    uint64_t start;
+    uint64_t len;
+} mapped_ram_runs[] = {
+    { 0, 3 * 1024 * 1024 + RUNS_PAGE_SIZE },
+    { 4 * 1024 * 1024, RUNS_PAGE_SIZE },
+    { 4 * 1024 * 1024 + 2 * RUNS_PAGE_SIZE, 3 * RUNS_PAGE_SIZE },
+    { RUNS_RAM_SIZE - 16 * RUNS_PAGE_SIZE, 16 * RUNS_PAGE_SIZE },
+};
+
+static uint8_t mapped_ram_runs_byte(uint64_t addr)
+{
+    uint64_t page = addr / RUNS_PAGE_SIZE;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(mapped_ram_runs); i++) {
+        if (addr >= mapped_ram_runs[i].start &&
+            addr < mapped_ram_runs[i].start + mapped_ram_runs[i].len) {
+            return page % 255 + 1;
+        }
+    }
+    return 0;
+}
+
+static void test_precopy_file_mapped_ram_runs(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    g_autofree uint8_t *buf = g_malloc(RUNS_PAGE_SIZE);
+    QTestState *from, *to;
+    uint64_t addr;
+    int i;
+
+    from = qtest_initf("-machine none -m %dM", RUNS_RAM_SIZE >> 20);
+    to = qtest_initf("-machine none -m %dM -incoming defer",
+                     RUNS_RAM_SIZE >> 20);
+
+    for (addr = 0; addr < RUNS_RAM_SIZE; addr += RUNS_PAGE_SIZE) {
+        uint8_t val = mapped_ram_runs_byte(addr);
+
+        if (val) {
+            qtest_memset(from, addr, val, RUNS_PAGE_SIZE);
+        }
+    }
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+
+    qtest_qmp_assert_success(from, "{ 'execute': 'stop' }");
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_complete(from);
+
+    migrate_incoming_qmp(to, uri, NULL, "{}");
+    wait_for_migration_complete(to);
+
+    for (addr = 0; addr < RUNS_RAM_SIZE; addr += RUNS_PAGE_SIZE) {
+        uint8_t val = mapped_ram_runs_byte(addr);
+
+        qtest_memread(to, addr, buf, RUNS_PAGE_SIZE);
+        for (i = 0; i < RUNS_PAGE_SIZE; i++) {
+            g_assert_cmphex(buf[i], ==, val);
+        }
+    }
+
+    qtest_quit(from);
+    qtest_quit(to);
+}
+
 static void test_multifd_file_mapped_ram_live(void)
 {
     g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
@@ -326,6 +403,8 @@ void migration_test_add_file(MigrationTestEnv *env)
                        test_precopy_file_mapped_ram);
     migration_test_add("/migration/precopy/file/mapped-ram/live",
                        test_precopy_file_mapped_ram_live);
+    migration_test_add("/migration/precopy/file/mapped-ram/runs",
+                       test_precopy_file_mapped_ram_runs);
 
     migration_test_add("/migration/multifd/file/mapped-ram",
                        test_multifd_file_mapped_ram);
@@ -47,6 +47,35 @@ static void test_postcopy_preempt(void)
     test_postcopy_common(&args);
 }
 
+static void *migrate_hook_start_postcopy_prefetch(QTestState *from,
+                                                  QTestState *to)
+{
+    migrate_set_parameter_int(to, "x-postcopy-prefetch-depth", 16);
+    return NULL;
+}
+
+static void test_postcopy_prefetch(void)
+{
+    MigrateCommon args = {
+        .start_hook = migrate_hook_start_postcopy_prefetch,
+    };
+
+    test_postcopy_common(&args);
+}
+
+/* Prefetching is disabled, demand faults must still be served first */
+static void test_postcopy_preempt_prefetch(void)
+{
+    MigrateCommon args = {
+        .start = {
+            .caps[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT] = true,
+        },
+        .start_hook = migrate_hook_start_postcopy_prefetch,
+    };
+
+    test_postcopy_common(&args);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateCommon args = { };
@@ -129,6 +158,11 @@ void migration_test_add_postcopy(MigrationTestEnv *env)
         migration_test_add("/migration/postcopy/preempt/recovery/plain",
                            test_postcopy_preempt_recovery);
 
+        migration_test_add("/migration/postcopy/prefetch",
+                           test_postcopy_prefetch);
+        migration_test_add("/migration/postcopy/preempt/prefetch",
+                           test_postcopy_preempt_prefetch);
+
         migration_test_add(
             "/migration/postcopy/recovery/double-failures/handshake",
             test_postcopy_recovery_fail_handshake);
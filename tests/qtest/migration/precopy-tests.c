@@ -540,6 +540,33 @@ static void test_multifd_tcp_no_zero_page(void)
     test_precopy_common(&args);
 }
 
+static void
+migrate_hook_end_precopy_tcp_multifd_dedup(QTestState *from,
+                                           QTestState *to,
+                                           void *opaque)
+{
+    /*
+     * The guest writes the same byte at the start of every page, so
+     * each pass makes identical pages that dedup must have caught.
+     */
+    g_assert_cmpint(read_ram_property_int(from, "dedup-bytes"), >, 0);
+}
+
+static void test_multifd_tcp_dedup(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = migrate_hook_start_precopy_tcp_multifd,
+        .end_hook = migrate_hook_end_precopy_tcp_multifd_dedup,
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+            .caps[MIGRATION_CAPABILITY_X_MULTIFD_DEDUP] = true,
+        },
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_channels_none(void)
 {
     MigrateCommon args = {
@@ -1300,6 +1327,8 @@ void migration_test_add_precopy(MigrationTestEnv *env)
     }
     migration_test_add("/migration/multifd/tcp/channels/plain/none",
                        test_multifd_tcp_channels_none);
+    migration_test_add("/migration/multifd/tcp/plain/dedup",
+                       test_multifd_tcp_dedup);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/legacy",
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
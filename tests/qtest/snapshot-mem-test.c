@@ -0,0 +1,148 @@
+/*
+ * QTest testcase for in-memory VM snapshots
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "libqtest.h"
+#include "qobject/qdict.h"
+
+#define TEST_BASE       (16 * MiB)
+#define TEST_PAGES      64
+#define PAGE_SIZE       4096
+
+static QTestState *snapshot_mem_start(void)
+{
+    return qtest_init("-machine pc -m 128M");
+}
+
+static void fill_pages(QTestState *qts, uint64_t base, int nr, uint8_t seed)
+{
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        qtest_memset(qts, base + i * PAGE_SIZE, seed + i, PAGE_SIZE);
+    }
+}
+
+static void check_pages(QTestState *qts, uint64_t base, int nr, uint8_t seed)
+{
+    g_autofree uint8_t *buf = g_malloc(PAGE_SIZE);
+    int i, j;
+
+    for (i = 0; i < nr; i++) {
+        qtest_memread(qts, base + i * PAGE_SIZE, buf, PAGE_SIZE);
+        for (j = 0; j < PAGE_SIZE; j++) {
+            g_assert_cmphex(buf[j], ==, (uint8_t)(seed + i));
+        }
+    }
+}
+
+static void test_save_load(void)
+{
+    QTestState *qts = snapshot_mem_start();
+
+    fill_pages(qts, TEST_BASE, TEST_PAGES, 0x10);
+    qtest_qmp_assert_success(qts, "{'execute': 'x-snapshot-mem-save'}");
+
+    /* Dirty part of the range, only those pages are copied back */
+    fill_pages(qts, TEST_BASE, TEST_PAGES / 2, 0x80);
+    qtest_writeq(qts, TEST_BASE + (TEST_PAGES - 1) * PAGE_SIZE, 0);
+    qtest_qmp_assert_success(qts, "{'execute': 'x-snapshot-mem-load'}");
+    check_pages(qts, TEST_BASE, TEST_PAGES, 0x10);
+
+    /* The snapshot is kept and can be restored again */
+    fill_pages(qts, TEST_BASE + PAGE_SIZE, 2, 0xc0);
+    qtest_qmp_assert_success(qts, "{'execute': 'x-snapshot-mem-load'}");
+    check_pages(qts, TEST_BASE, TEST_PAGES, 0x10);
+
+    /* Taking a new snapshot replaces the old one */
+    fill_pages(qts, TEST_BASE, TEST_PAGES, 0x40);
+    qtest_qmp_assert_success(qts, "{'execute': 'x-snapshot-mem-save'}");
+    fill_pages(qts, TEST_BASE, TEST_PAGES, 0x50);
+    qtest_qmp_assert_success(qts, "{'execute': 'x-snapshot-mem-load'}");
+    check_pages(qts, TEST_BASE, TEST_PAGES, 0x40);
+
+    qtest_qmp_assert_success(qts, "{'execute': 'x-snapshot-mem-delete'}");
+    qtest_quit(qts);
+}
+
+static void test_errors(void)
+{
+    QTestState *qts = snapshot_mem_start();
+    QDict *rsp;
+
+    rsp = qtest_qmp_assert_failure_ref(qts,
+                                       "{'execute': 'x-snapshot-mem-load'}");
+    qobject_unref(rsp);
+    rsp = qtest_qmp_assert_failure_ref(qts,
+                                       "{'execute': 'x-snapshot-mem-delete'}");
+    qobject_unref(rsp);
+
+    qtest_qmp_assert_success(qts, "{'execute': 'x-snapshot-mem-save'}");
+
+    /* The snapshot owns the migration dirty bitmap */
+    rsp = qtest_qmp_assert_failure_ref(qts,
+                                       "{'execute': 'migrate',"
+                                       " 'arguments': {"
+                                       "   'uri': 'exec:cat > /dev/null' } }");
+    qobject_unref(rsp);
+    rsp = qtest_qmp_assert_failure_ref(qts,
+                                       "{'execute': 'calc-dirty-rate',"
+                                       " 'arguments': {"
+                                       "   'calc-time': 1,"
+                                       "   'mode': 'dirty-bitmap' } }");
+    qobject_unref(rsp);
+
+    /* Once the snapshot is deleted, there is nothing to load */
+    qtest_qmp_assert_success(qts, "{'execute': 'x-snapshot-mem-delete'}");
+    rsp = qtest_qmp_assert_failure_ref(qts,
+                                       "{'execute': 'x-snapshot-mem-load'}");
+    qobject_unref(rsp);
+
+    qtest_quit(qts);
+}
+
+/* Restore latency as a function of the number of dirty pages */
+static void perf_restore(void)
+{
+    QTestState *qts = snapshot_mem_start();
+    static const int dirty_pages[] = { 1, 16, 256, 4096, 16384 };
+    const int rounds = 10;
+    double duration;
+    int i, r;
+
+    qtest_qmp_assert_success(qts, "{'execute': 'x-snapshot-mem-save'}");
+
+    for (i = 0; i < ARRAY_SIZE(dirty_pages); i++) {
+        duration = 0;
+        for (r = 0; r < rounds; r++) {
+            qtest_memset(qts, TEST_BASE, r + 1,
+                         (size_t)dirty_pages[i] * PAGE_SIZE);
+            g_test_timer_start();
+            qtest_qmp_assert_success(qts,
+                                     "{'execute': 'x-snapshot-mem-load'}");
+            duration += g_test_timer_elapsed();
+        }
+        g_test_message("Restore with %d dirty pages: %f ms",
+                       dirty_pages[i], duration * 1000 / rounds);
+    }
+
+    qtest_qmp_assert_success(qts, "{'execute': 'x-snapshot-mem-delete'}");
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/snapshot-mem/save-load", test_save_load);
+    qtest_add_func("/snapshot-mem/errors", test_errors);
+    if (g_test_perf()) {
+        qtest_add_func("/snapshot-mem/perf/restore", perf_restore);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,88 @@
+/*
+ * Test LOCK-prefixed instructions on misaligned operands
+ *
+ * Several threads update counters that are misaligned but do not cross
+ * a cache line, so that QEMU performs the operations with host atomics
+ * instead of stopping the world.  Lost updates show up in the totals.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define NR_THREADS 4
+#define ITERATIONS 100000
+
+static uint8_t line[64] __attribute__((aligned(64)));
+
+#define ADDQ_OFS        1   /* lock addq */
+#define XADDL_OFS       11  /* lock xaddl */
+#define CMPXCHGW_OFS    17  /* lock cmpxchgw loop */
+#define ORB_OFS         30  /* lock orb, one bit per thread */
+
+static void *thread_fn(void *arg)
+{
+    long id = (long)arg;
+    void *q = line + ADDQ_OFS;
+    void *l = line + XADDL_OFS;
+    void *w = line + CMPXCHGW_OFS;
+    uint32_t prev_l = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        uint32_t one = 1;
+        uint16_t old, cmp;
+
+        asm volatile("lock addq $3, (%0)" : : "r"(q) : "memory", "cc");
+
+        asm volatile("lock xaddl %0, (%1)"
+                     : "+r"(one) : "r"(l) : "memory", "cc");
+        /* The old value returned by XADD never goes backwards */
+        assert(i == 0 || one > prev_l);
+        prev_l = one;
+
+        asm volatile("movw (%1), %0" : "=r"(cmp) : "r"(w) : "memory");
+        do {
+            old = cmp;
+            asm volatile("lock cmpxchgw %2, (%1)"
+                         : "+a"(cmp) : "r"(w), "r"((uint16_t)(old + 1))
+                         : "memory", "cc");
+        } while (cmp != old);
+    }
+
+    asm volatile("lock orb %0, (%1)"
+                 : : "r"((uint8_t)(1 << id)), "r"(line + ORB_OFS)
+                 : "memory", "cc");
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[NR_THREADS];
+    uint64_t q;
+    uint32_t l;
+    uint16_t w;
+    long i;
+
+    for (i = 0; i < NR_THREADS; i++) {
+        pthread_create(&threads[i], NULL, thread_fn, (void *)i);
+    }
+    for (i = 0; i < NR_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    __builtin_memcpy(&q, line + ADDQ_OFS, sizeof(q));
+    __builtin_memcpy(&l, line + XADDL_OFS, sizeof(l));
+    __builtin_memcpy(&w, line + CMPXCHGW_OFS, sizeof(w));
+
+    printf("addq %llu xaddl %u cmpxchgw %u orb 0x%x\n",
+           (unsigned long long)q, l, w, line[ORB_OFS]);
+    assert(q == 3ull * NR_THREADS * ITERATIONS);
+    assert(l == NR_THREADS * ITERATIONS);
+    assert(w == (uint16_t)(NR_THREADS * ITERATIONS));
+    assert(line[ORB_OFS] == (1 << NR_THREADS) - 1);
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Dispatch lookups over many I/O port regions
+ *
+ * Counts the isa-debugcon devices that the command line placed at
+ * consecutive ports from 0x1000, then reads them in a scattered order
+ * and alternately from two of them, checking every value and printing
+ * the TSC ticks per access of each pattern.  Also used by
+ * tests/perf/memory/ioport-lookup to measure how lookups scale with
+ * the number of regions.  Without such devices only the unassigned
+ * ports are read.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <minilib.h>
+
+#define FIRST_PORT      0x1000
+#define MAX_PORTS       0x8000
+#define DEBUGCON_VALUE  0xe9  /* default readback of isa-debugcon */
+#define UNASSIGNED      0xff
+#define ACCESSES        100000
+
+static inline uint8_t inb(uint16_t port)
+{
+    uint8_t val;
+
+    asm volatile("inb %1, %0" : "=a"(val) : "Nd"(port));
+    return val;
+}
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static int run(const char *what, unsigned int nr_ports, unsigned int stride,
+               uint8_t expected)
+{
+    uint64_t start, ticks;
+    unsigned int i, port = 0;
+    uint8_t val;
+
+    start = rdtsc();
+    for (i = 0; i < ACCESSES; i++) {
+        val = inb(FIRST_PORT + port);
+        if (val != expected) {
+            ml_printf("FAIL: %s: port 0x%x read 0x%x, expected 0x%x\n",
+                      what, FIRST_PORT + port, val, expected);
+            return 1;
+        }
+        port = (port + stride) % nr_ports;
+    }
+    ticks = rdtsc() - start;
+
+    ml_printf("%s: %ld ticks per access\n",
+              what, (unsigned long)(ticks / ACCESSES));
+    return 0;
+}
+
+int main(void)
+{
+    unsigned int n = 0;
+    uint8_t expected = DEBUGCON_VALUE;
+
+    while (n < MAX_PORTS && inb(FIRST_PORT + n) == DEBUGCON_VALUE) {
+        n++;
+    }
+    ml_printf("%d regions\n", n);
+
+    if (!n) {
+        n = 2;
+        expected = UNASSIGNED;
+    }
+
+    /* A prime stride visits every port before any repeats */
+    if (run("scattered", n, 7919 % n ? 7919 : 1, expected) ||
+        run("alternating", n < 2 ? 1 : 2, 1, expected)) {
+        return 1;
+    }
+
+    ml_printf("PASS\n");
+    return 0;
+}
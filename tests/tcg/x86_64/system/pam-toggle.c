@@ -0,0 +1,92 @@
+/*
+ * Toggle a PAM segment of the i440FX
+ *
+ * Each write to a PAM register is a memory transaction that remaps
+ * 16 KiB below 1 MiB between RAM and the PCI address space.  Check that
+ * RAM keeps its contents across the toggles and that writes in PCI mode
+ * do not reach it, and print the TSC ticks per toggle.  Also used by
+ * tests/perf/memory/pam-toggle to measure the cost of a transaction as
+ * the number of regions grows.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <minilib.h>
+
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/* PAM5 low nibble maps 0xd0000-0xd3fff */
+#define PAM_REG         0x5c
+#define PAM_SEGMENT     0xd0000
+#define PAM_RAM         0x3
+#define PAM_PCI         0x0
+
+#define TOGGLES         10000
+
+static inline void outl(uint16_t port, uint32_t val)
+{
+    asm volatile("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline void outb(uint16_t port, uint8_t val)
+{
+    asm volatile("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port)
+{
+    uint8_t val;
+
+    asm volatile("inb %1, %0" : "=a"(val) : "Nd"(port));
+    return val;
+}
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static uint8_t pam_high;
+
+/* Host bridge, bus 0 device 0 function 0 */
+static void pam_set(uint8_t mode)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (PAM_REG & ~3));
+    outb(PCI_CONFIG_DATA + (PAM_REG & 3), pam_high | mode);
+}
+
+int main(void)
+{
+    /* the mapping changes under the compiler's feet */
+    volatile uint32_t *seg = (volatile uint32_t *)PAM_SEGMENT;
+    uint64_t start, ticks;
+    int i;
+
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (PAM_REG & ~3));
+    pam_high = inb(PCI_CONFIG_DATA + (PAM_REG & 3)) & 0xf0;
+
+    pam_set(PAM_RAM);
+    *seg = 0x12345678;
+
+    start = rdtsc();
+    for (i = 0; i < TOGGLES; i++) {
+        pam_set(PAM_PCI);
+        *seg = i;
+        pam_set(PAM_RAM);
+        if (*seg != 0x12345678) {
+            ml_printf("FAIL: toggle %d: RAM contains 0x%x\n", i, *seg);
+            return 1;
+        }
+    }
+    ticks = rdtsc() - start;
+
+    ml_printf("%d toggles, %ld ticks per toggle\n",
+              TOGGLES, (unsigned long)(ticks / (2 * TOGGLES)));
+    ml_printf("PASS\n");
+    return 0;
+}
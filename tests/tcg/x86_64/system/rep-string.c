@@ -0,0 +1,79 @@
+/*
+ * REP string instructions
+ *
+ * Copies and fills a buffer many times with REP MOVS and REP STOS and
+ * checks the result.  Also used by tests/perf/tcg/icount-rep-string to
+ * compare the speed of icount and plain TCG.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <minilib.h>
+
+#define BUF_SIZE (64 * 1024)
+#define ROUNDS 256
+
+static uint8_t src[BUF_SIZE] __attribute__((aligned(4096)));
+static uint8_t dst[BUF_SIZE] __attribute__((aligned(4096)));
+
+static void rep_movsb(void *d, const void *s, unsigned long n)
+{
+    asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+static void rep_movsq(void *d, const void *s, unsigned long n)
+{
+    asm volatile("rep movsq" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+static void rep_stosb(void *d, uint8_t v, unsigned long n)
+{
+    asm volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(v) : "memory");
+}
+
+static int check(const char *what, unsigned int round)
+{
+    int i;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        if (dst[i] != (uint8_t)i) {
+            ml_printf("FAIL: %s round %d: byte %d is 0x%x, expected 0x%x\n",
+                      what, round, i, dst[i], (uint8_t)i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(void)
+{
+    unsigned int r;
+    int i;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        src[i] = i;
+    }
+
+    /* Only a few rounds are checked, so that the REP loops dominate */
+    for (r = 0; r < ROUNDS; r++) {
+        rep_stosb(dst, r, BUF_SIZE);
+        if (dst[0] != (uint8_t)r || dst[BUF_SIZE - 1] != (uint8_t)r) {
+            ml_printf("FAIL: rep stosb round %d\n", r);
+            return 1;
+        }
+
+        if (r & 1) {
+            rep_movsq(dst, src, BUF_SIZE / 8);
+        } else {
+            rep_movsb(dst, src, BUF_SIZE);
+        }
+        if ((r < 2 || r == ROUNDS - 1) &&
+            check(r & 1 ? "rep movsq" : "rep movsb", r)) {
+            return 1;
+        }
+    }
+
+    ml_printf("PASS\n");
+    return 0;
+}
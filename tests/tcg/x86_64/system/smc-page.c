@@ -0,0 +1,79 @@
+/*
+ * Self-modifying code on pages that lose their last TB
+ *
+ * A TB that straddles two pages is invalidated by a write to its second
+ * page, which leaves the first page without any TB.  Writes to the first
+ * page must then still see code that is translated there later.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <minilib.h>
+
+#define PAGE_SIZE 4096
+
+static uint8_t code[2 * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+typedef uint32_t (*code_fn)(void);
+
+/* mov $imm, %eax; ret */
+static code_fn emit_mov_ret(unsigned int offset, uint32_t imm)
+{
+    volatile uint8_t *p = &code[offset]; /* the guest executes it */
+    int i;
+
+    p[0] = 0xb8;
+    for (i = 0; i < 4; i++) {
+        p[1 + i] = imm >> (i * 8);
+    }
+    p[5] = 0xc3;
+    return (code_fn)&code[offset];
+}
+
+static int check(const char *what, code_fn fn, uint32_t expected)
+{
+    uint32_t ret = fn();
+
+    if (ret != expected) {
+        ml_printf("FAIL: %s: got 0x%x, expected 0x%x\n", what, ret, expected);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    volatile uint8_t *data = code; /* the stores must not be elided */
+    code_fn straddle, fn;
+    int err = 0;
+    int i;
+
+    /* The immediate spans both pages */
+    straddle = emit_mov_ret(PAGE_SIZE - 3, 0x11223344);
+    err |= check("straddling TB", straddle, 0x11223344);
+
+    /* Invalidate it from the second page, the first one has no TB left */
+    code[PAGE_SIZE] = 0x55;
+    err |= check("second page modified", straddle, 0x11553344);
+    code[PAGE_SIZE] = 0x66;
+
+    /* Data writes to the first page, then new code there */
+    for (i = 0; i < 256; i++) {
+        data[64 + i] = i;
+    }
+    fn = emit_mov_ret(0, 0xcafe);
+    err |= check("new code on first page", fn, 0xcafe);
+    emit_mov_ret(0, 0xbeef);
+    err |= check("first page modified", fn, 0xbeef);
+
+    /* And the straddling TB from the first page's side */
+    err |= check("straddling TB again", straddle, 0x11663344);
+    code[PAGE_SIZE - 2] = 0x77;
+    err |= check("first page of straddling TB modified", straddle, 0x11663377);
+
+    if (!err) {
+        ml_printf("PASS\n");
+    }
+    return err;
+}
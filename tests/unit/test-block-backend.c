@@ -27,6 +27,7 @@
 #include "system/block-backend.h"
 #include "qapi/error.h"
 #include "qemu/main-loop.h"
+#include "qobject/qdict.h"
 
 static void test_drain_aio_error_flush_cb(void *opaque, int ret)
 {
@@ -70,6 +71,164 @@ static void test_drain_all_aio_error(void)
     blk_unref(blk);
 }
 
+static void test_merge_cb(void *opaque, int ret)
+{
+    int *completed = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    (*completed)++;
+}
+
+static void test_merge_requests(void)
+{
+    QDict *opts = qdict_new();
+    BlockBackend *blk;
+    QEMUIOVector qiov[5];
+    uint8_t buf[5][4096];
+    int completed = 0;
+    int i;
+
+    qdict_put_str(opts, "driver", "null-co");
+    qdict_put_int(opts, "size", 1024 * 1024);
+    blk = blk_new_open(NULL, NULL, opts, BDRV_O_RDWR, &error_abort);
+    blk_set_request_merging(blk, true, 0);
+
+    /* Four adjacent requests in reverse order, and one that isn't adjacent */
+    for (i = 0; i < 4; i++) {
+        qemu_iovec_init_buf(&qiov[i], buf[i], sizeof(buf[i]));
+        blk_aio_preadv(blk, (3 - i) * 4096, &qiov[i], 0, test_merge_cb,
+                       &completed);
+    }
+    qemu_iovec_init_buf(&qiov[4], buf[4], sizeof(buf[4]));
+    blk_aio_preadv(blk, 65536, &qiov[4], 0, test_merge_cb, &completed);
+    g_assert_cmpint(completed, ==, 0);
+
+    while (completed < 5) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_READ], ==, 3);
+
+    /* Writes are not merged with reads */
+    blk_aio_preadv(blk, 0, &qiov[0], 0, test_merge_cb, &completed);
+    blk_aio_pwritev(blk, 4096, &qiov[1], 0, test_merge_cb, &completed);
+    blk_aio_pwritev(blk, 8192, &qiov[2], 0, test_merge_cb, &completed);
+    while (completed < 8) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_READ], ==, 3);
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_WRITE], ==, 1);
+
+    /*
+     * A read after a write submits the write before it, and the write
+     * completes without running its callback from blk_aio_preadv()
+     */
+    blk_aio_pwritev(blk, 0, &qiov[0], 0, test_merge_cb, &completed);
+    blk_aio_preadv(blk, 4096, &qiov[1], 0, test_merge_cb, &completed);
+    g_assert_cmpint(completed, ==, 8);
+    blk_aio_pwritev(blk, 4096, &qiov[2], 0, test_merge_cb, &completed);
+    while (completed < 11) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_READ], ==, 3);
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_WRITE], ==, 1);
+
+    blk_unref(blk);
+}
+
+static BlockBackend *test_merge_open_file(char **path)
+{
+    QDict *opts = qdict_new();
+    BlockBackend *blk;
+    int fd;
+
+    fd = g_file_open_tmp("qemu-test-merge.XXXXXX", path, NULL);
+    g_assert(fd >= 0);
+    g_assert(ftruncate(fd, 1024 * 1024) == 0);
+    close(fd);
+
+    qdict_put_str(opts, "driver", "file");
+    qdict_put_str(opts, "filename", *path);
+    blk = blk_new_open(NULL, NULL, opts, BDRV_O_RDWR, &error_abort);
+    blk_set_request_merging(blk, true, 0);
+    return blk;
+}
+
+static void test_merge_requests_data(void)
+{
+    g_autofree char *path = NULL;
+    BlockBackend *blk = test_merge_open_file(&path);
+    QEMUIOVector qiov[4];
+    uint8_t buf[4][4096];
+    uint8_t expected[4096];
+    int completed = 0;
+    int i;
+
+    /* Merged writes must put each buffer at its own offset */
+    for (i = 0; i < 4; i++) {
+        memset(buf[i], 0x10 + i, sizeof(buf[i]));
+        qemu_iovec_init_buf(&qiov[i], buf[i], sizeof(buf[i]));
+        blk_aio_pwritev(blk, (3 - i) * 4096, &qiov[i], 0, test_merge_cb,
+                        &completed);
+    }
+    while (completed < 4) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_WRITE], ==, 3);
+
+    /* And merged reads must return it from there */
+    memset(buf, 0, sizeof(buf));
+    for (i = 0; i < 4; i++) {
+        blk_aio_preadv(blk, i * 4096, &qiov[i], 0, test_merge_cb, &completed);
+    }
+    while (completed < 8) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_READ], ==, 3);
+
+    for (i = 0; i < 4; i++) {
+        memset(expected, 0x10 + 3 - i, sizeof(expected));
+        g_assert(memcmp(buf[i], expected, sizeof(expected)) == 0);
+    }
+
+    blk_unref(blk);
+    unlink(path);
+}
+
+static void test_merge_requests_drain(void)
+{
+    g_autofree char *path = NULL;
+    BlockBackend *blk = test_merge_open_file(&path);
+    QEMUIOVector qiov[4];
+    uint8_t buf[4][4096];
+    int completed = 0;
+    int i;
+
+    /* Draining submits the held back requests and waits for them */
+    blk_set_request_merging(blk, true, NANOSECONDS_PER_SECOND * 3600);
+    for (i = 0; i < 4; i++) {
+        qemu_iovec_init_buf(&qiov[i], buf[i], sizeof(buf[i]));
+        blk_aio_preadv(blk, i * 4096, &qiov[i], 0, test_merge_cb, &completed);
+    }
+    g_assert_cmpint(completed, ==, 0);
+
+    blk_drain(blk);
+    g_assert_cmpint(completed, ==, 4);
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_READ], ==, 3);
+
+    /* Requests submitted in a drained section are not held back */
+    bdrv_drained_begin(blk_bs(blk));
+    blk_aio_preadv(blk, 0, &qiov[0], 0, test_merge_cb, &completed);
+    blk_aio_preadv(blk, 4096, &qiov[1], 0, test_merge_cb, &completed);
+    bdrv_drained_end(blk_bs(blk));
+    while (completed < 6) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_READ], ==, 3);
+
+    blk_unref(blk);
+    unlink(path);
+}
+
 int main(int argc, char **argv)
 {
     bdrv_init();
@@ -80,6 +239,11 @@ int main(int argc, char **argv)
     g_test_add_func("/block-backend/drain_aio_error", test_drain_aio_error);
     g_test_add_func("/block-backend/drain_all_aio_error",
                     test_drain_all_aio_error);
+    g_test_add_func("/block-backend/merge_requests", test_merge_requests);
+    g_test_add_func("/block-backend/merge_requests_data",
+                    test_merge_requests_data);
+    g_test_add_func("/block-backend/merge_requests_drain",
+                    test_merge_requests_drain);
 
     return g_test_run();
 }
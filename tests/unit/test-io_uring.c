@@ -0,0 +1,212 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * block/io_uring.c registered files and fixed buffers
+ *
+ * Registration is best effort, so these tests cannot tell whether a
+ * request really used IOSQE_FIXED_FILE or READ_FIXED/WRITE_FIXED.  They
+ * check that data goes to the right place whichever path is taken, with
+ * the file and buffers registered, unregistered, or registered more than
+ * once, and with requests that cannot use the registered buffers.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/iov.h"
+#include "qemu/units.h"
+#include "block/aio.h"
+#include "block/raw-aio.h"
+
+#define FILE_SIZE (64 * KiB)
+#define BUF_SIZE (16 * KiB)
+
+typedef struct {
+    int fd;
+    uint64_t offset;
+    QEMUIOVector *qiov;
+    int type;
+    BdrvRequestFlags flags;
+    int ret;
+    bool done;
+} IoRequest;
+
+static AioContext *ctx;
+static int test_fd = -1;
+static bool have_io_uring;
+
+static void coroutine_fn io_co(void *opaque)
+{
+    IoRequest *req = opaque;
+
+    req->ret = luring_co_submit(NULL, req->fd, req->offset, req->qiov,
+                                req->type, req->flags);
+    req->done = true;
+}
+
+static int do_io(uint64_t offset, QEMUIOVector *qiov, int type,
+                 BdrvRequestFlags flags)
+{
+    IoRequest req = {
+        .fd = test_fd,
+        .offset = offset,
+        .qiov = qiov,
+        .type = type,
+        .flags = flags,
+    };
+
+    aio_co_enter(ctx, qemu_coroutine_create(io_co, &req));
+    while (!req.done) {
+        aio_poll(ctx, true);
+    }
+    return req.ret;
+}
+
+static int do_io_buf(uint64_t offset, void *buf, size_t len, int type,
+                     BdrvRequestFlags flags)
+{
+    QEMUIOVector qiov;
+
+    qemu_iovec_init_buf(&qiov, buf, len);
+    return do_io(offset, &qiov, type, flags);
+}
+
+/* Write @len bytes of @pattern from @wbuf and read them back into @rbuf */
+static void check_rw(uint64_t offset, uint8_t *wbuf, uint8_t *rbuf,
+                     size_t len, uint8_t pattern, BdrvRequestFlags flags)
+{
+    memset(wbuf, pattern, len);
+    memset(rbuf, ~pattern, len);
+
+    g_assert_cmpint(do_io_buf(offset, wbuf, len, QEMU_AIO_WRITE, flags),
+                    ==, 0);
+    g_assert_cmpint(do_io_buf(offset, rbuf, len, QEMU_AIO_READ, flags),
+                    ==, 0);
+    g_assert(!memcmp(wbuf, rbuf, len));
+
+    /* Check the file too, in case both requests used the wrong address */
+    memset(rbuf, ~pattern, len);
+    g_assert_cmpint(pread(test_fd, rbuf, len, offset), ==, len);
+    g_assert(!memcmp(wbuf, rbuf, len));
+}
+
+static void test_registered_file(void)
+{
+    g_autofree uint8_t *wbuf = g_malloc(BUF_SIZE);
+    g_autofree uint8_t *rbuf = g_malloc(BUF_SIZE);
+
+    if (!have_io_uring) {
+        g_test_skip("io_uring is not available");
+        return;
+    }
+
+    check_rw(0, wbuf, rbuf, BUF_SIZE, 0x11, 0);
+
+    luring_register_file(test_fd);
+    check_rw(BUF_SIZE, wbuf, rbuf, BUF_SIZE, 0x22, 0);
+    g_assert_cmpint(do_io(0, NULL, QEMU_AIO_FLUSH, 0), ==, 0);
+
+    /* Reads past the end of the file are padded with zeroes */
+    memset(rbuf, 0xff, BUF_SIZE);
+    g_assert_cmpint(do_io_buf(FILE_SIZE - BUF_SIZE / 2, rbuf, BUF_SIZE,
+                              QEMU_AIO_READ, 0), ==, 0);
+    g_assert(buffer_is_zero(rbuf + BUF_SIZE / 2, BUF_SIZE / 2));
+
+    luring_unregister_file(test_fd);
+    check_rw(2 * BUF_SIZE, wbuf, rbuf, BUF_SIZE, 0x33, 0);
+}
+
+static void test_fixed_buffers(void)
+{
+    size_t size = 4 * BUF_SIZE;
+    uint8_t *bufs;
+    g_autofree uint8_t *plain = g_malloc(BUF_SIZE);
+    struct iovec iov[2];
+    QEMUIOVector qiov;
+
+    if (!have_io_uring) {
+        g_test_skip("io_uring is not available");
+        return;
+    }
+
+    bufs = qemu_memalign(qemu_real_host_page_size(), size);
+
+    luring_register_file(test_fd);
+    luring_register_buf(bufs, size);
+
+    /* Both requests inside the registered buffer */
+    check_rw(0, bufs, bufs + BUF_SIZE, BUF_SIZE, 0x44,
+             BDRV_REQ_REGISTERED_BUF);
+
+    /* Unaligned length in the middle of the buffer */
+    check_rw(4096, bufs + 2 * BUF_SIZE + 512, bufs + 512, 1000, 0x55,
+             BDRV_REQ_REGISTERED_BUF);
+
+    /* The last bytes of the buffer */
+    check_rw(BUF_SIZE, bufs + size - 512, bufs, 512, 0x66,
+             BDRV_REQ_REGISTERED_BUF);
+
+    /* A short fixed read is resubmitted, then padded with zeroes */
+    memset(bufs, 0xff, BUF_SIZE);
+    g_assert_cmpint(do_io_buf(FILE_SIZE - BUF_SIZE / 2, bufs, BUF_SIZE,
+                              QEMU_AIO_READ, BDRV_REQ_REGISTERED_BUF), ==, 0);
+    g_assert(buffer_is_zero(bufs + BUF_SIZE / 2, BUF_SIZE / 2));
+
+    /* Write from a registered buffer, read into one that is not */
+    check_rw(2 * BUF_SIZE, bufs, plain, BUF_SIZE, 0x77,
+             BDRV_REQ_REGISTERED_BUF);
+
+    /* More than one iovec cannot use a fixed buffer */
+    memset(bufs, 0x88, BUF_SIZE);
+    iov[0] = (struct iovec) { bufs, BUF_SIZE / 2 };
+    iov[1] = (struct iovec) { bufs + 3 * BUF_SIZE, BUF_SIZE / 2 };
+    memset(iov[1].iov_base, 0x88, BUF_SIZE / 2);
+    qemu_iovec_init_external(&qiov, iov, 2);
+    g_assert_cmpint(do_io(0, &qiov, QEMU_AIO_WRITE, BDRV_REQ_REGISTERED_BUF),
+                    ==, 0);
+    g_assert_cmpint(pread(test_fd, plain, BUF_SIZE, 0), ==, BUF_SIZE);
+    g_assert(!memcmp(plain, bufs, BUF_SIZE));
+
+    /* Registering again takes a reference */
+    luring_register_buf(bufs, size);
+    luring_unregister_buf(bufs, size);
+    check_rw(BUF_SIZE, bufs, bufs + BUF_SIZE, BUF_SIZE, 0x99,
+             BDRV_REQ_REGISTERED_BUF);
+
+    luring_unregister_buf(bufs, size);
+    check_rw(0, bufs, bufs + BUF_SIZE, BUF_SIZE, 0xaa,
+             BDRV_REQ_REGISTERED_BUF);
+
+    /* A registered buffer with a file that is not */
+    luring_register_buf(bufs, size);
+    luring_unregister_file(test_fd);
+    check_rw(0, bufs, bufs + BUF_SIZE, BUF_SIZE, 0xbb,
+             BDRV_REQ_REGISTERED_BUF);
+    luring_unregister_buf(bufs, size);
+
+    qemu_vfree(bufs);
+}
+
+int main(int argc, char **argv)
+{
+    g_autofree char *path = NULL;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    ctx = aio_context_new(&error_abort);
+    qemu_set_current_aio_context(ctx);
+    have_io_uring = aio_setup_linux_io_uring(ctx, NULL) != NULL;
+
+    test_fd = g_file_open_tmp("test-io_uring-XXXXXX", &path, NULL);
+    g_assert(test_fd >= 0);
+    unlink(path);
+    g_assert(ftruncate(test_fd, FILE_SIZE) == 0);
+
+    g_test_add_func("/io_uring/registered-file", test_registered_file);
+    g_test_add_func("/io_uring/fixed-buffers", test_fixed_buffers);
+    ret = g_test_run();
+
+    close(test_fd);
+    aio_context_unref(ctx);
+    return ret;
+}
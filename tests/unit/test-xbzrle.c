@@ -173,6 +173,55 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_PAGES 100
+
+static void test_encode_accel(void)
+{
+    uint8_t *old_page = g_malloc0(XBZRLE_PAGE_SIZE);
+    uint8_t *new_pages = g_malloc0(XBZRLE_PAGE_SIZE * ACCEL_PAGES);
+    uint8_t *ref = g_malloc(XBZRLE_PAGE_SIZE * ACCEL_PAGES);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    int ref_len[ACCEL_PAGES];
+    bool first = true;
+    int i, j;
+
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        uint8_t *page = new_pages + i * XBZRLE_PAGE_SIZE;
+
+        for (j = g_test_rand_int_range(0, 64); j > 0; j--) {
+            int off = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+            int len = g_test_rand_int_range(1, 48);
+
+            memset(page + off, j, MIN(len, XBZRLE_PAGE_SIZE - off));
+        }
+    }
+
+    /* Every implementation must produce the same stream as the best one */
+    do {
+        for (i = 0; i < ACCEL_PAGES; i++) {
+            int dlen = xbzrle_encode_buffer(old_page,
+                                            new_pages + i * XBZRLE_PAGE_SIZE,
+                                            XBZRLE_PAGE_SIZE,
+                                            compressed, XBZRLE_PAGE_SIZE);
+
+            if (first) {
+                ref_len[i] = dlen;
+                memcpy(ref + i * XBZRLE_PAGE_SIZE, compressed, MAX(dlen, 0));
+            } else {
+                g_assert_cmpint(dlen, ==, ref_len[i]);
+                g_assert(memcmp(ref + i * XBZRLE_PAGE_SIZE, compressed,
+                                MAX(dlen, 0)) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_page);
+    g_free(new_pages);
+    g_free(ref);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +234,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* Must be last: leaves the slowest encoder selected */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -267,7 +267,8 @@ bool aio_prepare(AioContext *ctx)
     poll_set_started(ctx, &ready_list, false);
     /* TODO what to do with this list? */
 
-    return false;
+    /* Left over by fdmon_io_uring_destroy(), dispatch them right away */
+    return fdmon_io_uring_pending(ctx);
 }
 
 bool aio_pending(AioContext *ctx)
@@ -279,6 +280,10 @@ bool aio_pending(AioContext *ctx)
      * We have to walk very carefully in case aio_set_fd_handler is
      * called while we're walking.
      */
+    if (fdmon_io_uring_pending(ctx)) {
+        return true;
+    }
+
     qemu_lockcnt_inc(&ctx->list_lock);
 
     QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
@@ -435,6 +440,7 @@ void aio_dispatch(AioContext *ctx)
     qemu_lockcnt_inc(&ctx->list_lock);
     aio_bh_poll(ctx);
     aio_dispatch_handlers(ctx);
+    fdmon_io_uring_dispatch(ctx);
     aio_free_deleted_handlers(ctx);
     qemu_lockcnt_dec(&ctx->list_lock);
 
@@ -745,6 +751,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     progress |= aio_bh_poll(ctx);
     progress |= aio_dispatch_ready_handlers(ctx, &ready_list, block_ns);
+    progress |= fdmon_io_uring_dispatch(ctx);
 
     aio_free_deleted_handlers(ctx);
 
@@ -69,6 +69,13 @@ static inline void fdmon_epoll_disable(AioContext *ctx)
 #ifdef CONFIG_LINUX_IO_URING
 bool fdmon_io_uring_setup(AioContext *ctx);
 void fdmon_io_uring_destroy(AioContext *ctx);
+bool fdmon_io_uring_dispatch(AioContext *ctx);
+
+/* Are there completed aio_add_sqe() requests waiting for dispatch? */
+static inline bool fdmon_io_uring_pending(AioContext *ctx)
+{
+    return !QSIMPLEQ_EMPTY(&ctx->cqe_handler_ready_list);
+}
 #else
 static inline bool fdmon_io_uring_setup(AioContext *ctx)
 {
@@ -78,6 +85,16 @@ static inline bool fdmon_io_uring_setup(AioContext *ctx)
 static inline void fdmon_io_uring_destroy(AioContext *ctx)
 {
 }
+
+static inline bool fdmon_io_uring_dispatch(AioContext *ctx)
+{
+    return false;
+}
+
+static inline bool fdmon_io_uring_pending(AioContext *ctx)
+{
+    return false;
+}
 #endif /* !CONFIG_LINUX_IO_URING */
 
 #endif /* AIO_POSIX_H */
@@ -19,9 +19,12 @@
  * 4. Nanosecond timeouts are supported so it requires fewer syscalls than
  *    epoll(7).
  *
- * This code only monitors file descriptors and does not do asynchronous disk
- * I/O.  Implementing disk I/O efficiently has other requirements and should
- * use a separate io_uring so it does not make sense to unify the code.
+ * Other requests, for example disk I/O from block/io_uring.c, can be added to
+ * the same ring with aio_add_sqe().  They are submitted together with the
+ * file descriptor monitoring changes and the timeout, so an event loop
+ * iteration that both waits for events and issues I/O takes one syscall.
+ * Their completions are dispatched from aio_poll() through CqeHandler
+ * callbacks.
  *
  * File descriptor monitoring is implemented using the following operations:
  *
@@ -38,7 +41,8 @@
  * the "cq ring".  Ring entries are called "sqe" and "cqe", respectively.
  *
  * The code is structured so that sq/cq rings are only modified within
- * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
+ * fdmon_io_uring_wait() and aio_add_sqe(), both of which run in the
+ * AioContext's thread.  Changes to AioHandlers are made by enqueuing them on
  * ctx->submit_list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
  * and/or IORING_OP_POLL_REMOVE sqes for them.
  */
@@ -55,6 +59,9 @@ enum {
     FDMON_IO_URING_PENDING  = (1 << 0),
     FDMON_IO_URING_ADD      = (1 << 1),
     FDMON_IO_URING_REMOVE   = (1 << 2),
+
+    /* Tag in the user_data of sqes added with aio_add_sqe() */
+    FDMON_IO_URING_CQE_HANDLER = (1 << 0),
 };
 
 static inline int poll_events_from_pfd(int pfd_events)
@@ -75,7 +82,7 @@ static inline int pfd_events_from_poll(int poll_events)
 
 /*
  * Returns an sqe for submitting a request.  Only be called within
- * fdmon_io_uring_wait().
+ * fdmon_io_uring_wait() or aio_add_sqe().
  */
 static struct io_uring_sqe *get_sqe(AioContext *ctx)
 {
@@ -226,14 +233,27 @@ static bool process_cqe(AioContext *ctx,
                         AioHandlerList *ready_list,
                         struct io_uring_cqe *cqe)
 {
-    AioHandler *node = io_uring_cqe_get_data(cqe);
+    uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+    AioHandler *node;
     unsigned flags;
 
     /* poll_timeout and poll_remove have a zero user_data field */
-    if (!node) {
+    if (!data) {
         return false;
     }
 
+    if (data & FDMON_IO_URING_CQE_HANDLER) {
+        CqeHandler *cqe_handler =
+            (CqeHandler *)(data & ~(uintptr_t)FDMON_IO_URING_CQE_HANDLER);
+
+        cqe_handler->cqe = *cqe;
+        QSIMPLEQ_INSERT_TAIL(&ctx->cqe_handler_ready_list, cqe_handler, next);
+        ctx->cqe_handler_inflight--;
+        return true;
+    }
+
+    node = (AioHandler *)data;
+
     /*
      * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
      * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
@@ -321,10 +341,83 @@ static const FDMonOps fdmon_io_uring_ops = {
     .need_wait = fdmon_io_uring_need_wait,
 };
 
+bool aio_has_io_uring(AioContext *ctx)
+{
+    return ctx->fdmon_ops == &fdmon_io_uring_ops;
+}
+
+void aio_add_sqe(AioContext *ctx,
+                 void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
+                 void *opaque, CqeHandler *cqe_handler)
+{
+    struct io_uring_sqe *sqe;
+
+    assert(aio_has_io_uring(ctx));
+    assert(!((uintptr_t)cqe_handler & FDMON_IO_URING_CQE_HANDLER));
+
+    sqe = get_sqe(ctx);
+    prep_sqe(sqe, opaque);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)cqe_handler |
+                                        FDMON_IO_URING_CQE_HANDLER));
+    ctx->cqe_handler_inflight++;
+}
+
+/* Invoke the callbacks of completed aio_add_sqe() requests */
+bool fdmon_io_uring_dispatch(AioContext *ctx)
+{
+    CqeHandlerSimpleQ *ready_list = &ctx->cqe_handler_ready_list;
+    CqeHandler *cqe_handler;
+    bool progress = false;
+
+    /* Callbacks may run nested aio_poll(), so dequeue before calling them */
+    while ((cqe_handler = QSIMPLEQ_FIRST(ready_list))) {
+        QSIMPLEQ_REMOVE_HEAD(ready_list, next);
+        cqe_handler->cb(cqe_handler);
+        progress = true;
+    }
+
+    return progress;
+}
+
+/*
+ * Wait for the requests added with aio_add_sqe() before the ring goes away.
+ * Their callbacks stay on ctx->cqe_handler_ready_list and are run by the
+ * next aio_poll() or aio_dispatch().
+ */
+static void fdmon_io_uring_drain(AioContext *ctx)
+{
+    AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
+    AioHandler *node;
+    int ret;
+
+    if (!ctx->cqe_handler_inflight) {
+        return;
+    }
+
+    while (ctx->cqe_handler_inflight) {
+        do {
+            ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring, 1);
+        } while (ret == -EINTR);
+
+        assert(ret >= 0);
+        process_cq_ring(ctx, &ready_list);
+    }
+
+    /* The next fdmon implementation polls these file descriptors again */
+    while ((node = QLIST_FIRST(&ready_list))) {
+        QLIST_REMOVE(node, node_ready);
+    }
+
+    aio_notify(ctx);
+}
+
 bool fdmon_io_uring_setup(AioContext *ctx)
 {
     int ret;
 
+    QSIMPLEQ_INIT(&ctx->cqe_handler_ready_list);
+    ctx->cqe_handler_inflight = 0;
+
     ret = io_uring_queue_init(FDMON_IO_URING_ENTRIES, &ctx->fdmon_io_uring, 0);
     if (ret != 0) {
         return false;
@@ -340,6 +433,7 @@ void fdmon_io_uring_destroy(AioContext *ctx)
     if (ctx->fdmon_ops == &fdmon_io_uring_ops) {
         AioHandler *node;
 
+        fdmon_io_uring_drain(ctx);
         io_uring_queue_exit(&ctx->fdmon_io_uring);
 
         /* Move handlers due to be removed onto the deleted list */